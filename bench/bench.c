@@ -0,0 +1,1079 @@
+/*
+ * PS2VMC Tool - PS2 Virtual Memory Card Tool by Bucanero
+ *
+ * mcio benchmarks
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+
+/* white-box build: the benchmarks poke at the static Card_* helpers */
+#include "src/mcio.c"
+
+#define BENCH_CARDSIZE		(8 * 1024 * 1024)
+#define BENCH_TRACELEN		(1 << 18)
+
+#define countof(a)		(sizeof(a) / sizeof(a[0]))
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/* build a freshly formatted card with 1KB clusters and 8KB erase blocks, no spare data */
+static void bench_mkcard(uint8_t *vmc, size_t size, uint8_t cardflags)
+{
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)vmc;
+	struct MCFsEntry *fse;
+	uint32_t clusters = size / MCIO_CLUSTERSIZE;
+	uint32_t fat_len = ((clusters * 4) - 1) / MCIO_CLUSTERSIZE + 1;
+	uint32_t ifc_len = ((fat_len * 4) - 1) / MCIO_CLUSTERSIZE + 1;
+	uint32_t alloc_offset = 8 + ifc_len + fat_len;
+	uint32_t blocks = clusters / 8;
+	uint32_t alloc_end = (blocks - 2) * 8 - alloc_offset;
+	uint32_t i;
+
+	memset(vmc, 0xFF, size);
+	memset(vmc, 0, 340);
+	memcpy(mcdi->magic, SUPERBLOCK_MAGIC, 28);
+	memcpy(mcdi->version, SUPERBLOCK_VERSION, 12);
+	append_le_uint16((uint8_t *)&mcdi->pagesize, 512);
+	append_le_uint16((uint8_t *)&mcdi->pages_per_cluster, 2);
+	append_le_uint16((uint8_t *)&mcdi->blocksize, 16);
+	append_le_uint16((uint8_t *)&mcdi->unused, 0xFF00);
+	append_le_uint32((uint8_t *)&mcdi->clusters_per_card, clusters);
+	append_le_uint32((uint8_t *)&mcdi->alloc_offset, alloc_offset);
+	append_le_uint32((uint8_t *)&mcdi->alloc_end, alloc_end);
+	append_le_uint32((uint8_t *)&mcdi->rootdir_cluster, 0);
+	append_le_uint32((uint8_t *)&mcdi->backup_block1, blocks - 1);
+	append_le_uint32((uint8_t *)&mcdi->backup_block2, blocks - 2);
+	for (i = 0; i < 32; i++) {
+		append_le_uint32((uint8_t *)&mcdi->ifc_list[i], (i < ifc_len) ? 8 + i : 0);
+		append_le_uint32((uint8_t *)&mcdi->bad_block_list[i], -1);
+	}
+	mcdi->cardtype = sceMcTypePS2;
+	mcdi->cardflags = cardflags;
+	append_le_uint32((uint8_t *)&mcdi->clusters_per_block, 8);
+
+	for (i = 0; i < fat_len; i++)
+		append_le_uint32(&vmc[((8 + (i / 256)) * MCIO_CLUSTERSIZE) + ((i % 256) * 4)], 8 + ifc_len + i);
+
+	for (i = 0; i < alloc_end; i++)
+		append_le_uint32(&vmc[((8 + ifc_len + (i / 256)) * MCIO_CLUSTERSIZE) + ((i % 256) * 4)], (i == 0) ? 0xFFFFFFFF : 0x7FFFFFFF);
+
+	/* root directory: "." and ".." */
+	fse = (struct MCFsEntry *)&vmc[alloc_offset * MCIO_CLUSTERSIZE];
+	memset(fse, 0, MCIO_CLUSTERSIZE);
+	append_le_uint16((uint8_t *)&fse[0].mode, sceMcFileAttrReadable | sceMcFileAttrWriteable | sceMcFileAttrExecutable | sceMcFileAttrSubdir | sceMcFile0400 | sceMcFileAttrExists);
+	append_le_uint32((uint8_t *)&fse[0].length, 2);
+	fse[0].name[0] = '.';
+	append_le_uint16((uint8_t *)&fse[1].mode, sceMcFileAttrWriteable | sceMcFileAttrExecutable | sceMcFileAttrSubdir | sceMcFile0400 | sceMcFileAttrExists | sceMcFileAttrHidden);
+	fse[1].name[0] = '.';
+	fse[1].name[1] = '.';
+}
+
+/* fixture setup cannot fail half way, any error ends the run */
+static void *bench_malloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if (p == NULL) {
+		printf("Error: out of memory\n");
+		exit(1);
+	}
+
+	return p;
+}
+
+static mcio_ctx_t *bench_mount(uint8_t *vmc, size_t size, int cache_size, int commit_mode)
+{
+	mcio_ctx_t *ctx = mcio_alloc();
+
+	if (ctx == NULL) {
+		printf("Error: out of memory\n");
+		exit(1);
+	}
+
+	mcio_setCacheSize(ctx, cache_size);
+	mcio_setCommitMode(ctx, commit_mode);
+	if (mcio_init(ctx, vmc, size) != sceMcResSucceed) {
+		printf("Error: synthetic card not detected\n");
+		exit(1);
+	}
+
+	return ctx;
+}
+
+/* a freshly formatted card with the default cache and commit mode */
+static mcio_ctx_t *bench_newcard(uint8_t *vmc, size_t size)
+{
+	bench_mkcard(vmc, size, 0x52); /* same flags as a PCSX2 formatted card */
+
+	return bench_mount(vmc, size, MIN_CACHEENTRY, MCIO_COMMIT_BACKUP);
+}
+
+/* ---- cluster cache ------------------------------------------------------- */
+
+/* the fixed 36 entry cache mcio used before: linear scan plus array shift on every hit */
+struct LegacyCache {
+	int size;
+	uint8_t *cachebuf;
+	struct MCCacheEntry *entrycache;
+	struct MCCacheEntry **mccache;
+};
+
+static void legacy_init(struct LegacyCache *lc, int size)
+{
+	int i;
+
+	lc->size = size;
+	lc->cachebuf = calloc(size, MCIO_CLUSTERSIZE);
+	lc->entrycache = calloc(size, sizeof(struct MCCacheEntry));
+	lc->mccache = calloc(size, sizeof(struct MCCacheEntry *));
+
+	for (i = 0; i < size; i++) {
+		lc->entrycache[i].cl_data = lc->cachebuf + (i * MCIO_CLUSTERSIZE);
+		lc->entrycache[i].cluster = -1;
+		lc->mccache[i] = &lc->entrycache[size - 1 - i];
+	}
+}
+
+static void legacy_free(struct LegacyCache *lc)
+{
+	free(lc->cachebuf);
+	free(lc->entrycache);
+	free(lc->mccache);
+}
+
+static struct MCCacheEntry *legacy_read(struct LegacyCache *lc, const uint8_t *vmc, int32_t cluster, int *hit)
+{
+	struct MCCacheEntry *mce = NULL;
+	int i;
+
+	for (i = 0; i < lc->size; i++) {
+		if (lc->entrycache[i].cluster == cluster) {
+			mce = &lc->entrycache[i];
+			break;
+		}
+	}
+
+	*hit = (mce != NULL);
+	if (mce == NULL) {
+		mce = lc->mccache[lc->size - 1];
+		mce->cluster = cluster;
+		memcpy(mce->cl_data, &vmc[cluster * MCIO_CLUSTERSIZE], MCIO_CLUSTERSIZE);
+	}
+
+	for (i = 0; lc->mccache[i] != mce; i++)
+		;
+	memmove(&lc->mccache[1], &lc->mccache[0], i * sizeof(struct MCCacheEntry *));
+	lc->mccache[0] = mce;
+
+	return mce;
+}
+
+static uint32_t bench_rand(uint32_t *seed)
+{
+	*seed = (*seed * 1103515245) + 12345;
+	return (*seed >> 8) & 0xFFFFFF;
+}
+
+/*
+ * "fs": what a file copy looks like to the cache, a hot set of FAT/directory
+ *       clusters interleaved with a sequential walk through file data.
+ * "random": uniform reads over a 2048 cluster working set.
+ */
+static void bench_trace(int32_t *trace, int len, const char *kind, uint32_t first, uint32_t last)
+{
+	uint32_t seed = 0x5eed;
+	uint32_t span = last - first;
+	uint32_t pos = 0;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (strcmp(kind, "fs") == 0) {
+			if (bench_rand(&seed) % 10 < 3)
+				trace[i] = 8 + (bench_rand(&seed) % 48);
+			else
+				trace[i] = first + (pos++ % span);
+		}
+		else
+			trace[i] = first + (bench_rand(&seed) % 2048);
+	}
+}
+
+static void bench_cache(void)
+{
+	static const int capacities[] = { 36, 256, 2048, 0 };
+	static const char *traces[] = { "fs", "random" };
+	uint8_t *vmc = bench_malloc(BENCH_CARDSIZE);
+	int32_t *trace = bench_malloc(BENCH_TRACELEN * sizeof(int32_t));
+	struct MCCacheEntry *mce;
+	mcio_ctx_t *ctx;
+	int t, c, i, hit, hits;
+	double start, elapsed;
+
+	bench_mkcard(vmc, BENCH_CARDSIZE, 0x52);
+
+	printf("%-8s %-8s %8s %10s %10s\n", "trace", "cache", "entries", "hit %", "ns/lookup");
+
+	for (t = 0; t < (int)countof(traces); t++) {
+		bench_trace(trace, BENCH_TRACELEN, traces[t], 0x29, 0x1F00);
+
+		for (c = 0; c < (int)countof(capacities); c++) {
+			struct LegacyCache lc;
+			int size = capacities[c] ? capacities[c] : BENCH_CARDSIZE / MCIO_CLUSTERSIZE;
+
+			legacy_init(&lc, size);
+			hits = 0;
+			start = bench_now();
+			for (i = 0; i < BENCH_TRACELEN; i++) {
+				legacy_read(&lc, vmc, trace[i], &hit);
+				hits += hit;
+			}
+			elapsed = bench_now() - start;
+			legacy_free(&lc);
+
+			printf("%-8s %-8s %8d %10.2f %10.1f\n", traces[t], "linear", size,
+				100.0 * hits / BENCH_TRACELEN, elapsed / BENCH_TRACELEN);
+
+			ctx = bench_mount(vmc, BENCH_CARDSIZE, capacities[c], MCIO_COMMIT_BACKUP);
+			Card_ClearCache(ctx);
+
+			/* the hit counting lookup stays outside the timed replay */
+			hits = 0;
+			for (i = 0; i < BENCH_TRACELEN; i++) {
+				hits += (Card_GetCacheEntry(ctx, trace[i]) != NULL);
+				Card_ReadCluster(ctx, trace[i], &mce);
+			}
+			Card_ClearCache(ctx);
+
+			start = bench_now();
+			for (i = 0; i < BENCH_TRACELEN; i++)
+				Card_ReadCluster(ctx, trace[i], &mce);
+			elapsed = bench_now() - start;
+
+			printf("%-8s %-8s %8d %10.2f %10.1f\n", traces[t], "hash-lru", ctx->cache_size,
+				100.0 * hits / BENCH_TRACELEN, elapsed / BENCH_TRACELEN);
+
+			mcio_free(ctx);
+		}
+	}
+
+	free(trace);
+	free(vmc);
+}
+
+/* ---- page ECC ------------------------------------------------------------ */
+
+#define BENCH_ECCPAGES		(1 << 14)
+
+static void ecc_reference(const uint8_t *data, uint8_t *ecc, int chunks)
+{
+	int i;
+
+	for (i = 0; i < chunks; i++)
+		Card_DataChecksum((uint8_t *)data + (i << 7), ecc + (i * 3));
+}
+
+static void bench_ecc(void)
+{
+	struct {
+		const char *name;
+		void (*fn)(const uint8_t *, uint8_t *, int);
+		int available;
+	} impls[] = {
+		{ "scalar", ecc_reference, 1 },
+#ifdef MCIO_ECC_X86
+		{ "sse2", Card_DataChecksumSSE2, 1 },
+		{ "avx2", Card_DataChecksumAVX2, __builtin_cpu_supports("avx2") },
+#endif
+		{ "dispatch", Card_PageChecksum, 1 },
+	};
+	uint8_t *data = bench_malloc(BENCH_ECCPAGES * 512);
+	uint8_t *ref = bench_malloc(BENCH_ECCPAGES * 12);
+	uint8_t *out = bench_malloc(BENCH_ECCPAGES * 12);
+	uint32_t seed = 0xecc;
+	double start, elapsed;
+	int i, n, bad;
+
+	/* random pages, plus the erased and single bit patterns the card actually holds */
+	for (i = 0; i < BENCH_ECCPAGES * 512; i++)
+		data[i] = bench_rand(&seed) & 0xFF;
+	memset(data, 0xFF, 512);
+	memset(data + 512, 0x00, 512);
+	for (i = 0; i < 1024; i++)
+		data[1024 + i * 8 + (i & 7)] = 1 << (i & 7);
+
+	ecc_reference(data, ref, BENCH_ECCPAGES * 4);
+
+	printf("%-8s %10s %10s %8s\n", "ecc", "ns/page", "MB/s", "match");
+
+	for (n = 0; n < (int)countof(impls); n++) {
+		if (!impls[n].available)
+			continue;
+
+		memset(out, 0, BENCH_ECCPAGES * 12);
+		impls[n].fn(data, out, BENCH_ECCPAGES * 4);
+		bad = memcmp(ref, out, BENCH_ECCPAGES * 12) != 0;
+
+		start = bench_now();
+		for (i = 0; i < 16; i++)
+			impls[n].fn(data, out, BENCH_ECCPAGES * 4);
+		elapsed = (bench_now() - start) / 16;
+
+		printf("%-8s %10.1f %10.1f %8s\n", impls[n].name, elapsed / BENCH_ECCPAGES,
+			(BENCH_ECCPAGES * 512.0) / (elapsed / 1e9) / (1024 * 1024), bad ? "NO" : "yes");
+
+		if (bad) {
+			printf("Error: %s ECC differs from the reference\n", impls[n].name);
+			exit(1);
+		}
+	}
+
+	free(out);
+	free(ref);
+	free(data);
+}
+
+/* ---- block flushes ------------------------------------------------------- */
+
+/* inject-heavy session: a save directory filled, partly removed and filled again */
+static void bench_inject(mcio_ctx_t *ctx, uint64_t *payload)
+{
+	static uint8_t data[64 * 1024];
+	uint32_t seed = 0xb10c;
+	char path[64];
+	int i, round, fd, size;
+
+	for (i = 0; i < (int)sizeof(data); i++)
+		data[i] = bench_rand(&seed) & 0xFF;
+
+	mcio_mcMkDir(ctx, "BENCH");
+
+	for (round = 0; round < 4; round++) {
+		for (i = 0; i < 24; i++) {
+			size = 1024 + (bench_rand(&seed) % (sizeof(data) - 1024));
+			snprintf(path, sizeof(path), "BENCH/file%02d.bin", i);
+
+			fd = mcio_mcOpen(ctx, path, sceMcFileCreateFile | sceMcFileAttrWriteable | sceMcFileAttrFile);
+			if (fd < 0 || mcio_mcWrite(ctx, fd, data, size) != size) {
+				printf("Error: inject of %s failed\n", path);
+				exit(1);
+			}
+			mcio_mcClose(ctx, fd);
+			*payload += size;
+		}
+
+		for (i = round & 1; i < 24; i += 2) {
+			snprintf(path, sizeof(path), "BENCH/file%02d.bin", i);
+			mcio_mcRemove(ctx, path);
+		}
+	}
+}
+
+static void bench_flush(void)
+{
+	static const struct { const char *name; uint8_t cardflags; int mode, txn; } cards[] = {
+		{ "raw", 0x52, MCIO_COMMIT_BACKUP, 0 },
+		{ "ecc", 0x53, MCIO_COMMIT_BACKUP, 0 },
+		{ "raw-dir", 0x52, MCIO_COMMIT_DIRECT, 0 },
+		{ "ecc-dir", 0x53, MCIO_COMMIT_DIRECT, 0 },
+		{ "raw-txn", 0x52, MCIO_COMMIT_BACKUP, 1 },
+	};
+	size_t eccsize = BENCH_CARDSIZE + (BENCH_CARDSIZE >> 5);
+	uint8_t *raw = bench_malloc(BENCH_CARDSIZE);
+	uint8_t *vmc = bench_malloc(eccsize);
+	uint64_t payload;
+	mcio_ctx_t *ctx;
+	double start, elapsed;
+	int c;
+
+	printf("%-8s %10s %12s %8s %8s %10s %10s\n", "flush", "payload KB", "written KB", "amplif.", "blocks", "us/block", "ms total");
+
+	for (c = 0; c < (int)countof(cards); c++) {
+		size_t size = BENCH_CARDSIZE;
+
+		bench_mkcard(raw, BENCH_CARDSIZE, cards[c].cardflags);
+		memcpy(vmc, raw, BENCH_CARDSIZE);
+
+		if (cards[c].cardflags & CF_USE_ECC) {
+			/* lay the formatted card out with its spare areas */
+			ctx = bench_mount(raw, BENCH_CARDSIZE, MIN_CACHEENTRY, MCIO_COMMIT_BACKUP);
+			mcio_mcReadPages(ctx, 0, BENCH_CARDSIZE / 512, vmc, 1, 0);
+			mcio_free(ctx);
+			size = eccsize;
+		}
+
+		ctx = bench_mount(vmc, size, MIN_CACHEENTRY, cards[c].mode);
+		ctx->wr_bytes = 0;
+		ctx->wr_blocks = 0;
+		payload = 0;
+
+		start = bench_now();
+		if (cards[c].txn)
+			mcio_begin(ctx);
+		bench_inject(ctx, &payload);
+		if (cards[c].txn)
+			mcio_commit(ctx);
+		Card_FlushMCCache(ctx);
+		elapsed = bench_now() - start;
+
+		printf("%-8s %10.0f %12.0f %8.2f %8u %10.2f %10.2f\n", cards[c].name,
+			payload / 1024.0, ctx->wr_bytes / 1024.0, (double)ctx->wr_bytes / payload,
+			ctx->wr_blocks, (elapsed / 1e3) / (ctx->wr_blocks ? ctx->wr_blocks : 1), elapsed / 1e6);
+
+		mcio_free(ctx);
+	}
+
+	free(vmc);
+	free(raw);
+}
+
+/* ---- chunked writes ------------------------------------------------------ */
+
+static void bench_chunked(void)
+{
+	static const int chunks[] = { 256 * 1024, 4096, 512 };
+	static uint8_t data[256 * 1024];
+	uint8_t *vmc = bench_malloc(BENCH_CARDSIZE);
+	mcio_ctx_t *ctx;
+	double start, elapsed;
+	int c, i, fd, pos, prealloc;
+
+	for (i = 0; i < (int)sizeof(data); i++)
+		data[i] = i * 7;
+
+	printf("%-8s %10s %12s %10s\n", "write", "chunk", "written KB", "ms");
+
+	for (c = 0; c < (int)countof(chunks) * 2; c++) {
+		prealloc = c / countof(chunks); /* second pass reserves each file with mcio_mcAllocate() */
+		ctx = bench_newcard(vmc, BENCH_CARDSIZE);
+		ctx->wr_bytes = 0;
+
+		start = bench_now();
+		for (i = 0; i < 8; i++) {
+			char path[32];
+
+			snprintf(path, sizeof(path), "stream%d.bin", i);
+			fd = mcio_mcOpen(ctx, path, sceMcFileCreateFile | sceMcFileAttrWriteable | sceMcFileAttrFile);
+			if (fd >= 0 && prealloc && mcio_mcAllocate(ctx, fd, sizeof(data)) != sceMcResSucceed)
+				fd = -1;
+			for (pos = 0; pos < (int)sizeof(data); pos += chunks[c % countof(chunks)]) {
+				if (fd < 0 || mcio_mcWrite(ctx, fd, data + pos, chunks[c % countof(chunks)]) != chunks[c % countof(chunks)]) {
+					printf("Error: write of %s failed\n", path);
+					exit(1);
+				}
+			}
+			mcio_mcClose(ctx, fd);
+		}
+		elapsed = bench_now() - start;
+
+		printf("%-8s %10d %12.0f %10.2f\n", prealloc ? "alloc" : "stream", chunks[c % countof(chunks)], ctx->wr_bytes / 1024.0, elapsed / 1e6);
+
+		mcio_free(ctx);
+	}
+
+	free(vmc);
+}
+
+/* ---- cluster placement --------------------------------------------------- */
+
+/* extents and erase blocks of one file's chain, against the blocks it would need if contiguous */
+static void bench_chainstat(mcio_ctx_t *ctx, const char *path, int *extents, int *blocks, int *minblocks)
+{
+	struct MCFHandle *fh;
+	int32_t fat_index, next, clusters, block, prev_block;
+	int32_t alloc_offset = read_le_uint32((uint8_t *)&ctx->devinfo.alloc_offset);
+	int fd;
+
+	fd = mcio_mcOpen(ctx, path, sceMcFileAttrReadable | sceMcFileAttrFile);
+	if (fd < 0)
+		return;
+
+	fh = ctx->fdhandles[fd];
+	fat_index = fh->freeclink;
+	clusters = 0;
+	prev_block = -1;
+
+	while (fat_index >= 0) {
+		block = (fat_index + alloc_offset) / 8;
+		if (block != prev_block)
+			(*blocks)++;
+		prev_block = block;
+		clusters++;
+
+		next = ctx->fat[fat_index];
+		if (next >= -1)
+			break;
+		next &= 0x7fffffff;
+		if (next != fat_index + 1)
+			(*extents)++;
+		fat_index = next;
+	}
+
+	if (clusters) {
+		(*extents)++;
+		*minblocks += (clusters + 7) / 8;
+	}
+
+	mcio_mcClose(ctx, fd);
+}
+
+/* long churn of mixed save sizes, then placement quality of the survivors */
+static void bench_frag(void)
+{
+	static uint8_t data[96 * 1024];
+	uint8_t *vmc = bench_malloc(BENCH_CARDSIZE);
+	mcio_ctx_t *ctx;
+	uint32_t seed;
+	char path[64];
+	struct io_dirent entry;
+	int prealloc, round, i, fd, size, files, extents, blocks, minblocks;
+	double start, elapsed;
+
+	memset(data, 0x5a, sizeof(data));
+
+	printf("%-8s %8s %10s %12s %12s %10s\n", "frag", "files", "extents", "ext/file", "blocks/min", "ms");
+
+	for (prealloc = 0; prealloc < 2; prealloc++) {
+		ctx = bench_newcard(vmc, BENCH_CARDSIZE);
+
+		seed = 0xf4a9;
+		start = bench_now();
+		for (round = 0; round < 16; round++) {
+			for (i = 0; i < 48; i++) {
+				if (bench_rand(&seed) % 3)
+					continue;
+
+				size = 512 + (bench_rand(&seed) % (sizeof(data) - 512));
+				snprintf(path, sizeof(path), "file%02d.bin", i);
+				mcio_mcRemove(ctx, path);
+
+				fd = mcio_mcOpen(ctx, path, sceMcFileCreateFile | sceMcFileAttrWriteable | sceMcFileAttrFile);
+				if (fd >= 0 && prealloc && mcio_mcAllocate(ctx, fd, size) != sceMcResSucceed)
+					fd = -1;
+				if (fd < 0 || mcio_mcWrite(ctx, fd, data, size) != size) {
+					printf("Error: write of %s failed\n", path);
+					exit(1);
+				}
+				mcio_mcClose(ctx, fd);
+			}
+		}
+		elapsed = bench_now() - start;
+
+		files = extents = blocks = minblocks = 0;
+		for (i = 0; i < 48; i++) {
+			snprintf(path, sizeof(path), "file%02d.bin", i);
+			if (mcio_mcStat(ctx, path, &entry) < 0)
+				continue;
+			files++;
+			bench_chainstat(ctx, path, &extents, &blocks, &minblocks);
+		}
+
+		printf("%-8s %8d %10d %12.2f %12.2f %10.2f\n", prealloc ? "alloc" : "write", files, extents,
+			(double)extents / (files ? files : 1), (double)blocks / (minblocks ? minblocks : 1), elapsed / 1e6);
+
+		mcio_free(ctx);
+	}
+
+	free(vmc);
+}
+
+/* ---- synthetic card workloads -------------------------------------------- */
+
+#define WL_REPS			3
+#define WL_MAXFILES		8
+#define WL_MAXSAVES		960	/* the root directory holds about a thousand entries */
+
+enum { WL_EMPTY, WL_FULL, WL_FRAG };
+enum { WL_SMALL, WL_LARGE };
+
+static const char *wl_fills[] = { "empty", "full", "frag" };
+static const char *wl_kinds[] = { "small", "large" };
+
+static uint8_t wl_data[512 * 1024];
+
+struct wl_state {
+	uint8_t *vmc;		/* working copy, the timed operations run on it */
+	size_t vmcsize;
+	int cardsize;		/* without spare data */
+	int ecc;
+	int kind;
+	uint8_t *psu;		/* export target */
+	size_t psulen;
+	uint8_t *psu_in;	/* the probe save as a .PSU named BWIMPORT */
+	size_t psu_inlen;
+	uint8_t *conv;		/* other layout of the card, ecc-convert target */
+	uint8_t *scratch;
+	uint64_t bytes;		/* what the last run moved */
+};
+
+/* many small saves are a handful of files up to 8KB per 8MB of card, few large ones are a couple of files up to 512KB */
+static int wl_putsave(mcio_ctx_t *ctx, const char *dir, int kind, int cardsize, uint32_t seed)
+{
+	char path[64];
+	int i, fd, size, files, total = 0;
+
+	files = (kind == WL_SMALL) ? 2 + (bench_rand(&seed) % 3) : 1 + (bench_rand(&seed) % 2);
+
+	fd = mcio_mcMkDir(ctx, dir);
+	if (fd < 0)
+		return fd;
+	mcio_mcClose(ctx, fd);
+
+	for (i = 0; i < files; i++) {
+		if (kind == WL_SMALL)
+			size = 512 + (bench_rand(&seed) % (cardsize / 1024 - 512));
+		else
+			size = 128 * 1024 + (bench_rand(&seed) % (sizeof(wl_data) - 128 * 1024));
+
+		snprintf(path, sizeof(path), "%s/file%d.bin", dir, i);
+		fd = mcio_mcOpen(ctx, path, sceMcFileCreateFile | sceMcFileAttrWriteable | sceMcFileAttrFile);
+		if (fd < 0)
+			return fd;
+
+		if (mcio_mcAllocate(ctx, fd, size) != sceMcResSucceed || mcio_mcWrite(ctx, fd, wl_data, size) != size) {
+			mcio_mcClose(ctx, fd);
+			return sceMcResFullDevice;
+		}
+		mcio_mcClose(ctx, fd);
+		total += size;
+	}
+
+	return total;
+}
+
+static void wl_rmsave(mcio_ctx_t *ctx, const char *dir)
+{
+	char path[64];
+	int i;
+
+	for (i = 0; i < WL_MAXFILES; i++) {
+		snprintf(path, sizeof(path), "%s/file%d.bin", dir, i);
+		mcio_mcRemove(ctx, path);
+	}
+	mcio_mcRmDir(ctx, dir);
+}
+
+/* fill the card with saves, leaving room for the probe, inject and import saves */
+static void wl_fill(mcio_ctx_t *ctx, int fill, int kind, int cardsize)
+{
+	char dir[32];
+	int i, saves, cardfree;
+	int reserve = (kind == WL_SMALL) ? 3 * 4 * (cardsize / 1024) : 3 * 2 * (int)sizeof(wl_data);
+
+	if (fill == WL_EMPTY)
+		return;
+
+	for (saves = 0; saves < WL_MAXSAVES; saves++) {
+		if (mcio_mcGetAvailableSpace(ctx, &cardfree) < 0 || cardfree < reserve)
+			break;
+
+		snprintf(dir, sizeof(dir), "BWSAVE%05d", saves);
+		if (wl_putsave(ctx, dir, kind, cardsize, 0x5a7e + saves) < 0) {
+			wl_rmsave(ctx, dir);
+			break;
+		}
+	}
+
+	/* punch a hole every other save */
+	if (fill == WL_FRAG) {
+		for (i = 0; i < saves; i += 2) {
+			snprintf(dir, sizeof(dir), "BWSAVE%05d", i);
+			wl_rmsave(ctx, dir);
+		}
+	}
+}
+
+static void wl_psu_put(uint8_t **p, const struct io_dirent *dirent, const char *name)
+{
+	struct MCFsEntry *entry = (struct MCFsEntry *)*p;
+
+	memset(entry, 0, sizeof(struct MCFsEntry));
+	memcpy(&entry->created, &dirent->stat.ctime, sizeof(struct sceMcStDateTime));
+	memcpy(&entry->modified, &dirent->stat.mtime, sizeof(struct sceMcStDateTime));
+	snprintf(entry->name, sizeof(entry->name), "%.31s", name);
+	entry->mode = dirent->stat.mode;
+	entry->length = dirent->stat.size;
+	*p += sizeof(struct MCFsEntry);
+}
+
+static int wl_psu_file(mcio_ctx_t *ctx, int dirfd, const char *path, const struct io_dirent *dirent, void *arg)
+{
+	uint8_t **p = (uint8_t **)arg;
+	int r, pad;
+
+	(void)path;
+	wl_psu_put(p, dirent, dirent->name);
+
+	r = mcio_mcReadFileAt(ctx, dirfd, dirent->name, *p, dirent->stat.size);
+	if (r != (int)dirent->stat.size)
+		return (r < 0) ? r : -1001;
+
+	pad = (1024 - (dirent->stat.size % 1024)) % 1024;
+	memset(*p + r, 0xFF, pad);
+	*p += r + pad;
+
+	return 1;
+}
+
+/* the save as a .PSU in memory, same layout cmd_export writes */
+static int wl_psu_export(mcio_ctx_t *ctx, const char *dir, const char *name, uint8_t *out, size_t *len)
+{
+	struct io_dirent dirent;
+	uint8_t *p = out;
+	int r;
+
+	r = mcio_mcStat(ctx, dir, &dirent);
+	if (r < 0)
+		return r;
+
+	wl_psu_put(&p, &dirent, name);
+	dirent.stat.size = 0;
+	wl_psu_put(&p, &dirent, ".");
+	wl_psu_put(&p, &dirent, "..");
+
+	r = mcio_mcWalk(ctx, dir, wl_psu_file, &p);
+	if (r < 0)
+		return r;
+
+	*len = p - out;
+	return 0;
+}
+
+/* same steps as cmd_psu_import, reading from memory */
+static int wl_psu_import(mcio_ctx_t *ctx, const uint8_t *psu)
+{
+	const struct MCFsEntry *save = (const struct MCFsEntry *)psu;
+	const struct MCFsEntry *file;
+	const uint8_t *p = psu + 3 * sizeof(struct MCFsEntry);
+	struct io_dirent entry;
+	char path[64];
+	int i, fd, r;
+
+	fd = mcio_mcMkDir(ctx, save->name);
+	if (fd < 0)
+		return fd;
+	mcio_mcClose(ctx, fd);
+
+	for (i = save->length; i > 2; i--) {
+		file = (const struct MCFsEntry *)p;
+		p += sizeof(struct MCFsEntry);
+
+		snprintf(path, sizeof(path), "%s/%s", save->name, file->name);
+		fd = mcio_mcOpen(ctx, path, sceMcFileCreateFile | sceMcFileAttrWriteable | sceMcFileAttrFile);
+		if (fd < 0)
+			return fd;
+
+		r = mcio_mcAllocate(ctx, fd, file->length);
+		if (r == sceMcResSucceed)
+			r = mcio_mcWrite(ctx, fd, (void *)p, file->length);
+		mcio_mcClose(ctx, fd);
+		if (r != (int)file->length)
+			return -1004;
+
+		mcio_mcStat(ctx, path, &entry);
+		memcpy(&entry.stat.ctime, &file->created, sizeof(struct sceMcStDateTime));
+		memcpy(&entry.stat.mtime, &file->modified, sizeof(struct sceMcStDateTime));
+		entry.stat.mode = file->mode;
+		mcio_mcSetStat(ctx, path, &entry);
+
+		p += (file->length + 1023) & ~1023;
+	}
+
+	mcio_mcStat(ctx, save->name, &entry);
+	memcpy(&entry.stat.ctime, &save->created, sizeof(struct sceMcStDateTime));
+	memcpy(&entry.stat.mtime, &save->modified, sizeof(struct sceMcStDateTime));
+	entry.stat.mode = save->mode;
+	mcio_mcSetStat(ctx, save->name, &entry);
+
+	return 0;
+}
+
+static int wl_count(mcio_ctx_t *ctx, int dirfd, const char *path, const struct io_dirent *dirent, void *arg)
+{
+	(void)ctx; (void)dirfd; (void)path; (void)dirent;
+	(*(uint64_t *)arg)++;
+	return 0;
+}
+
+static int wl_format(mcio_ctx_t *ctx, struct wl_state *st)
+{
+	int r = mcio_mcFormat(ctx);
+
+	Card_FlushMCCache(ctx);
+	st->bytes = st->cardsize;
+	return r;
+}
+
+static int wl_inject(mcio_ctx_t *ctx, struct wl_state *st)
+{
+	int r = wl_putsave(ctx, "BWINJECT", st->kind, st->cardsize, 0x1e1);
+
+	Card_FlushMCCache(ctx);
+	st->bytes = (r < 0) ? 0 : r;
+	return r;
+}
+
+static void wl_uninject(mcio_ctx_t *ctx, struct wl_state *st)
+{
+	(void)st;
+	wl_rmsave(ctx, "BWINJECT");
+	Card_FlushMCCache(ctx);
+}
+
+static int wl_extract(mcio_ctx_t *ctx, struct wl_state *st)
+{
+	char path[64];
+	int i, r;
+
+	st->bytes = 0;
+	for (i = 0; i < WL_MAXFILES; i++) {
+		snprintf(path, sizeof(path), "BWPROBE/file%d.bin", i);
+		r = mcio_mcReadFile(ctx, path, st->scratch, sizeof(wl_data));
+		if (r < 0)
+			break;
+		st->bytes += r;
+	}
+
+	return st->bytes ? 0 : -1;
+}
+
+static int wl_list(mcio_ctx_t *ctx, struct wl_state *st)
+{
+	st->bytes = 0;
+	return mcio_mcWalk(ctx, "/", wl_count, &st->bytes);
+}
+
+static int wl_free(mcio_ctx_t *ctx, struct wl_state *st)
+{
+	int cardfree, r;
+
+	r = mcio_mcGetAvailableSpace(ctx, &cardfree);
+	st->bytes = cardfree;
+	return r;
+}
+
+static int wl_export(mcio_ctx_t *ctx, struct wl_state *st)
+{
+	int r = wl_psu_export(ctx, "BWPROBE", "BWPROBE", st->psu, &st->psulen);
+
+	st->bytes = st->psulen;
+	return r;
+}
+
+static int wl_import(mcio_ctx_t *ctx, struct wl_state *st)
+{
+	int r = wl_psu_import(ctx, st->psu_in);
+
+	Card_FlushMCCache(ctx);
+	st->bytes = st->psu_inlen;
+	return r;
+}
+
+static void wl_unimport(mcio_ctx_t *ctx, struct wl_state *st)
+{
+	(void)st;
+	wl_rmsave(ctx, "BWIMPORT");
+	Card_FlushMCCache(ctx);
+}
+
+/* ECC images convert to raw, raw images get their spare areas generated */
+static int wl_convert(mcio_ctx_t *ctx, struct wl_state *st)
+{
+	int pages = st->cardsize / 512;
+
+	st->bytes = (size_t)pages * (st->ecc ? 512 : 528);
+	return mcio_mcReadPages(ctx, 0, pages, st->conv, !st->ecc, 0);
+}
+
+static const struct {
+	const char *name;
+	int (*run)(mcio_ctx_t *ctx, struct wl_state *st);
+	void (*undo)(mcio_ctx_t *ctx, struct wl_state *st);
+} wl_ops[] = {
+	{ "format", wl_format, NULL },
+	{ "inject", wl_inject, wl_uninject },
+	{ "extract", wl_extract, NULL },
+	{ "list", wl_list, NULL },
+	{ "free", wl_free, NULL },
+	{ "psu-export", wl_export, NULL },
+	{ "psu-import", wl_import, wl_unimport },
+	{ "ecc-convert", wl_convert, NULL },
+};
+
+static mcio_ctx_t *wl_mount(struct wl_state *st, const uint8_t *image)
+{
+	memcpy(st->vmc, image, st->vmcsize);
+
+	return bench_mount(st->vmc, st->vmcsize, MIN_CACHEENTRY, MCIO_COMMIT_BACKUP);
+}
+
+static void wl_result(const char *card, const struct wl_state *st, int fill, int op, const char *pass, int rep,
+	double elapsed, mcio_ctx_t *ctx)
+{
+	struct mcio_stat stats[MCIO_STAT_COUNT];
+
+	mcio_getStats(ctx, stats);
+	printf("{\"card\":\"%s\",\"size\":%d,\"ecc\":%d,\"fill\":\"%s\",\"saves\":\"%s\",\"op\":\"%s\","
+		"\"pass\":\"%s\",\"rep\":%d,\"ns\":%.0f,\"bytes\":%" PRIu64 ",\"cache_miss\":%" PRIu64
+		",\"page_read\":%" PRIu64 ",\"page_write\":%" PRIu64 "}\n",
+		card, st->cardsize, st->ecc, wl_fills[fill], wl_kinds[st->kind], wl_ops[op].name, pass, rep, elapsed,
+		st->bytes, stats[MCIO_STAT_CACHE_MISS].count, stats[MCIO_STAT_PAGE_READ].count, stats[MCIO_STAT_PAGE_WRITE].count);
+}
+
+static void wl_run(const char *card, struct wl_state *st, const uint8_t *image, int fill, int op, int reps)
+{
+	mcio_ctx_t *ctx;
+	double start, elapsed;
+	int rep, r;
+
+	/* cold: every repetition on a freshly mounted card, nothing cached */
+	for (rep = 0; rep < reps; rep++) {
+		ctx = wl_mount(st, image);
+		mcio_resetStats(ctx);
+
+		start = bench_now();
+		r = wl_ops[op].run(ctx, st);
+		elapsed = bench_now() - start;
+		if (r < 0) {
+			printf("Error: %s on %s failed (%d)\n", wl_ops[op].name, card, r);
+			exit(1);
+		}
+
+		wl_result(card, st, fill, op, "cold", rep, elapsed, ctx);
+		mcio_free(ctx);
+	}
+
+	/* warm: one untimed run primes the cache, then repeat on the same mount */
+	ctx = wl_mount(st, image);
+	wl_ops[op].run(ctx, st);
+	if (wl_ops[op].undo)
+		wl_ops[op].undo(ctx, st);
+
+	for (rep = 0; rep < reps; rep++) {
+		mcio_resetStats(ctx);
+
+		start = bench_now();
+		r = wl_ops[op].run(ctx, st);
+		elapsed = bench_now() - start;
+		if (r < 0) {
+			printf("Error: %s on %s failed (%d)\n", wl_ops[op].name, card, r);
+			exit(1);
+		}
+
+		wl_result(card, st, fill, op, "warm", rep, elapsed, ctx);
+		if (wl_ops[op].undo)
+			wl_ops[op].undo(ctx, st);
+	}
+
+	mcio_free(ctx);
+}
+
+/* every card size, layout, fill level and save shape, each operation timed cold and warm, one JSON object per line */
+static void bench_workload(int reps, int maxsize)
+{
+	static const int sizes[] = { 8, 16, 32, 64 };
+	size_t maxbytes = (size_t)64 * 1024 * 1024;
+	size_t maxecc = maxbytes + (maxbytes >> 5);
+	uint8_t *raw = bench_malloc(maxbytes);
+	uint8_t *image = bench_malloc(maxecc);
+	struct wl_state st;
+	mcio_ctx_t *ctx;
+	char card[32];
+	uint32_t seed = 0xc0de;
+	int s, ecc, fill, kind, op, i;
+
+	memset(&st, 0, sizeof(st));
+	st.vmc = bench_malloc(maxecc);
+	st.conv = bench_malloc(maxecc);
+	st.psu = bench_malloc(2 * sizeof(wl_data) * WL_MAXFILES);
+	st.psu_in = bench_malloc(2 * sizeof(wl_data) * WL_MAXFILES);
+	st.scratch = bench_malloc(sizeof(wl_data));
+	memset(st.conv, 0, maxecc);
+
+	for (i = 0; i < (int)sizeof(wl_data); i++)
+		wl_data[i] = bench_rand(&seed) & 0xFF;
+
+	for (s = 0; s < (int)countof(sizes) && sizes[s] <= maxsize; s++) {
+		for (kind = WL_SMALL; kind <= WL_LARGE; kind++) {
+			for (fill = WL_EMPTY; fill <= WL_FRAG; fill++) {
+				st.cardsize = sizes[s] * 1024 * 1024;
+				st.kind = kind;
+
+				/* lay out the saves on a raw card, the ECC variant is its converted image */
+				ctx = bench_newcard(raw, st.cardsize);
+				wl_fill(ctx, fill, kind, st.cardsize);
+				if (wl_putsave(ctx, "BWPROBE", kind, st.cardsize, 0x9b0e) < 0 ||
+					wl_psu_export(ctx, "BWPROBE", "BWIMPORT", st.psu_in, &st.psu_inlen) < 0) {
+					printf("Error: probe save on %dMB card failed\n", sizes[s]);
+					exit(1);
+				}
+				Card_FlushMCCache(ctx);
+				mcio_free(ctx);
+
+				for (ecc = 0; ecc < 2; ecc++) {
+					st.ecc = ecc;
+					st.vmcsize = st.cardsize;
+					if (ecc) {
+						((struct MCDevInfo *)raw)->cardflags |= CF_USE_ECC;
+						ctx = bench_mount(raw, st.cardsize, MIN_CACHEENTRY, MCIO_COMMIT_BACKUP);
+						mcio_mcReadPages(ctx, 0, st.cardsize / 512, image, 1, 0);
+						mcio_free(ctx);
+						st.vmcsize += st.cardsize >> 5;
+					} else
+						memcpy(image, raw, st.cardsize);
+
+					snprintf(card, sizeof(card), "%dM-%s-%s-%s", sizes[s], ecc ? "ecc" : "raw", wl_fills[fill], wl_kinds[kind]);
+					for (op = 0; op < (int)countof(wl_ops); op++)
+						wl_run(card, &st, image, fill, op, reps);
+				}
+			}
+		}
+	}
+
+	free(st.scratch);
+	free(st.psu_in);
+	free(st.psu);
+	free(st.conv);
+	free(st.vmc);
+	free(image);
+	free(raw);
+}
+
+int main(int argc, char **argv)
+{
+	const char *name = (argc > 1) ? argv[1] : "all";
+
+	if (strcmp(name, "all") == 0 || strcmp(name, "cache") == 0)
+		bench_cache();
+	if (strcmp(name, "all") == 0 || strcmp(name, "ecc") == 0)
+		bench_ecc();
+	if (strcmp(name, "all") == 0 || strcmp(name, "flush") == 0)
+		bench_flush();
+	if (strcmp(name, "all") == 0 || strcmp(name, "write") == 0)
+		bench_chunked();
+	if (strcmp(name, "all") == 0 || strcmp(name, "frag") == 0)
+		bench_frag();
+	/* minutes rather than seconds, only on request: workload [reps] [max card MB] */
+	if (strcmp(name, "workload") == 0)
+		bench_workload((argc > 2) ? atoi(argv[2]) : WL_REPS, (argc > 3) ? atoi(argv[3]) : 64);
+
+	return 0;
+}
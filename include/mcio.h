@@ -79,27 +79,97 @@ typedef struct {
 	uint32_t positionInFile;
 } ps2_FileInfo_t;
 
-int mcio_init(void* vmc, size_t size);
-int mcio_mcDetect(void);
-int mcio_mcGetInfo(int *pagesize, int *blocksize, int *cardsize, int *cardflags);
-int mcio_mcGetAvailableSpace(int *cardfree);
-int mcio_mcOpen(const char *filename, int flag);
-int mcio_mcClose(int fd);
-int mcio_mcRead(int fd, void *buf, int length);
-int mcio_mcWrite(int fd, void *buf, int length);
-int mcio_mcSeek(int fd, int offset, int origin);
-int mcio_mcCreateCrossLinkedFile(const char *real_filename, const char *dummy_filename);
-int mcio_mcDopen(const char *dirname);
-int mcio_mcDclose(int fd);
-int mcio_mcDread(int fd, struct io_dirent *dirent);
-int mcio_mcMkDir(const char *dirname);
-int mcio_mcReadPage(int pagenum, void *buf, void *ecc);
-int mcio_mcUnformat(void);
-int mcio_mcFormat(void);
-int mcio_mcRemove(const char *filename);
-int mcio_mcRmDir(const char *dirname);
-int mcio_mcStat(const char *filename, struct io_dirent *dirent);
-int mcio_mcSetStat(const char *filename, const struct io_dirent *dirent);
+struct mcio_ecc_stats {
+	uint32_t pages;
+	uint32_t ok;
+	uint32_t erased;
+	uint32_t correctable;		/* single bit errors, in the data or in the ECC itself */
+	uint32_t uncorrectable;
+	uint32_t repaired;
+};
+
+/* one mcio_getStats() counter, times are inclusive: a cache miss also holds its page reads */
+struct mcio_stat {
+	uint64_t count;
+	uint64_t ns;
+};
+
+/* location of a directory entry: first cluster of its directory and index in it */
+struct mcio_dirpos {
+	uint32_t cluster;
+	uint32_t fsindex;
+};
+
+#define MCIO_PATH_MAX	1024
+
+/* opaque memory card context, one per mounted VMC image */
+typedef struct mcio_ctx mcio_ctx_t;
+
+/*
+ * mcio_mcWalk() callback, for each entry below the walked directory with the entry as
+ * mcio_mcStat() reports it; dirfd is its open directory, usable with the *At calls.
+ * Return < 0 to stop the walk, 1 to skip a directory's content, 0 to go on.
+ */
+typedef int (*mcio_walk_cb)(mcio_ctx_t *ctx, int dirfd, const char *path, const struct io_dirent *dirent, void *arg);
+
+mcio_ctx_t *mcio_alloc(void);
+void mcio_free(mcio_ctx_t *ctx);
+int mcio_init(mcio_ctx_t *ctx, void* vmc, size_t size);
+/* cluster cache capacity in 1KB entries (default 36), <= 0 keeps the whole card resident */
+int mcio_setCacheSize(mcio_ctx_t *ctx, int entries);
+/* MCIO_COMMIT_DIRECT writes flushed blocks in place, leaving crash safety to the host */
+int mcio_setCommitMode(mcio_ctx_t *ctx, int mode);
+/* image bytes stored since mcio_init() or mcio_clearDirty(), as merged offset/length pairs; returns the pair count, at most max are filled */
+int mcio_getDirtyRanges(mcio_ctx_t *ctx, size_t *ranges, int max);
+void mcio_clearDirty(mcio_ctx_t *ctx);
+/* time the counted events too, two clock reads each; counts are always kept */
+void mcio_setStatsTiming(mcio_ctx_t *ctx, int enable);
+/* the MCIO_STAT_COUNT counters since mcio_alloc() or mcio_resetStats() */
+void mcio_getStats(mcio_ctx_t *ctx, struct mcio_stat *stats);
+void mcio_resetStats(mcio_ctx_t *ctx);
+const char *mcio_statName(int stat);
+/* group card operations: they reach the image in a single write back at the outermost commit, abort drops all of it */
+int mcio_begin(mcio_ctx_t *ctx);
+int mcio_commit(mcio_ctx_t *ctx);
+int mcio_abort(mcio_ctx_t *ctx);
+int mcio_mcDetect(mcio_ctx_t *ctx);
+int mcio_mcGetInfo(mcio_ctx_t *ctx, int *pagesize, int *blocksize, int *cardsize, int *cardflags);
+int mcio_mcGetAvailableSpace(mcio_ctx_t *ctx, int *cardfree);
+int mcio_mcOpen(mcio_ctx_t *ctx, const char *filename, int flag);
+/* open an entry of an open directory by name, read-only, without resolving a path from the root */
+int mcio_mcOpenAt(mcio_ctx_t *ctx, int dirfd, const char *name, int flag);
+int mcio_mcFstat(mcio_ctx_t *ctx, int fd, struct io_dirent *dirent);
+int mcio_mcClose(mcio_ctx_t *ctx, int fd);
+int mcio_mcRead(mcio_ctx_t *ctx, int fd, void *buf, int length);
+/* read up to length bytes of a whole file straight from the image, the cluster cache is left alone */
+int mcio_mcReadFile(mcio_ctx_t *ctx, const char *filename, void *buf, int length);
+int mcio_mcReadFileAt(mcio_ctx_t *ctx, int dirfd, const char *name, void *buf, int length);
+int mcio_mcWrite(mcio_ctx_t *ctx, int fd, void *buf, int length);
+/* reserve the clusters for size bytes of an open file in one pass, the file length is unchanged */
+int mcio_mcAllocate(mcio_ctx_t *ctx, int fd, int size);
+/* write an open file's length and times to its directory entry, like close does */
+int mcio_mcSync(mcio_ctx_t *ctx, int fd);
+int mcio_mcSeek(mcio_ctx_t *ctx, int fd, int offset, int origin);
+int mcio_mcCreateCrossLinkedFile(mcio_ctx_t *ctx, const char *real_filename, const char *dummy_filename);
+int mcio_mcDopen(mcio_ctx_t *ctx, const char *dirname);
+int mcio_mcDclose(mcio_ctx_t *ctx, int fd);
+int mcio_mcDread(mcio_ctx_t *ctx, int fd, struct io_dirent *dirent);
+/* mcio_mcDread() that also gives where the entry lives */
+int mcio_mcDreadPos(mcio_ctx_t *ctx, int fd, struct io_dirent *dirent, struct mcio_dirpos *pos);
+/* depth-first walk of everything below dirname in one pass over the directory clusters */
+int mcio_mcWalk(mcio_ctx_t *ctx, const char *dirname, mcio_walk_cb cb, void *arg);
+int mcio_mcMkDir(mcio_ctx_t *ctx, const char *dirname);
+int mcio_mcReadPage(mcio_ctx_t *ctx, int pagenum, void *buf, void *ecc);
+/* count pages into buf, each followed by a freshly computed ECC spare when ecc is set; refused inside a transaction */
+int mcio_mcReadPages(mcio_ctx_t *ctx, int first, int count, void *buf, int ecc, int threads);
+int mcio_mcUnformat(mcio_ctx_t *ctx);
+/* check the spare ECC of every page, threads <= 0 uses one per CPU; status (optional) gets one MCIO_ECC_* per page; refused inside a transaction */
+int mcio_mcVerifyECC(mcio_ctx_t *ctx, int repair, int threads, struct mcio_ecc_stats *stats, uint8_t *status);
+int mcio_mcFormat(mcio_ctx_t *ctx);
+int mcio_mcRemove(mcio_ctx_t *ctx, const char *filename);
+int mcio_mcRmDir(mcio_ctx_t *ctx, const char *dirname);
+int mcio_mcStat(mcio_ctx_t *ctx, const char *filename, struct io_dirent *dirent);
+int mcio_mcSetStat(mcio_ctx_t *ctx, const char *filename, const struct io_dirent *dirent);
 
 /* MC error codes */
 #define sceMcResSucceed			 0
@@ -123,6 +193,31 @@ int mcio_mcSetStat(const char *filename, const struct io_dirent *dirent);
 #define sceMcResNotDir			-100
 #define sceMcResNotFile			-101
 
+/* mcio_setCommitMode() modes */
+#define MCIO_COMMIT_BACKUP		0	/* journal every block through the backup blocks, like a real card */
+#define MCIO_COMMIT_DIRECT		1
+
+/* mcio_getStats() counters */
+#define MCIO_STAT_CACHE_HIT		0
+#define MCIO_STAT_CACHE_MISS		1	/* cluster loaded from the image, eviction included */
+#define MCIO_STAT_PAGE_READ		2
+#define MCIO_STAT_PAGE_WRITE		3
+#define MCIO_STAT_ECC_CHECK		4	/* 128 byte chunks checked against their ECC */
+#define MCIO_STAT_ECC_CORRECT		5	/* single bit errors, in the data or in the ECC itself */
+#define MCIO_STAT_BLOCK_WRITE		6	/* erase blocks committed by a cache flush */
+#define MCIO_STAT_BACKUP_WRITE		7	/* blocks journaled through the backup blocks */
+#define MCIO_STAT_FAT_LOOKUP		8
+#define MCIO_STAT_FREE_SEARCH		9	/* free cluster searches */
+#define MCIO_STAT_FREE_SCAN		10	/* free bitmap words those searches went through */
+#define MCIO_STAT_DIRENT_READ		11	/* directory entries looked up */
+#define MCIO_STAT_COUNT			12
+
+/* mcio_mcVerifyECC() page status */
+#define MCIO_ECC_OK			0
+#define MCIO_ECC_ERASED			1
+#define MCIO_ECC_CORRECTABLE		2
+#define MCIO_ECC_UNCORRECTABLE		3
+
 /* file attributes */
 #define sceMcFileAttrReadable         0x0001
 #define sceMcFileAttrWriteable        0x0002
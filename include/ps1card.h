@@ -36,6 +36,25 @@ enum ps1block_type
     PS1BLOCK_CORRUPTED,
 };
 
+enum ps1card_stat
+{
+    PS1STAT_CARD_READ,          //Card images read from a file
+    PS1STAT_CARD_DECODE,        //Slots decoded from the raw card
+    PS1STAT_CARD_REBUILD,       //Raw cards recreated from the slots
+    PS1STAT_CARD_WRITE,         //Card images written to a file
+    PS1STAT_CHECKSUM,           //Header XOR checksums computed
+    PS1STAT_LINK_WALK,          //Slots followed through save links
+    PS1STAT_FREE_SCAN,          //Slots examined for free space
+    PS1STAT_ICON_DECODE,        //Icon frames converted to RGBA
+    PS1STAT_COUNT,
+};
+
+typedef struct ps1CardStat
+{
+    uint64_t count;
+    uint64_t ns;                        //Time spent, nanoseconds
+} ps1CardStat_t;
+
 typedef struct ps1McData
 {
     uint8_t* headerData;                //Memory Card header data (128 bytes each)
@@ -90,3 +109,15 @@ void formatSave(int slotNumber);
 
 //Get Memory Card data
 ps1mcData_t* getMemoryCardData(void);
+
+//Time the counted events too (two clock reads each), counts are always kept
+void setMemoryCardStatsTiming(int enable);
+
+//Get the performance counters (PS1STAT_COUNT entries)
+const ps1CardStat_t* getMemoryCardStats(void);
+
+//Reset the performance counters
+void resetMemoryCardStats(void);
+
+//Get the name of a performance counter
+const char* getMemoryCardStatName(int stat);
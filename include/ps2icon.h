@@ -23,6 +23,7 @@
 */
 
 #include <stdint.h>
+#include "mcio.h"
 
 //================================================================================================
 //   Typedefs and Defines
@@ -102,4 +103,4 @@ typedef struct Frame_Key_t {
 } Frame_Key;
 
 //Get icon data as bytes
-uint8_t* getIconPS2(const char* folder, const char* iconfile);
+uint8_t* getIconPS2(mcio_ctx_t *ctx, const char* folder, const char* iconfile);
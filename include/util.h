@@ -36,5 +36,30 @@ uint64_t read_le_uint64(const uint8_t *buf);
 
 int read_buffer(const char *file_path, uint8_t **buf, size_t *size);
 int write_buffer(const char *file_path, uint8_t *buf, size_t size);
+int replace_buffer(const char *file_path, uint8_t *buf, size_t size);
+int update_buffer(const char *file_path, const uint8_t *buf, const size_t *ranges, int count);
+int map_buffer(const char *file_path, uint8_t **buf, size_t *size);
+int unmap_buffer(uint8_t *buf, size_t size);
+
+uint64_t clock_ns(void);
+int cpu_count(void);
+
+/* growable string, failed is set once an append could not be stored */
+struct strbuf {
+	char *buf;
+	size_t len;
+	size_t size;
+	int failed;
+};
+
+void strbuf_printf(struct strbuf *sb, const char *fmt, ...);
+void format_stats(struct strbuf *sb, const char **names, const uint64_t *count, const uint64_t *ns, int n, uint64_t elapsed_ns);
+/* --stats output */
+#define STATS_NONE	0
+#define STATS_TEXT	1
+#define STATS_JSON	2
+
+int parse_stats_option(const char *arg);
+void print_stats(FILE *fp, int json, const char **names, const uint64_t *count, const uint64_t *ns, int n, uint64_t elapsed_ns);
 
 #endif
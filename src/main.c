@@ -25,6 +25,9 @@
 #include <string.h>
 #include <memory.h>
 #include <inttypes.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "mcio.h"
 #include "util.h"
@@ -42,7 +45,10 @@ enum ps2vmc_cmd {
 	CMD_MCFREE,
 	CMD_MCIMG,
 	CMD_ECC_IMG,
+	CMD_CONVERT,
+	CMD_VERIFY_ECC,
 	CMD_LIST,
+	CMD_TREE,
 	CMD_PSU_EXPORT,
 	CMD_ICONS_PNG,
 	CMD_EXTRACT,
@@ -54,8 +60,12 @@ enum ps2vmc_cmd {
 	CMD_CROSSLINK,
 	CMD_PSU_IMPORT,
 	CMD_PSV_IMPORT,
+	CMD_BATCH,
 };
 
+/* progress messages, off while worker threads share stdout */
+static int verbose = 1;
+
 
 static void print_usage(int argc, char **argv)
 {
@@ -63,15 +73,31 @@ static void print_usage(int argc, char **argv)
 	printf("Copyright (C) 2023 - by Bucanero\n");
 	printf("based on ps3mca-tool by jimmikaelkael et al.\n\n");
 	printf("Usage:\n");
-	printf("%s <VMC filepath> <command> [<arguments>]\n", argv[0]);
+	printf("%s <VMC filepath> [<options>] <command> [<arguments>]\n", argv[0]);
+	printf("%s --fleet <VMC directory|list file> [--threads <n>] [--stats] <command> [<arguments>]\n", argv[0]);
+	printf("\n");
+	printf("Options:\n");
+	printf("\t --fast-commit    write blocks in place, save through a temporary file\n");
+	printf("\t --threads <n>    fleet worker threads, one per CPU by default\n");
+	printf("\t --stats[=json]   report the library counters on stderr, per card in fleet mode\n");
+	printf("\n");
+	printf("Fleet commands (one JSON line per card):\n");
+	printf("\t --mc-info, -i\n");
+	printf("\t --mc-free, -f\n");
+	printf("\t --list, -ls <mc path>\n");
+	printf("\t --tree <mc path>\n");
+	printf("\t --psu-export, -px <mc path> <output directory>\n");
 	printf("\n");
 	printf("Available commands:\n");
 	printf("\t --mc-info, -i\n");
 	printf("\t --mc-free, -f\n");
 	printf("\t --mc-image, -img <output filepath>\n");
 	printf("\t --ecc-image, -ecc <output filepath>\n");
+	printf("\t --convert <output filepath>\n");
+	printf("\t --verify-ecc [--repair]\n");
 	printf("\t --mc-format\n");
 	printf("\t --list, -ls <mc path>\n");
+	printf("\t --tree <mc path>\n");
 	printf("\t --icons-png <mc path>\n");
 	printf("\t --extract-file, -x <mc filepath> <output filepath>\n");
 	printf("\t --inject-file, -in <input filepath> <mc filepath>\n");
@@ -82,15 +108,16 @@ static void print_usage(int argc, char **argv)
 	printf("\t --psv-import, -pi <PSV filepath>\n");
 	printf("\t --psu-import, -pu <PSU filepath>\n");
 	printf("\t --psu-export, -px <mc path> <output filepath>\n");
+	printf("\t --batch <script filepath|->  one command per line, saved once at the end\n");
 	printf("\n");
 }
 
-static int cmd_mcinfo(void)
+static int cmd_mcinfo(mcio_ctx_t *ctx)
 {
 	int r;
 	int pagesize, blocksize, cardsize, cardflags;
 
-	r = mcio_mcGetInfo(&pagesize, &blocksize, &cardsize, &cardflags);
+	r = mcio_mcGetInfo(ctx, &pagesize, &blocksize, &cardsize, &cardflags);
 	if (r < 0)
 		return r;
 
@@ -107,7 +134,7 @@ static int cmd_mcinfo(void)
 	return 0;
 }
 
-static int cmd_mcfree(void)
+static int cmd_mcfree(mcio_ctx_t *ctx)
 {
 	int r;
 	int cardfree;
@@ -115,7 +142,7 @@ static int cmd_mcfree(void)
 	printf("PS2 Memory Card free space\n");
 	printf("Calculating free space...\n");
 
-	r = mcio_mcGetAvailableSpace(&cardfree);
+	r = mcio_mcGetAvailableSpace(ctx, &cardfree);
 	if (r < 0)
 		return r;
 
@@ -124,12 +151,14 @@ static int cmd_mcfree(void)
 	return 0;
 }
 
-static int cmd_mcimg(const char *output)
+#define IMAGE_CHUNK_PAGES	8192	/* 4MB of page data per write */
+
+static int write_image(mcio_ctx_t *ctx, const char *output, int ecc)
 {
-	int r, i;
+	int r, i, count;
 	int pagesize, blocksize, cardsize, cardflags;
 
-	r = mcio_mcGetInfo(&pagesize, &blocksize, &cardsize, &cardflags);
+	r = mcio_mcGetInfo(ctx, &pagesize, &blocksize, &cardsize, &cardflags);
 	if (r < 0)
 		return -1;
 
@@ -137,103 +166,189 @@ static int cmd_mcimg(const char *output)
 	if (fh == NULL)
 		return -2;
 
-	void *buf = malloc(pagesize);
+	int stride = pagesize + (ecc ? (pagesize >> 5) : 0);
+	void *buf = malloc((size_t)IMAGE_CHUNK_PAGES * stride);
 	if (buf == NULL) {
 		fclose(fh);
 		return -3;
 	}
 
-	for (i = 0; i < (cardsize / pagesize); i++) {
-		mcio_mcReadPage(i, buf, NULL);
-		r = fwrite(buf, 1, pagesize, fh);
-		if (r != pagesize) {
+	for (i = 0; i < (cardsize / pagesize); i += count) {
+		count = (cardsize / pagesize) - i;
+		if (count > IMAGE_CHUNK_PAGES)
+			count = IMAGE_CHUNK_PAGES;
+
+		r = mcio_mcReadPages(ctx, i, count, buf, ecc, 0);
+		if (r < 0) {
+			fprintf(stderr, "Error: can't read pages %d-%d... (%d)\n", i, i + count - 1, r);
+			free(buf);
+			fclose(fh);
+			return r;
+		}
+		if (fwrite(buf, stride, count, fh) != (size_t)count) {
 			free(buf);
 			fclose(fh);
 			return -4;
 		}
 	}
 
-	fclose(fh);
 	free(buf);
+	if (fclose(fh) != 0)
+		return -4;
+
+	return 0;
+}
+
+static int cmd_mcimg(mcio_ctx_t *ctx, const char *output)
+{
+	int r;
+
+	r = write_image(ctx, output, 0);
+	if (r < 0)
+		return r;
 
 	printf("Exported raw memory card: %s\n", output);
 
 	return 0;
 }
 
-static int cmd_ecc_img(const char *output)
+static int cmd_ecc_img(mcio_ctx_t *ctx, const char *output)
 {
-	int r, i;
+	int r;
+
+	r = write_image(ctx, output, 1);
+	if (r < 0)
+		return r;
+
+	printf("Exported ECC memory card: %s\n", output);
+
+	return 0;
+}
+
+static int cmd_convert(mcio_ctx_t *ctx, const char *output)
+{
+	int r;
 	int pagesize, blocksize, cardsize, cardflags;
 
-	r = mcio_mcGetInfo(&pagesize, &blocksize, &cardsize, &cardflags);
+	r = mcio_mcGetInfo(ctx, &pagesize, &blocksize, &cardsize, &cardflags);
 	if (r < 0)
 		return -1;
 
-	FILE *fh = fopen(output, "wb");
-	if (fh == NULL)
-		return -2;
+	/* ECC images convert to raw, raw images get their spare areas generated */
+	if (cardflags & 1)
+		return cmd_mcimg(ctx, output);
 
-	void *ecc = malloc(pagesize >> 5);
-	void *buf = malloc(pagesize);
-	if (buf == NULL || ecc == NULL) {
-		fclose(fh);
+	return cmd_ecc_img(ctx, output);
+}
+
+static int cmd_verify_ecc(mcio_ctx_t *ctx, int repair, int *damaged)
+{
+	int r, i;
+	int pagesize, blocksize, cardsize, cardflags;
+	struct mcio_ecc_stats stats;
+	static const char *results[] = { "ok", "erased", "correctable", "uncorrectable" };
+
+	r = mcio_mcGetInfo(ctx, &pagesize, &blocksize, &cardsize, &cardflags);
+	if (r < 0)
+		return r;
+
+	uint8_t *status = malloc(cardsize / pagesize);
+	if (status == NULL)
 		return -3;
-	}
 
-	for (i = 0; i < (cardsize / pagesize); i++) {
-		mcio_mcReadPage(i, buf, ecc);
-		r = fwrite(buf, 1, pagesize, fh);
-		if (r != pagesize) {
-			free(buf);
-			fclose(fh);
-			return -4;
-		}
+	printf("PS2 Memory Card ECC check\n");
 
-		r = fwrite(ecc, 1, pagesize >> 5, fh);
-		if (r != pagesize >> 5) {
-			free(buf);
-			fclose(fh);
-			return -4;
-		}
+	r = mcio_mcVerifyECC(ctx, repair, 0, &stats, status);
+	if (r < 0) {
+		free(status);
+		return r;
 	}
 
-	fclose(fh);
-	free(buf);
-	free(ecc);
+	for (i = 0; i < (int)stats.pages; i++) {
+		if (status[i] >= MCIO_ECC_CORRECTABLE)
+			printf("Page %6d (block %4d): %s%s\n", i, i / blocksize, results[status[i]],
+				(repair && status[i] == MCIO_ECC_CORRECTABLE) ? ", repaired" : "");
+	}
+	free(status);
 
-	printf("Exported ECC memory card: %s\n", output);
+	printf("Pages checked:  %u\n", stats.pages);
+	printf("Valid:          %u\n", stats.ok);
+	printf("Erased:         %u\n", stats.erased);
+	printf("Correctable:    %u\n", stats.correctable);
+	printf("Uncorrectable:  %u\n", stats.uncorrectable);
+	if (repair)
+		printf("Repaired:       %u\n", stats.repaired);
+
+	*damaged = stats.uncorrectable + (stats.correctable - stats.repaired);
 
 	return 0;
 }
 
-static int cmd_export(const char* path, const char* output)
+static void psu_entry(struct MCFsEntry *entry, const struct io_dirent *dirent)
+{
+	memset(entry, 0, sizeof(struct MCFsEntry));
+	memcpy(&entry->created, &dirent->stat.ctime, sizeof(struct sceMcStDateTime));
+	memcpy(&entry->modified, &dirent->stat.mtime, sizeof(struct sceMcStDateTime));
+	memcpy(entry->name, dirent->name, sizeof(entry->name));
+	entry->mode = dirent->stat.mode;
+	entry->length = dirent->stat.size;
+}
+
+/* one save file: its entry, then its data padded to a whole cluster */
+static int export_file(mcio_ctx_t *ctx, int dirfd, const char *path, const struct io_dirent *dirent, void *arg)
 {
-	int r, fd, dd, foundfile;
+	int r;
+	FILE *fh = (FILE *)arg;
+	struct MCFsEntry entry;
+
+	if (verbose)
+		printf("Adding %-48s | %8d bytes\n", path, dirent->stat.size);
+
+	psu_entry(&entry, dirent);
+	fwrite(&entry, sizeof(entry), 1, fh);
+
+	uint8_t *p = malloc(dirent->stat.size);
+	if (p == NULL)
+		return -1000;
+
+	r = mcio_mcReadFileAt(ctx, dirfd, dirent->name, p, dirent->stat.size);
+	if (r != (int)dirent->stat.size) {
+		free(p);
+		return (r < 0) ? r : -1001;
+	}
+
+	r = fwrite(p, 1, dirent->stat.size, fh);
+	free(p);
+	if (r != (int)dirent->stat.size)
+		return -1003;
+
+	entry.length = (1024 - (dirent->stat.size % 1024)) % 1024;
+	while(entry.length--)
+		fputc(0xFF, fh);
+
+	/* a save is flat, the content of a subdirectory is not part of it */
+	return 1;
+}
+
+static int cmd_export(mcio_ctx_t *ctx, const char* path, const char* output)
+{
+	int r;
 	struct io_dirent dirent;
 	struct MCFsEntry entry;
-	char filepath[256];
 
-	printf("Exporting '%s' to %s...\n", path, output);
+	if (verbose)
+		printf("Exporting '%s' to %s...\n", path, output);
 
-	dd = mcio_mcDopen(path);
-	if (dd < 0)
-		return dd;
+	// Read main directory entry
+	r = mcio_mcStat(ctx, path, &dirent);
+	if (r < 0)
+		return r;
 
 	FILE *fh = fopen(output, "wb");
-	if (fh == NULL) {
+	if (fh == NULL)
 		return -1002;
-	}
 
-	// Read main directory entry
-	mcio_mcStat(path, &dirent);
-
-	memset(&entry, 0, sizeof(entry));
-	memcpy(&entry.created, &dirent.stat.ctime, sizeof(struct sceMcStDateTime));
-	memcpy(&entry.modified, &dirent.stat.mtime, sizeof(struct sceMcStDateTime));
-	memcpy(entry.name, dirent.name, sizeof(entry.name));
-	entry.mode = dirent.stat.mode;
-	entry.length = dirent.stat.size;
+	psu_entry(&entry, &dirent);
 	fwrite(&entry, sizeof(entry), 1, fh);
 
 	// "."
@@ -246,63 +361,19 @@ static int cmd_export(const char* path, const char* output)
 	strncpy(entry.name, "..", sizeof(entry.name));
 	fwrite(&entry, sizeof(entry), 1, fh);
 
-	do {
-		r = mcio_mcDread(dd, &dirent);
-		foundfile = r;
-		if (r && (strcmp(dirent.name, ".")) && (strcmp(dirent.name, ".."))) {
-			snprintf(filepath, sizeof(filepath), "%s/%s", path, dirent.name);
-			printf("Adding %-48s | %8d bytes\n", filepath, dirent.stat.size);
-
-			mcio_mcStat(filepath, &dirent);
-
-			memset(&entry, 0, sizeof(entry));
-			memcpy(&entry.created, &dirent.stat.ctime, sizeof(struct sceMcStDateTime));
-			memcpy(&entry.modified, &dirent.stat.mtime, sizeof(struct sceMcStDateTime));
-			memcpy(entry.name, dirent.name, sizeof(entry.name));
-			entry.mode = dirent.stat.mode;
-			entry.length = dirent.stat.size;
-			fwrite(&entry, sizeof(entry), 1, fh);
-
-			fd = mcio_mcOpen(filepath, sceMcFileAttrReadable | sceMcFileAttrFile);
-			if (fd < 0)
-				return fd;
-
-			uint8_t *p = malloc(dirent.stat.size);
-			if (p == NULL)
-				return -1000;
-
-			r = mcio_mcRead(fd, p, dirent.stat.size);
-			if (r != (int)dirent.stat.size) {
-				mcio_mcClose(fd);
-				free(p);
-				return -1001;
-			}
-
-			mcio_mcClose(fd);
-
-			r = fwrite(p, 1, dirent.stat.size, fh);
-			if (r != (int)dirent.stat.size) {
-				fclose(fh);
-				free(p);
-				return -1003;
-			}
-			free(p);
-
-			entry.length = (1024 - (dirent.stat.size % 1024)) % 1024;
-			while(entry.length--)
-				fputc(0xFF, fh);
-		}
-	} while (foundfile);
-
-	mcio_mcDclose(dd);
+	r = mcio_mcWalk(ctx, path, export_file, fh);
 	fclose(fh);
 
-	printf("Save succesfully exported to %s.\n", output);
+	if (r < 0)
+		return r;
+
+	if (verbose)
+		printf("Save succesfully exported to %s.\n", output);
 
-	return dd;
+	return 0;
 }
 
-static int cmd_export_icons_png(const char* path)
+static int cmd_export_icons_png(mcio_ctx_t *ctx, const char* path)
 {
 	int r, fd;
 	ps2_IconSys_t iconsys;
@@ -314,23 +385,23 @@ static int cmd_export_icons_png(const char* path)
 	printf("Exporting '%s' icons...\n", path);
 
 	snprintf(filePath, sizeof(filePath), "%s/icon.sys", path);
-	fd = mcio_mcOpen(filePath, sceMcFileAttrReadable | sceMcFileAttrFile);
+	fd = mcio_mcOpen(ctx, filePath, sceMcFileAttrReadable | sceMcFileAttrFile);
 	if (fd < 0)
 		return fd;
 
-	r = mcio_mcRead(fd, &iconsys, sizeof(ps2_IconSys_t));
+	r = mcio_mcRead(ctx, fd, &iconsys, sizeof(ps2_IconSys_t));
 	if (r != (int)sizeof(ps2_IconSys_t)) {
-		mcio_mcClose(fd);
+		mcio_mcClose(ctx, fd);
 		return -1001;
 	}
-	mcio_mcClose(fd);
+	mcio_mcClose(ctx, fd);
 
 	printf("- List icon  : %s\n", fnames[0]);
 	printf("- Copy icon  : %s\n", fnames[1]);
 	printf("- Delete icon: %s\n", fnames[2]);
 
 	for (int i = 0; i < 3; i++) {
-		output = getIconPS2(path, fnames[i]);
+		output = getIconPS2(ctx, path, fnames[i]);
 		if (!output) {
 			return -1002;
 		}
@@ -356,14 +427,14 @@ static int cmd_export_icons_png(const char* path)
 	return 0;
 }
 
-static int cmd_mcformat(void)
+static int cmd_mcformat(mcio_ctx_t *ctx)
 {
 	int r;
 
 	printf("PS2 Memory Card format\n");
 	printf("Formating MC...\n");
 
-	r = mcio_mcFormat();
+	r = mcio_mcFormat(ctx);
 	if (r < 0)
 		return r;
 
@@ -372,63 +443,83 @@ static int cmd_mcformat(void)
 	return 0;
 }
 
-static int cmd_list(char *path)
+static void print_entry(const char *name, const struct io_dirent *dirent)
+{
+	printf("%-32s| %s | ", name, (dirent->stat.mode & sceMcFileAttrSubdir) ? "<dir> " : "<file>");
+	printf("%8d | ", dirent->stat.size);
+	printf("%c%c%c%c%c%c%c | ", (dirent->stat.mode & sceMcFileAttrReadable) ? 'r' : '-', 
+		(dirent->stat.mode & sceMcFileAttrWriteable) ? 'w' : '-',
+		(dirent->stat.mode & sceMcFileAttrExecutable) ? 'x' : '-',
+		(dirent->stat.mode & sceMcFileAttrDupProhibit) ? 'p' : '-',
+		(dirent->stat.mode & sceMcFileAttrHidden) ? 'H' : '-',
+		(dirent->stat.mode & sceMcFileAttrPDAExec) ? 'S' : '-',
+		(dirent->stat.mode & sceMcFileAttrPS1) ? '1' : '-');
+	printf("%02d/%02d/%04d-", dirent->stat.mtime.Month, dirent->stat.mtime.Day, dirent->stat.mtime.Year);
+	printf("%02d:%02d:%02d", dirent->stat.mtime.Hour, dirent->stat.mtime.Min, dirent->stat.mtime.Sec);
+	printf("\n");
+}
+
+static int cmd_list(mcio_ctx_t *ctx, char *path)
 {
 	int r, fd;
 
-	fd = mcio_mcDopen(path);
+	fd = mcio_mcDopen(ctx, path);
 	if (fd >= 0) {
 		struct io_dirent dirent;
 		printf("---------- Filename ----------  |  Type  |   Size   | Attribs | Last Modification (UTC)\n");
 		do {
-			r = mcio_mcDread(fd, &dirent);
+			r = mcio_mcDread(ctx, fd, &dirent);
 			if ((r)) { /* && (strcmp(dirent.name, ".")) && (strcmp(dirent.name, ".."))) { */
-				printf("%-32s| %s | ", dirent.name, (dirent.stat.mode & sceMcFileAttrSubdir) ? "<dir> " : "<file>");
-				printf("%8d | ", dirent.stat.size);
-				printf("%c%c%c%c%c%c%c | ", (dirent.stat.mode & sceMcFileAttrReadable) ? 'r' : '-', 
-					(dirent.stat.mode & sceMcFileAttrWriteable) ? 'w' : '-',
-					(dirent.stat.mode & sceMcFileAttrExecutable) ? 'x' : '-',
-					(dirent.stat.mode & sceMcFileAttrDupProhibit) ? 'p' : '-',
-					(dirent.stat.mode & sceMcFileAttrHidden) ? 'H' : '-',
-					(dirent.stat.mode & sceMcFileAttrPDAExec) ? 'S' : '-',
-					(dirent.stat.mode & sceMcFileAttrPS1) ? '1' : '-');
-				printf("%02d/%02d/%04d-", dirent.stat.mtime.Month, dirent.stat.mtime.Day, dirent.stat.mtime.Year);
-				printf("%02d:%02d:%02d", dirent.stat.mtime.Hour, dirent.stat.mtime.Min, dirent.stat.mtime.Sec);
-				printf("\n");
+				print_entry(dirent.name, &dirent);
 			}
 		} while (r);
 
-		mcio_mcDclose(fd);
+		mcio_mcDclose(ctx, fd);
 	}
 
 	return fd;
 }
 
-static int cmd_extract(char *filepath, char *output)
+static int tree_entry(mcio_ctx_t *ctx, int dirfd, const char *path, const struct io_dirent *dirent, void *arg)
+{
+	(void)ctx;
+	(void)dirfd;
+	(void)arg;
+
+	print_entry(path, dirent);
+
+	return 0;
+}
+
+static int cmd_tree(mcio_ctx_t *ctx, char *path)
+{
+	printf("------------ Path ------------  |  Type  |   Size   | Attribs | Last Modification (UTC)\n");
+
+	return mcio_mcWalk(ctx, path, tree_entry, NULL);
+}
+
+static int cmd_extract(mcio_ctx_t *ctx, char *filepath, char *output)
 {
 	int fd, r;
+	struct io_dirent dirent;
 
 	printf("Reading file: '%s'...\n", filepath);
 
-	fd = mcio_mcOpen(filepath, sceMcFileAttrReadable | sceMcFileAttrFile);
+	fd = mcio_mcStat(ctx, filepath, &dirent);
 	if (fd < 0)
 		return fd;
 
-	int filesize = mcio_mcSeek(fd, 0, SEEK_END);
-	mcio_mcSeek(fd, 0, SEEK_SET);
+	int filesize = dirent.stat.size;
 	uint8_t *p = malloc(filesize);
 	if (p == NULL)
 		return -1000;
 
-	r = mcio_mcRead(fd, p, filesize);
+	r = mcio_mcReadFile(ctx, filepath, p, filesize);
 	if (r != filesize) {
-		mcio_mcClose(fd);
 		free(p);
-		return -1001;
+		return (r < 0) ? r : -1001;
 	}
 
-	mcio_mcClose(fd);
-
 	FILE *fh = fopen(output, "wb");
 	if (fh == NULL) {
 		free(p);
@@ -451,7 +542,7 @@ static int cmd_extract(char *filepath, char *output)
 	return fd;
 }
 
-static int cmd_inject(char *input, char *filepath)
+static int cmd_inject(mcio_ctx_t *ctx, char *input, char *filepath)
 {
 	int fd, r;
 
@@ -485,27 +576,27 @@ static int cmd_inject(char *input, char *filepath)
 
 	printf("Writing data to: '%s'...\n", filepath);
 
-	fd = mcio_mcOpen(filepath, sceMcFileCreateFile | sceMcFileAttrWriteable | sceMcFileAttrFile);
+	fd = mcio_mcOpen(ctx, filepath, sceMcFileCreateFile | sceMcFileAttrWriteable | sceMcFileAttrFile);
 	if (fd < 0) {
 		free(p);
 		return fd;
 	}
 
-	r = mcio_mcWrite(fd, p, filesize);
+	r = mcio_mcWrite(ctx, fd, p, filesize);
 	if (r != filesize) {
-		mcio_mcClose(fd);
+		mcio_mcClose(ctx, fd);
 		free(p);
 		return -1004;
 	}
 
-	mcio_mcClose(fd);
+	mcio_mcClose(ctx, fd);
 
 	free(p);
 
 	return fd;
 }
 
-static int cmd_import(const char *input)
+static int cmd_import(mcio_ctx_t *ctx, const char *input)
 {
 	int fd, r;
 	char filepath[256];
@@ -559,11 +650,17 @@ static int cmd_import(const char *input)
 
 	printf("Writing data to: '/%s'...\n", ps2md->filename);
 
-	r = mcio_mcMkDir(ps2md->filename);
+	r = mcio_begin(ctx);
+	if (r < 0) {
+		free(p);
+		return r;
+	}
+
+	r = mcio_mcMkDir(ctx, ps2md->filename);
 	if (r < 0)
 		fprintf(stderr, "Error: can't create directory '%s'... (%d)\n", ps2md->filename, r);
 	else
-		mcio_mcClose(r);
+		mcio_mcClose(ctx, r);
 
 	for (int i = read_le_uint32((uint8_t*)&ps2md->numberOfFilesInDir); i > 2; i--, ps2fi++)
 	{
@@ -571,39 +668,46 @@ static int cmd_import(const char *input)
 
 		snprintf(filepath, sizeof(filepath), "%s/%s", ps2md->filename, ps2fi->filename);
 		printf("Adding %-48s | %8d bytes\n", filepath, filesize);
-		fd = mcio_mcOpen(filepath, sceMcFileCreateFile | sceMcFileAttrWriteable | sceMcFileAttrFile);
+		fd = mcio_mcOpen(ctx, filepath, sceMcFileCreateFile | sceMcFileAttrWriteable | sceMcFileAttrFile);
 		if (fd < 0) {
+			mcio_abort(ctx);
 			free(p);
 			return fd;
 		}
 
-		r = mcio_mcWrite(fd, &p[read_le_uint32((uint8_t*)&ps2fi->positionInFile)], filesize);
+		r = mcio_mcAllocate(ctx, fd, filesize);
+		if (r == sceMcResSucceed)
+			r = mcio_mcWrite(ctx, fd, &p[read_le_uint32((uint8_t*)&ps2fi->positionInFile)], filesize);
 		if (r != filesize) {
-			mcio_mcClose(fd);
+			mcio_abort(ctx);
 			free(p);
 			return -1004;
 		}
-		mcio_mcClose(fd);
+		mcio_mcClose(ctx, fd);
 
-		mcio_mcStat(filepath, &entry);
+		mcio_mcStat(ctx, filepath, &entry);
 		memcpy(&entry.stat.ctime, &ps2fi->create, sizeof(struct sceMcStDateTime));
 		memcpy(&entry.stat.mtime, &ps2fi->modified, sizeof(struct sceMcStDateTime));
 		entry.stat.mode = read_le_uint32((uint8_t*)&ps2fi->attribute);
-		mcio_mcSetStat(filepath, &entry);
+		mcio_mcSetStat(ctx, filepath, &entry);
 	}
 
-	mcio_mcStat(ps2md->filename, &entry);
+	mcio_mcStat(ctx, ps2md->filename, &entry);
 	memcpy(&entry.stat.ctime, &ps2md->create, sizeof(struct sceMcStDateTime));
 	memcpy(&entry.stat.mtime, &ps2md->modified, sizeof(struct sceMcStDateTime));
 	entry.stat.mode = read_le_uint32((uint8_t*)&ps2md->attribute);
-	mcio_mcSetStat(ps2md->filename, &entry);
+	mcio_mcSetStat(ctx, ps2md->filename, &entry);
 
 	free(p);
 
+	r = mcio_commit(ctx);
+	if (r < 0)
+		return r;
+
 	return fd;
 }
 
-static int cmd_psu_import(const char *input)
+static int cmd_psu_import(mcio_ctx_t *ctx, const char *input)
 {
 	int fd, r;
 	char filepath[256];
@@ -637,11 +741,17 @@ static int cmd_psu_import(const char *input)
 
 	printf("Writing data to: '/%s'...\n", psu_entry.name);
 
-	r = mcio_mcMkDir(psu_entry.name);
+	r = mcio_begin(ctx);
+	if (r < 0) {
+		fclose(fh);
+		return r;
+	}
+
+	r = mcio_mcMkDir(ctx, psu_entry.name);
 	if (r < 0)
 		fprintf(stderr, "Error: can't create directory '%s'... (%d)\n", psu_entry.name, r);
 	else
-		mcio_mcClose(r);
+		mcio_mcClose(ctx, r);
 
 	for (int i = psu_entry.length; i > 2; i--)
 	{
@@ -649,329 +759,995 @@ static int cmd_psu_import(const char *input)
 
 		snprintf(filepath, sizeof(filepath), "%s/%s", psu_entry.name, file_entry.name);
 		printf("Adding %-48s | %8d bytes\n", filepath, file_entry.length);
-		fd = mcio_mcOpen(filepath, sceMcFileCreateFile | sceMcFileAttrWriteable | sceMcFileAttrFile);
+		fd = mcio_mcOpen(ctx, filepath, sceMcFileCreateFile | sceMcFileAttrWriteable | sceMcFileAttrFile);
 		if (fd < 0) {
+			mcio_abort(ctx);
+			fclose(fh);
 			return fd;
 		}
 
 		uint8_t *p = malloc(file_entry.length);
 		fread(p, 1, file_entry.length, fh);
 
-		r = mcio_mcWrite(fd, p, file_entry.length);
+		r = mcio_mcAllocate(ctx, fd, file_entry.length);
+		if (r == sceMcResSucceed)
+			r = mcio_mcWrite(ctx, fd, p, file_entry.length);
 		free(p);
 
 		if (r != (int)file_entry.length) {
-			mcio_mcClose(fd);
+			mcio_abort(ctx);
+			fclose(fh);
 			return -1004;
 		}
-		mcio_mcClose(fd);
+		mcio_mcClose(ctx, fd);
 
-		mcio_mcStat(filepath, &entry);
+		mcio_mcStat(ctx, filepath, &entry);
 		memcpy(&entry.stat.ctime, &file_entry.created, sizeof(struct sceMcStDateTime));
 		memcpy(&entry.stat.mtime, &file_entry.modified, sizeof(struct sceMcStDateTime));
 		entry.stat.mode = file_entry.mode;
-		mcio_mcSetStat(filepath, &entry);
+		mcio_mcSetStat(ctx, filepath, &entry);
 
 		r = 1024 - (file_entry.length % 1024);
 		if(r < 1024)
 			fseek(fh, r, SEEK_CUR);
 	}
 
-	mcio_mcStat(psu_entry.name, &entry);
+	mcio_mcStat(ctx, psu_entry.name, &entry);
 	memcpy(&entry.stat.ctime, &psu_entry.created, sizeof(struct sceMcStDateTime));
 	memcpy(&entry.stat.mtime, &psu_entry.modified, sizeof(struct sceMcStDateTime));
 	entry.stat.mode = psu_entry.mode;
-	mcio_mcSetStat(psu_entry.name, &entry);
+	mcio_mcSetStat(ctx, psu_entry.name, &entry);
+
+	fclose(fh);
+
+	r = mcio_commit(ctx);
+	if (r < 0)
+		return r;
 
 	return fd;
 }
 
-static int cmd_mkdir(char *path)
+static int cmd_mkdir(mcio_ctx_t *ctx, char *path)
 {
 	printf("Creating directory: '%s'...\n", path);
-	return mcio_mcMkDir(path);
+	return mcio_mcMkDir(ctx, path);
 }
 
-static int cmd_rmdir(char *path)
+static int cmd_rmdir(mcio_ctx_t *ctx, char *path)
 {
 	printf("Removing directory: '%s'...\n", path);
-	return mcio_mcRmDir(path);
+	return mcio_mcRmDir(ctx, path);
 }
 
-static int cmd_remove(char *path)
+static int cmd_remove(mcio_ctx_t *ctx, char *path)
 {
 	printf("Removing file: '%s'...\n", path);
-	return mcio_mcRemove(path);
+	return mcio_mcRemove(ctx, path);
 }
 
-static int cmd_crosslink(char *real_filepath, char *dummy_filepath)
+static int cmd_crosslink(mcio_ctx_t *ctx, char *real_filepath, char *dummy_filepath)
 {
 	printf("Cross-linking file: '%s' to '%s'...\n", dummy_filepath, real_filepath);
-	mcio_mcCreateCrossLinkedFile(real_filepath, dummy_filepath);
+	mcio_mcCreateCrossLinkedFile(ctx, real_filepath, dummy_filepath);
 	return 0;
 }
 
 
-int main(int argc, char **argv)
+/* ---- fleet mode: read-only commands over many cards ---------------------- */
+
+static void get_mcio_stats(mcio_ctx_t *ctx, const char **names, uint64_t *count, uint64_t *ns)
 {
-	int r, cmd = CMD_NONE;
-	char **cmd_args = NULL;
-	uint8_t *data = NULL;
+	struct mcio_stat stats[MCIO_STAT_COUNT];
+	int i;
+
+	mcio_getStats(ctx, stats);
+	for (i = 0; i < MCIO_STAT_COUNT; i++) {
+		names[i] = mcio_statName(i);
+		count[i] = stats[i].count;
+		ns[i] = stats[i].ns;
+	}
+}
+
+static void print_mcio_stats(FILE *fp, mcio_ctx_t *ctx, int json, uint64_t elapsed)
+{
+	const char *names[MCIO_STAT_COUNT];
+	uint64_t count[MCIO_STAT_COUNT], ns[MCIO_STAT_COUNT];
+
+	get_mcio_stats(ctx, names, count, ns);
+	print_stats(fp, json, names, count, ns, MCIO_STAT_COUNT, elapsed);
+}
+
+struct fleet {
+	char **cards;
+	int count;
+	int size;
+	int cmd;
+	char **cmd_args;
+	int stats;
+	int next;
+	int failed;
+};
+
+static int fleet_add(struct fleet *fl, const char *path)
+{
+	char **cards;
+
+	if (fl->count == fl->size) {
+		cards = realloc(fl->cards, (fl->size ? fl->size * 2 : 256) * sizeof(char *));
+		if (cards == NULL)
+			return -1;
+		fl->cards = cards;
+		fl->size = fl->size ? fl->size * 2 : 256;
+	}
+
+	fl->cards[fl->count] = strdup(path);
+	if (fl->cards[fl->count] == NULL)
+		return -1;
+	fl->count++;
+
+	return 0;
+}
+
+static int fleet_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* every regular file of a directory, or one path per line of a list file */
+static int read_fleet(struct fleet *fl, const char *source)
+{
+	char path[1024];
+	struct stat st;
+
+	if (stat(source, &st) < 0)
+		return -1;
+
+	if (S_ISDIR(st.st_mode)) {
+		struct dirent *de;
+		DIR *dir = opendir(source);
+		if (dir == NULL)
+			return -1;
+
+		while ((de = readdir(dir)) != NULL) {
+			snprintf(path, sizeof(path), "%s/%s", source, de->d_name);
+			if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && fleet_add(fl, path) < 0) {
+				closedir(dir);
+				return -1;
+			}
+		}
+		closedir(dir);
+
+		qsort(fl->cards, fl->count, sizeof(char *), fleet_cmp);
+		return 0;
+	}
+
+	FILE *fh = fopen(source, "r");
+	if (fh == NULL)
+		return -1;
+
+	while (fgets(path, sizeof(path), fh)) {
+		path[strcspn(path, "\r\n")] = 0;
+		if (path[0] == 0 || path[0] == '#')
+			continue;
+		if (fleet_add(fl, path) < 0) {
+			fclose(fh);
+			return -1;
+		}
+	}
+	fclose(fh);
+
+	return 0;
+}
+
+static void json_string(struct strbuf *out, const char *s)
+{
+	strbuf_printf(out, "\"");
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			strbuf_printf(out, "\\%c", *s);
+		else if ((uint8_t)*s < 0x20)
+			strbuf_printf(out, "\\u%04x", (uint8_t)*s);
+		else
+			strbuf_printf(out, "%c", *s);
+	}
+	strbuf_printf(out, "\"");
+}
+
+static int fleet_list(mcio_ctx_t *ctx, const char *path, struct strbuf *out)
+{
+	int r, fd, n = 0;
+	struct io_dirent dirent;
+
+	fd = mcio_mcDopen(ctx, path);
+	if (fd < 0)
+		return fd;
+
+	strbuf_printf(out, ",\"entries\":[");
+	while ((r = mcio_mcDread(ctx, fd, &dirent)) > 0) {
+		strbuf_printf(out, "%s{\"name\":", n++ ? "," : "");
+		json_string(out, dirent.name);
+		strbuf_printf(out, ",\"mode\":%u,\"size\":%u,\"mtime\":\"%04d-%02d-%02d %02d:%02d:%02d\"}",
+			dirent.stat.mode, dirent.stat.size,
+			dirent.stat.mtime.Year, dirent.stat.mtime.Month, dirent.stat.mtime.Day,
+			dirent.stat.mtime.Hour, dirent.stat.mtime.Min, dirent.stat.mtime.Sec);
+	}
+	strbuf_printf(out, "]");
+
+	mcio_mcDclose(ctx, fd);
+
+	return (r < 0) ? r : 0;
+}
+
+struct fleet_tree {
+	struct strbuf *out;
+	int n;
+};
+
+static int fleet_tree_entry(mcio_ctx_t *ctx, int dirfd, const char *path, const struct io_dirent *dirent, void *arg)
+{
+	struct fleet_tree *t = arg;
+
+	(void)ctx;
+	(void)dirfd;
+
+	strbuf_printf(t->out, "%s{\"path\":", t->n++ ? "," : "");
+	json_string(t->out, path);
+	strbuf_printf(t->out, ",\"mode\":%u,\"size\":%u,\"mtime\":\"%04d-%02d-%02d %02d:%02d:%02d\"}",
+		dirent->stat.mode, dirent->stat.size,
+		dirent->stat.mtime.Year, dirent->stat.mtime.Month, dirent->stat.mtime.Day,
+		dirent->stat.mtime.Hour, dirent->stat.mtime.Min, dirent->stat.mtime.Sec);
+
+	return 0;
+}
+
+/* one card: private read-only mapping, only the pages the command reads are loaded */
+static int fleet_card(struct fleet *fl, const char *card, struct strbuf *out)
+{
+	int r, pagesize, blocksize, cardsize, cardflags;
+	uint8_t *data;
 	size_t dsize;
+	char output[1024];
+	mcio_ctx_t *ctx;
+	uint64_t start = clock_ns();
 
-	printf(PROGRAM_NAME " v" PROGRAM_VER "\n");
+	strbuf_printf(out, "{\"card\":");
+	json_string(out, card);
 
+	if (map_buffer(card, &data, &dsize) < 0) {
+		strbuf_printf(out, ",\"result\":%d}\n", -1000);
+		return -1000;
+	}
 
-	if (argc-- < 3) {
-		print_usage(argc, argv);
+	ctx = mcio_alloc();
+	if (ctx == NULL) {
+		unmap_buffer(data, dsize);
+		strbuf_printf(out, ",\"result\":%d}\n", -1002);
+		return -1002;
+	}
+
+	mcio_setStatsTiming(ctx, fl->stats);
+
+	r = mcio_init(ctx, data, dsize);
+	if (r >= 0 || r == sceMcResNoFormat) {
+		switch (fl->cmd) {
+		case CMD_MCINFO:
+			r = mcio_mcGetInfo(ctx, &pagesize, &blocksize, &cardsize, &cardflags);
+			if (r >= 0)
+				strbuf_printf(out, ",\"pagesize\":%d,\"blocksize\":%d,\"cardsize\":%d,\"cardflags\":%d",
+					pagesize, blocksize, cardsize, cardflags);
+			break;
+		case CMD_MCFREE:
+			r = mcio_mcGetAvailableSpace(ctx, &cardsize);
+			if (r >= 0)
+				strbuf_printf(out, ",\"free_kb\":%d", cardsize / 1024);
+			break;
+		case CMD_LIST:
+			r = fleet_list(ctx, fl->cmd_args[0], out);
+			break;
+		case CMD_TREE: {
+			struct fleet_tree t = { out, 0 };
+			strbuf_printf(out, ",\"entries\":[");
+			r = mcio_mcWalk(ctx, fl->cmd_args[0], fleet_tree_entry, &t);
+			strbuf_printf(out, "]");
+			break;
+		}
+		case CMD_PSU_EXPORT:
+			/* <output directory>/<card file name>.psu */
+			snprintf(output, sizeof(output), "%s/%s.psu", fl->cmd_args[1],
+				strrchr(card, '/') ? strrchr(card, '/') + 1 : card);
+			r = cmd_export(ctx, fl->cmd_args[0], output);
+			if (r >= 0) {
+				strbuf_printf(out, ",\"psu\":");
+				json_string(out, output);
+			}
+			break;
+		}
+	}
+
+	if (fl->stats) {
+		const char *names[MCIO_STAT_COUNT];
+		uint64_t count[MCIO_STAT_COUNT], ns[MCIO_STAT_COUNT];
+
+		get_mcio_stats(ctx, names, count, ns);
+		strbuf_printf(out, ",\"stats\":");
+		format_stats(out, names, count, ns, MCIO_STAT_COUNT, clock_ns() - start);
+	}
+
+	strbuf_printf(out, ",\"result\":%d}\n", (r < 0) ? r : 0);
+
+	mcio_free(ctx);
+	unmap_buffer(data, dsize);
+
+	return r;
+}
+
+static void *fleet_worker(void *arg)
+{
+	struct fleet *fl = (struct fleet *)arg;
+	struct strbuf line;
+	int i, r;
+
+	while ((i = __atomic_fetch_add(&fl->next, 1, __ATOMIC_RELAXED)) < fl->count) {
+		memset(&line, 0, sizeof(line));
+		r = fleet_card(fl, fl->cards[i], &line);
+
+		/* a whole line per write, results of the workers never interleave */
+		if (!line.failed)
+			fwrite(line.buf, 1, line.len, stdout);
+		free(line.buf);
+
+		if (r < 0 || line.failed)
+			__atomic_fetch_add(&fl->failed, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+static int cmd_fleet(const char *source, int threads, int stats, int cmd, char **cmd_args)
+{
+	struct fleet fl;
+	pthread_t *tids;
+	int i, started;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.cmd = cmd;
+	fl.cmd_args = cmd_args;
+	fl.stats = (stats != STATS_NONE);
+
+	if (read_fleet(&fl, source) < 0) {
+		fprintf(stderr, "Error: can't read VMC list '%s'...\n", source);
+		for (i = 0; i < fl.count; i++)
+			free(fl.cards[i]);
+		free(fl.cards);
 		return 1;
 	}
-	else {
-		if (!strcmp(argv[2], "--mc-info") || !strcmp(argv[2], "-i")) {
-			cmd = CMD_MCINFO;
+
+	if (threads <= 0)
+		threads = cpu_count();
+	if (threads > fl.count)
+		threads = fl.count;
+	if (threads < 1)
+		threads = 1;
+
+	verbose = 0;
+
+	tids = calloc(threads, sizeof(pthread_t));
+	started = 0;
+	for (i = 1; tids != NULL && i < threads; i++, started++) {
+		if (pthread_create(&tids[i], NULL, fleet_worker, &fl) != 0)
+			break;
+	}
+
+	/* the calling thread is worker 0 */
+	fleet_worker(&fl);
+
+	for (i = 1; i <= started; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+
+	for (i = 0; i < fl.count; i++)
+		free(fl.cards[i]);
+	free(fl.cards);
+
+	fflush(stdout);
+	if (fl.failed)
+		fprintf(stderr, "Error: %d of %d card(s) failed...\n", fl.failed, fl.count);
+
+	return fl.failed ? 1 : 0;
+}
+
+/* argv[0] is the command, followed by its argc - 1 arguments */
+static int parse_command(int argc, char **argv, char ***cmd_args, int *repair)
+{
+	int cmd = CMD_NONE;
+
+	*cmd_args = NULL;
+	*repair = 0;
+
+	if (!strcmp(argv[0], "--mc-info") || !strcmp(argv[0], "-i")) {
+		cmd = CMD_MCINFO;
+	}
+	else if (!strcmp(argv[0], "--mc-free") || !strcmp(argv[0], "-f")) {
+		cmd = CMD_MCFREE;
+	}
+	else if (!strcmp(argv[0], "--mc-image") || !strcmp(argv[0], "-img")) {
+		if (argc < 2) {
+			return CMD_NONE;
 		}
-		else if (!strcmp(argv[2], "--mc-free") || !strcmp(argv[2], "-f")) {
-			cmd = CMD_MCFREE;
+		cmd = CMD_MCIMG;
+		*cmd_args = &argv[1];
+	}
+	else if (!strcmp(argv[0], "--ecc-image") || !strcmp(argv[0], "-ecc")) {
+		if (argc < 2) {
+			return CMD_NONE;
 		}
-		else if (!strcmp(argv[2], "--mc-image") || !strcmp(argv[2], "-img")) {
-			if (argc < 3) {
-				print_usage(argc, argv);
-				return 1;
-			}
-			cmd = CMD_MCIMG;
-			cmd_args = &argv[3];
+		cmd = CMD_ECC_IMG;
+		*cmd_args = &argv[1];
+	}
+	else if (!strcmp(argv[0], "--convert")) {
+		if (argc < 2) {
+			return CMD_NONE;
 		}
-		else if (!strcmp(argv[2], "--ecc-image") || !strcmp(argv[2], "-ecc")) {
-			if (argc < 3) {
-				print_usage(argc, argv);
-				return 1;
+		cmd = CMD_CONVERT;
+		*cmd_args = &argv[1];
+	}
+	else if (!strcmp(argv[0], "--verify-ecc")) {
+		if (argc > 1) {
+			if (strcmp(argv[1], "--repair")) {
+				return CMD_NONE;
 			}
-			cmd = CMD_ECC_IMG;
-			cmd_args = &argv[3];
+			*repair = 1;
 		}
-		else if (!strcmp(argv[2], "--mc-format")) {
-			cmd = CMD_MCFORMAT;
+		cmd = CMD_VERIFY_ECC;
+	}
+	else if (!strcmp(argv[0], "--mc-format")) {
+		cmd = CMD_MCFORMAT;
+	}
+	else if (!strcmp(argv[0], "--list") || !strcmp(argv[0], "-ls")) {
+		if (argc < 2) {
+			return CMD_NONE;
 		}
-		else if (!strcmp(argv[2], "--list") || !strcmp(argv[2], "-ls")) {
-			if (argc < 3) {
-				print_usage(argc, argv);
-				return 1;
-			}
-			cmd = CMD_LIST;
-			cmd_args = &argv[3];
+		cmd = CMD_LIST;
+		*cmd_args = &argv[1];
+	}
+	else if (!strcmp(argv[0], "--tree")) {
+		if (argc < 2) {
+			return CMD_NONE;
 		}
-		else if (!strcmp(argv[2], "--icons-png")) {
-			if (argc < 3) {
-				print_usage(argc, argv);
-				return 1;
-			}
-			cmd = CMD_ICONS_PNG;
-			cmd_args = &argv[3];
+		cmd = CMD_TREE;
+		*cmd_args = &argv[1];
+	}
+	else if (!strcmp(argv[0], "--icons-png")) {
+		if (argc < 2) {
+			return CMD_NONE;
 		}
-		else if (!strcmp(argv[2], "--extract-file") || !strcmp(argv[2], "-x")) {
-			if (argc < 4) {
-				print_usage(argc, argv);
-				return 1;
-			}
-			cmd = CMD_EXTRACT;
-			cmd_args = &argv[3];
+		cmd = CMD_ICONS_PNG;
+		*cmd_args = &argv[1];
+	}
+	else if (!strcmp(argv[0], "--extract-file") || !strcmp(argv[0], "-x")) {
+		if (argc < 3) {
+			return CMD_NONE;
 		}
-		else if (!strcmp(argv[2], "--inject-file") || !strcmp(argv[2], "-in")) {
-			if (argc < 4) {
-				print_usage(argc, argv);
-				return 1;
-			}
-			cmd = CMD_INJECT;
-			cmd_args = &argv[3];
+		cmd = CMD_EXTRACT;
+		*cmd_args = &argv[1];
+	}
+	else if (!strcmp(argv[0], "--inject-file") || !strcmp(argv[0], "-in")) {
+		if (argc < 3) {
+			return CMD_NONE;
 		}
-		else if (!strcmp(argv[2], "--make-directory") || !strcmp(argv[2], "-mkdir")) {
-			if (argc < 3) {
-				print_usage(argc, argv);
-				return 1;
-			}
-			cmd = CMD_MKDIR;
-			cmd_args = &argv[3];
+		cmd = CMD_INJECT;
+		*cmd_args = &argv[1];
+	}
+	else if (!strcmp(argv[0], "--make-directory") || !strcmp(argv[0], "-mkdir")) {
+		if (argc < 2) {
+			return CMD_NONE;
 		}
-		else if (!strcmp(argv[2], "--remove-directory") || !strcmp(argv[2], "-rmdir")) {
-			if (argc < 3) {
-				print_usage(argc, argv);
-				return 1;
-			}
-			cmd = CMD_RMDIR;
-			cmd_args = &argv[3];
+		cmd = CMD_MKDIR;
+		*cmd_args = &argv[1];
+	}
+	else if (!strcmp(argv[0], "--remove-directory") || !strcmp(argv[0], "-rmdir")) {
+		if (argc < 2) {
+			return CMD_NONE;
 		}
-		else if (!strcmp(argv[2], "--remove") || !strcmp(argv[2], "-rm")) {
-			if (argc < 3) {
-				print_usage(argc, argv);
-				return 1;
-			}
-			cmd = CMD_REMOVE;
-			cmd_args = &argv[3];
+		cmd = CMD_RMDIR;
+		*cmd_args = &argv[1];
+	}
+	else if (!strcmp(argv[0], "--remove") || !strcmp(argv[0], "-rm")) {
+		if (argc < 2) {
+			return CMD_NONE;
 		}
-		else if (!strcmp(argv[2], "--file-crosslink") || !strcmp(argv[2], "-cl")) {
-			if (argc < 4) {
-				print_usage(argc, argv);
-				return 1;
-			}
-			cmd = CMD_CROSSLINK;
-			cmd_args = &argv[3];
+		cmd = CMD_REMOVE;
+		*cmd_args = &argv[1];
+	}
+	else if (!strcmp(argv[0], "--file-crosslink") || !strcmp(argv[0], "-cl")) {
+		if (argc < 3) {
+			return CMD_NONE;
 		}
-		else if (!strcmp(argv[2], "--psu-import") || !strcmp(argv[2], "-pu")) {
-			if (argc < 3) {
-				print_usage(argc, argv);
-				return 1;
-			}
-			cmd = CMD_PSU_IMPORT;
-			cmd_args = &argv[3];
+		cmd = CMD_CROSSLINK;
+		*cmd_args = &argv[1];
+	}
+	else if (!strcmp(argv[0], "--psu-import") || !strcmp(argv[0], "-pu")) {
+		if (argc < 2) {
+			return CMD_NONE;
 		}
-		else if (!strcmp(argv[2], "--psv-import") || !strcmp(argv[2], "-pi")) {
-			if (argc < 3) {
-				print_usage(argc, argv);
-				return 1;
-			}
-			cmd = CMD_PSV_IMPORT;
-			cmd_args = &argv[3];
+		cmd = CMD_PSU_IMPORT;
+		*cmd_args = &argv[1];
+	}
+	else if (!strcmp(argv[0], "--psv-import") || !strcmp(argv[0], "-pi")) {
+		if (argc < 2) {
+			return CMD_NONE;
 		}
-		else if (!strcmp(argv[2], "--psu-export") || !strcmp(argv[2], "-px")) {
-			if (argc < 3) {
-				print_usage(argc, argv);
-				return 1;
-			}
-			cmd = CMD_PSU_EXPORT;
-			cmd_args = &argv[3];
+		cmd = CMD_PSV_IMPORT;
+		*cmd_args = &argv[1];
+	}
+	else if (!strcmp(argv[0], "--psu-export") || !strcmp(argv[0], "-px")) {
+		if (argc < 3) {
+			return CMD_NONE;
+		}
+		cmd = CMD_PSU_EXPORT;
+		*cmd_args = &argv[1];
+	}
+	else if (!strcmp(argv[0], "--batch")) {
+		if (argc < 2)
+			return CMD_NONE;
+		cmd = CMD_BATCH;
+		*cmd_args = &argv[1];
+	}
+
+	return cmd;
+}
+
+static int run_command(mcio_ctx_t *ctx, int cmd, char **cmd_args, int repair, int *damaged)
+{
+	int r = 0;
+
+	if (cmd == CMD_MCINFO) {
+		r = cmd_mcinfo(ctx);
+		if (r < 0)
+			fprintf(stderr, "Error: can't get MC infos... (%d)\n", r);
+	}
+	else if (cmd == CMD_MCFREE) {
+		r = cmd_mcfree(ctx);
+		if (r == sceMcResNoFormat)
+			fprintf(stderr, "Error: memory card is not formatted!\n");
+		else if (r < 0)
+			fprintf(stderr, "Error: can't get MC free space... (%d)\n", r);
+	}
+	else if (cmd == CMD_MCIMG) {
+		r = cmd_mcimg(ctx, cmd_args[0]);
+		if (r < 0)
+			fprintf(stderr, "Error: can't create image file... (%d)\n", r);
+	}
+	else if (cmd == CMD_ECC_IMG) {
+		r = cmd_ecc_img(ctx, cmd_args[0]);
+		if (r < 0)
+			fprintf(stderr, "Error: can't create image file... (%d)\n", r);
+	}
+	else if (cmd == CMD_CONVERT) {
+		r = cmd_convert(ctx, cmd_args[0]);
+		if (r < 0)
+			fprintf(stderr, "Error: can't create image file... (%d)\n", r);
+	}
+	else if (cmd == CMD_VERIFY_ECC) {
+		r = cmd_verify_ecc(ctx, repair, damaged);
+		if (r == sceMcResFailIO)
+			fprintf(stderr, "Error: VMC image has no ECC data...\n");
+		else if (r < 0)
+			fprintf(stderr, "Error: can't verify ECC... (%d)\n", r);
+		else if (*damaged)
+			fprintf(stderr, "Error: %d damaged page(s) left...\n", *damaged);
+	}
+	else if (cmd == CMD_ICONS_PNG) {
+		r = cmd_export_icons_png(ctx, cmd_args[0]);
+		if (r < 0)
+			fprintf(stderr, "Error: can't export icons... (%d)\n", r);
+	}
+	else if (cmd == CMD_PSU_EXPORT) {
+		r = cmd_export(ctx, cmd_args[0], cmd_args[1]);
+		if (r < 0)
+			fprintf(stderr, "Error: can't export save to PSU... (%d)\n", r);
+	}
+	else if (cmd == CMD_MCFORMAT) {
+		r = cmd_mcformat(ctx);
+		if (r < 0)
+			fprintf(stderr, "Error: can't format MC... (%d)\n", r);
+	}
+	else if (cmd == CMD_LIST) {
+		r = cmd_list(ctx, cmd_args[0]);
+		if (r == sceMcResNoFormat)
+			fprintf(stderr, "Error: memory card is not formatted!\n");
+		else if (r == sceMcResNoEntry)
+			fprintf(stderr, "Error: path '%s' not found...\n", cmd_args[0]);
+		else if (r == sceMcResNotDir)
+			fprintf(stderr, "Error: path '%s' is not a directory...\n", cmd_args[0]);
+		else if (r < 0)
+			fprintf(stderr, "Error: can't list directory '%s' (%d)\n", cmd_args[0], r);
+	}
+	else if (cmd == CMD_TREE) {
+		r = cmd_tree(ctx, cmd_args[0]);
+		if (r == sceMcResNoFormat)
+			fprintf(stderr, "Error: memory card is not formatted!\n");
+		else if (r == sceMcResNoEntry)
+			fprintf(stderr, "Error: path '%s' not found...\n", cmd_args[0]);
+		else if (r == sceMcResNotDir)
+			fprintf(stderr, "Error: path '%s' is not a directory...\n", cmd_args[0]);
+		else if (r < 0)
+			fprintf(stderr, "Error: can't walk directory '%s' (%d)\n", cmd_args[0], r);
+	}
+	else if (cmd == CMD_EXTRACT) {
+		r = cmd_extract(ctx, cmd_args[0], cmd_args[1]);
+		if (r == sceMcResNoFormat)
+			fprintf(stderr, "Error: memory card is not formatted!\n");
+		else if (r == sceMcResNotFile)
+			fprintf(stderr, "Error: '%s' is not a file...\n", cmd_args[0]);
+		else if (r < 0)
+			fprintf(stderr, "Error: can't extract file '%s'... (%d)\n", cmd_args[0], r);
+	}
+	else if (cmd == CMD_INJECT) {
+		r = cmd_inject(ctx, cmd_args[0], cmd_args[1]);
+		if (r == sceMcResNoFormat)
+			fprintf(stderr, "Error: memory card is not formatted!\n");
+		else if (r < 0)
+			fprintf(stderr, "Error: can't inject file '%s'... (%d)\n", cmd_args[0], r);
+	}
+	else if (cmd == CMD_MKDIR) {
+		r = cmd_mkdir(ctx, cmd_args[0]);
+		if (r == sceMcResNoFormat)
+			fprintf(stderr, "Error: memory card is not formatted!\n");
+		else if (r < 0)
+			fprintf(stderr, "Error: can't create directory '%s'... (%d)\n", cmd_args[0], r);
+	}
+	else if (cmd == CMD_RMDIR) {
+		r = cmd_rmdir(ctx, cmd_args[0]);
+		if (r == sceMcResNoFormat)
+			fprintf(stderr, "Error: memory card is not formatted!\n");
+		else if (r < 0)
+			fprintf(stderr, "Error: can't remove directory '%s'... (%d)\n", cmd_args[0], r);
+	}
+	else if (cmd == CMD_REMOVE) {
+		r = cmd_remove(ctx, cmd_args[0]);
+		if (r == sceMcResNoFormat)
+			fprintf(stderr, "Error: memory card is not formatted!\n");
+		else if (r < 0)
+			fprintf(stderr, "Error: can't remove file '%s'... (%d)\n", cmd_args[0], r);
+	}
+	else if (cmd == CMD_CROSSLINK) {
+		r = cmd_crosslink(ctx, cmd_args[0], cmd_args[1]);
+		if (r < 0)
+			fprintf(stderr, "Error: can't crosslink file '%s'... (%d)\n", cmd_args[0], r);
+	}
+	else if (cmd == CMD_PSU_IMPORT) {
+		r = cmd_psu_import(ctx, cmd_args[0]);
+		if (r == sceMcResNoFormat)
+			fprintf(stderr, "Error: memory card is not formatted!\n");
+		else if (r < 0)
+			fprintf(stderr, "Error: can't import file '%s'... (%d)\n", cmd_args[0], r);
+	}
+	else if (cmd == CMD_PSV_IMPORT) {
+		r = cmd_import(ctx, cmd_args[0]);
+		if (r == sceMcResNoFormat)
+			fprintf(stderr, "Error: memory card is not formatted!\n");
+		else if (r < 0)
+			fprintf(stderr, "Error: can't import file '%s'... (%d)\n", cmd_args[0], r);
+	}
+
+	return r;
+}
+
+#define BATCH_MAX_ARGS		8
+
+struct batch_cmd {
+	int line;
+	int cmd;
+	int repair;
+	char *text;
+	char **args;
+	char *argv[BATCH_MAX_ARGS];
+};
+
+/* split a line in place: blanks separate words, "double quotes" keep blanks, '#' starts a comment */
+static int split_line(char *line, char **argv, int max)
+{
+	int argc = 0;
+	char *p = line;
+
+	while (*p) {
+		while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+			p++;
+		if (*p == 0 || *p == '#')
+			break;
+		if (argc == max)
+			return -1;
+
+		argv[argc++] = p;
+		if (*p == '"') {
+			argv[argc - 1] = ++p;
+			while (*p && *p != '"')
+				p++;
+			if (*p == 0)
+				return -1;
 		}
 		else {
+			while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+				p++;
+		}
+		if (*p)
+			*p++ = 0;
+	}
+
+	return argc;
+}
+
+static void free_batch(struct batch_cmd *batch, int count)
+{
+	for (int i = 0; i < count; i++)
+		free(batch[i].text);
+	free(batch);
+}
+
+/* parse the whole script up front, nothing touches the card when a line is wrong */
+static struct batch_cmd *read_batch(const char *script, int *count)
+{
+	char line[1024];
+	struct batch_cmd *batch = NULL, *b;
+	int argc, n = 0, lineno = 0;
+	FILE *fh;
+
+	fh = strcmp(script, "-") ? fopen(script, "r") : stdin;
+	if (fh == NULL) {
+		fprintf(stderr, "Error: can't open batch script '%s'...\n", script);
+		return NULL;
+	}
+
+	while (fgets(line, sizeof(line), fh)) {
+		lineno++;
+
+		b = realloc(batch, (n + 1) * sizeof(struct batch_cmd));
+		if (b == NULL)
+			goto fail;
+		batch = b;
+		b = &batch[n];
+		memset(b, 0, sizeof(struct batch_cmd));
+
+		b->text = strdup(line);
+		if (b->text == NULL)
+			goto fail;
+
+		argc = split_line(b->text, b->argv, BATCH_MAX_ARGS);
+		if (argc == 0) {
+			free(b->text);
+			continue;
+		}
+		n++;
+
+		b->line = lineno;
+		if (argc > 0)
+			b->cmd = parse_command(argc, b->argv, &b->args, &b->repair);
+		if (argc < 0 || b->cmd == CMD_NONE || b->cmd == CMD_BATCH) {
+			fprintf(stderr, "Error: %s:%d: invalid command...\n", script, lineno);
+			goto fail;
+		}
+	}
+
+	if (fh != stdin)
+		fclose(fh);
+
+	*count = n;
+	return (batch != NULL) ? batch : calloc(1, sizeof(struct batch_cmd));
+
+fail:
+	if (fh != stdin)
+		fclose(fh);
+	free_batch(batch, n);
+	return NULL;
+}
+
+static int writes_card(int cmd, int repair)
+{
+	return (cmd > CMD_EXTRACT) || repair;
+}
+
+static int cmd_batch(mcio_ctx_t *ctx, struct batch_cmd *batch, int count, int *damaged)
+{
+	int i, r, r2;
+
+	r = mcio_begin(ctx);
+
+	for (i = 0; (i < count) && (r >= 0); i++) {
+		/* whole-card commands see everything written so far, a format drops the open transaction anyway */
+		if ((batch[i].cmd <= CMD_VERIFY_ECC) || (batch[i].cmd == CMD_MCFORMAT)) {
+			r = mcio_commit(ctx);
+			if (r < 0)
+				break;
+			r = run_command(ctx, batch[i].cmd, batch[i].args, batch[i].repair, damaged);
+			r2 = mcio_begin(ctx);
+			if (r >= 0)
+				r = r2;
+		}
+		else
+			r = run_command(ctx, batch[i].cmd, batch[i].args, batch[i].repair, damaged);
+
+		printf("[%d/%d] line %d: %s %s\n", i + 1, count, batch[i].line, batch[i].argv[0], (r < 0) ? "FAILED" : "OK");
+	}
+
+	if (r < 0) {
+		mcio_abort(ctx);
+		if (i < count)
+			printf("Batch stopped, %d command(s) skipped\n", count - i);
+		return r;
+	}
+
+	return mcio_commit(ctx);
+}
+
+static int save_changes(mcio_ctx_t *ctx, const char *path, const uint8_t *data)
+{
+	int r, count;
+	size_t *ranges;
+
+	count = mcio_getDirtyRanges(ctx, NULL, 0);
+	if (count == 0)
+		return 0;
+
+	ranges = malloc(count * 2 * sizeof(size_t));
+	if (ranges == NULL)
+		return -1;
+
+	mcio_getDirtyRanges(ctx, ranges, count);
+	r = update_buffer(path, data, ranges, count);
+	free(ranges);
+
+	if (r == 0)
+		mcio_clearDirty(ctx);
+
+	return r;
+}
+
+int main(int argc, char **argv)
+{
+	int r, cmd = CMD_NONE;
+	char **cmd_args = NULL;
+	uint8_t *data = NULL;
+	size_t dsize;
+	int mapped, writeback, repair = 0, damaged = 0, fast_commit = 0, stats = STATS_NONE;
+	int batch_count = 0;
+	uint64_t start;
+	struct batch_cmd *batch = NULL;
+	mcio_ctx_t *ctx;
+
+	/* fleet results go to stdout as JSON lines, without the banner */
+	if (argc > 1 && !strcmp(argv[1], "--fleet")) {
+		int threads = 0;
+
+		while (argc > 3) {
+			if (argc > 4 && !strcmp(argv[3], "--threads")) {
+				threads = atoi(argv[4]);
+				memmove(&argv[3], &argv[5], (argc - 4) * sizeof(char *));
+				argc -= 2;
+			}
+			else if (parse_stats_option(argv[3]) != STATS_NONE) {
+				stats = STATS_JSON;
+				memmove(&argv[3], &argv[4], (argc - 3) * sizeof(char *));
+				argc--;
+			}
+			else
+				break;
+		}
+
+		cmd = (argc > 3) ? parse_command(argc - 3, &argv[3], &cmd_args, &repair) : CMD_NONE;
+		if (cmd != CMD_MCINFO && cmd != CMD_MCFREE && cmd != CMD_LIST && cmd != CMD_TREE && cmd != CMD_PSU_EXPORT) {
+			printf(PROGRAM_NAME " v" PROGRAM_VER "\n");
 			print_usage(argc, argv);
 			return 1;
 		}
+
+		return cmd_fleet(argv[2], threads, stats, cmd, cmd_args);
+	}
+
+	printf(PROGRAM_NAME " v" PROGRAM_VER "\n");
+
+	/* options between the VMC path and the command */
+	while (argc > 2) {
+		if (!strcmp(argv[2], "--fast-commit"))
+			fast_commit = 1;
+		else if ((r = parse_stats_option(argv[2])) != STATS_NONE)
+			stats = r;
+		else
+			break;
+
+		memmove(&argv[2], &argv[3], (argc - 2) * sizeof(char *));
+		argc--;
 	}
 
-	if (read_buffer(argv[1], &data, &dsize) < 0) {
+	if (argc < 3 || (cmd = parse_command(argc - 2, &argv[2], &cmd_args, &repair)) == CMD_NONE) {
+		print_usage(argc, argv);
+		return 1;
+	}
+
+	writeback = writes_card(cmd, repair);
+
+	if (cmd == CMD_BATCH) {
+		batch = read_batch(cmd_args[0], &batch_count);
+		if (batch == NULL)
+			return 1;
+
+		writeback = 0;
+		for (int i = 0; i < batch_count; i++)
+			writeback |= writes_card(batch[i].cmd, batch[i].repair);
+	}
+
+	start = clock_ns();
+
+	/*
+	 * map the VMC file privately; a successful command that modifies the card then writes
+	 * back only the pages it changed, or in fast commit mode replaces the whole image at once
+	 */
+	mapped = (map_buffer(argv[1], &data, &dsize) == 0);
+	if (!mapped && read_buffer(argv[1], &data, &dsize) < 0) {
 		fprintf(stderr, "Error: failed to open VMC file... (%s)\n", argv[1]);
+		free_batch(batch, batch_count);
+		return 1;
+	}
+
+	ctx = mcio_alloc();
+	if (ctx == NULL) {
+		fprintf(stderr, "Error: out of memory...\n");
+		if (mapped)
+			unmap_buffer(data, dsize);
+		else
+			free(data);
+		free_batch(batch, batch_count);
 		return 1;
 	}
 
-	r = mcio_init(data, dsize);
+	if (fast_commit)
+		mcio_setCommitMode(ctx, MCIO_COMMIT_DIRECT);
+
+	mcio_setStatsTiming(ctx, stats != STATS_NONE);
+
+	r = mcio_init(ctx, data, dsize);
 	/*if (r == sceMcResNoFormat)
 		fprintf(stderr, "Error: memory card not formated...\n");*/
 	if ((r != sceMcResNoFormat) && (r < 0)) {
 		fprintf(stderr, "Error: no PS2 Memory Card detected... (%d)\n", r);
 	}
-	else {
-		if (cmd == CMD_MCINFO) {
-			r = cmd_mcinfo();
-			if (r < 0)
-				fprintf(stderr, "Error: can't get MC infos... (%d)\n", r);
-		}
-		else if (cmd == CMD_MCFREE) {
-			r = cmd_mcfree();
-			if (r == sceMcResNoFormat)
-				fprintf(stderr, "Error: memory card is not formatted!\n");
-			else if (r < 0)
-				fprintf(stderr, "Error: can't get MC free space... (%d)\n", r);
-		}
-		else if (cmd == CMD_MCIMG) {
-			r = cmd_mcimg(cmd_args[0]);
-			if (r < 0)
-				fprintf(stderr, "Error: can't create image file... (%d)\n", r);
-		}
-		else if (cmd == CMD_ECC_IMG) {
-			r = cmd_ecc_img(cmd_args[0]);
-			if (r < 0)
-				fprintf(stderr, "Error: can't create image file... (%d)\n", r);
-		}
-		else if (cmd == CMD_ICONS_PNG) {
-			r = cmd_export_icons_png(cmd_args[0]);
-			if (r < 0)
-				fprintf(stderr, "Error: can't export icons... (%d)\n", r);
-		}
-		else if (cmd == CMD_PSU_EXPORT) {
-			r = cmd_export(cmd_args[0], cmd_args[1]);
-			if (r < 0)
-				fprintf(stderr, "Error: can't export save to PSU... (%d)\n", r);
-		}
-		else if (cmd == CMD_MCFORMAT) {
-			r = cmd_mcformat();
-			if (r < 0)
-				fprintf(stderr, "Error: can't format MC... (%d)\n", r);
-		}
-		else if (cmd == CMD_LIST) {
-			r = cmd_list(cmd_args[0]);
-			if (r == sceMcResNoFormat)
-				fprintf(stderr, "Error: memory card is not formatted!\n");
-			else if (r == sceMcResNoEntry)
-				fprintf(stderr, "Error: path '%s' not found...\n", cmd_args[0]);
-			else if (r == sceMcResNotDir)
-				fprintf(stderr, "Error: path '%s' is not a directory...\n", cmd_args[0]);
-			else if (r < 0)
-				fprintf(stderr, "Error: can't list directory '%s' (%d)\n", cmd_args[0], r);
-		}
-		else if (cmd == CMD_EXTRACT) {
-			r = cmd_extract(cmd_args[0], cmd_args[1]);
-			if (r == sceMcResNoFormat)
-				fprintf(stderr, "Error: memory card is not formatted!\n");
-			else if (r == sceMcResNotFile)
-				fprintf(stderr, "Error: '%s' is not a file...\n", cmd_args[0]);
-			else if (r < 0)
-				fprintf(stderr, "Error: can't extract file '%s'... (%d)\n", cmd_args[0], r);
-		}
-		else if (cmd == CMD_INJECT) {
-			r = cmd_inject(cmd_args[0], cmd_args[1]);
-			if (r == sceMcResNoFormat)
-				fprintf(stderr, "Error: memory card is not formatted!\n");
-			else if (r < 0)
-				fprintf(stderr, "Error: can't inject file '%s'... (%d)\n", cmd_args[0], r);
-		}
-		else if (cmd == CMD_MKDIR) {
-			r = cmd_mkdir(cmd_args[0]);
-			if (r == sceMcResNoFormat)
-				fprintf(stderr, "Error: memory card is not formatted!\n");
-			else if (r < 0)
-				fprintf(stderr, "Error: can't create directory '%s'... (%d)\n", cmd_args[0], r);
-		}
-		else if (cmd == CMD_RMDIR) {
-			r = cmd_rmdir(cmd_args[0]);
-			if (r == sceMcResNoFormat)
-				fprintf(stderr, "Error: memory card is not formatted!\n");
-			else if (r < 0)
-				fprintf(stderr, "Error: can't remove directory '%s'... (%d)\n", cmd_args[0], r);
-		}
-		else if (cmd == CMD_REMOVE) {
-			r = cmd_remove(cmd_args[0]);
-			if (r == sceMcResNoFormat)
-				fprintf(stderr, "Error: memory card is not formatted!\n");
-			else if (r < 0)
-				fprintf(stderr, "Error: can't remove file '%s'... (%d)\n", cmd_args[0], r);
-		}
-		else if (cmd == CMD_CROSSLINK) {
-			r = cmd_crosslink(cmd_args[0], cmd_args[1]);
-			if (r < 0)
-				fprintf(stderr, "Error: can't crosslink file '%s'... (%d)\n", cmd_args[0], r);
-		}
-		else if (cmd == CMD_PSU_IMPORT) {
-			r = cmd_psu_import(cmd_args[0]);
-			if (r == sceMcResNoFormat)
-				fprintf(stderr, "Error: memory card is not formatted!\n");
-			else if (r < 0)
-				fprintf(stderr, "Error: can't import file '%s'... (%d)\n", cmd_args[0], r);
-		}
-		else if (cmd == CMD_PSV_IMPORT) {
-			r = cmd_import(cmd_args[0]);
-			if (r == sceMcResNoFormat)
-				fprintf(stderr, "Error: memory card is not formatted!\n");
-			else if (r < 0)
-				fprintf(stderr, "Error: can't import file '%s'... (%d)\n", cmd_args[0], r);
-		}
+	else if (cmd == CMD_BATCH) {
+		r = cmd_batch(ctx, batch, batch_count, &damaged);
+		if (r < 0)
+			fprintf(stderr, "Error: batch '%s' failed... (%d)\n", cmd_args[0], r);
 	}
+	else
+		r = run_command(ctx, cmd, cmd_args, repair, &damaged);
 
 	/* save changes */
-	if (cmd > CMD_EXTRACT && r == sceMcResSucceed) {
-		write_buffer(argv[1], data, dsize);
-		printf("VMC file saved: %s\n", argv[1]);
+	if (writeback && r == sceMcResSucceed) {
+		if (fast_commit)
+			r = replace_buffer(argv[1], data, dsize);
+		else
+			r = save_changes(ctx, argv[1], data);
+
+		if (r < 0)
+			fprintf(stderr, "Error: failed to save VMC file... (%s)\n", argv[1]);
+		else
+			printf("VMC file saved: %s\n", argv[1]);
 	}
-	free(data);
 
-	if (r < 0)
+	/* load and save included */
+	if (stats != STATS_NONE) {
+		fflush(stdout);
+		print_mcio_stats(stderr, ctx, stats == STATS_JSON, clock_ns() - start);
+		if (stats == STATS_JSON)
+			fputc('\n', stderr);
+	}
+
+	mcio_free(ctx);
+	free_batch(batch, batch_count);
+	if (mapped)
+		unmap_buffer(data, dsize);
+	else
+		free(data);
+
+	if (r < 0 || damaged)
 		return 1;
 
 	return 0;
@@ -26,6 +26,12 @@
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define MCIO_ECC_X86
+#include <immintrin.h>
+#endif
 
 /* Card Flags */
 #define CF_USE_ECC			0x01
@@ -45,9 +51,6 @@
 static const char SUPERBLOCK_MAGIC[]   = "Sony PS2 Memory Card Format ";
 static const char SUPERBLOCK_VERSION[] = "1.2.0.0\0\0\0\0";
 
-static uint8_t *vmc_data = NULL;
-static size_t vmc_size = 0;
-
 struct MCDevInfo {			/* size = 384 */
 	uint8_t  magic[28];		/* Superblock magic, on PS2 MC : "Sony PS2 Memory Card Format " */
 	uint8_t  version[12];		/* Version number of the format used, 1.2 indicates full support for bad_block_list */
@@ -82,14 +85,16 @@ struct MCDevInfo {			/* size = 384 */
 	uint32_t unknown5;
 } __attribute__((packed));
 
-static struct MCDevInfo mcio_devinfo;
-
 struct MCCacheEntry {
 	int32_t   cluster;
 	uint8_t  *cl_data;
 	uint8_t   wr_flag;
 	uint8_t   rd_flag;
-} __attribute__((packed));
+	struct MCCacheEntry  *prev;	/* LRU list, towards the most recently used entry */
+	struct MCCacheEntry  *next;	/* LRU list, towards the least recently used entry */
+	struct MCCacheEntry  *hnext;	/* cluster hash chain */
+	struct MCCacheEntry **hprev;
+};
 
 struct MCCacheDir {
 	int32_t   cluster;
@@ -102,30 +107,26 @@ struct MCFatCluster {
 	int32_t entry[MCIO_CLUSTERFATENTRIES];
 } __attribute__((packed));
 
-#define MAX_CACHEENTRY		36
-static uint8_t mcio_cachebuf[MAX_CACHEENTRY * MCIO_CLUSTERSIZE];
-static struct MCCacheEntry mcio_entrycache[MAX_CACHEENTRY];
-static struct MCCacheEntry *mcio_mccache[MAX_CACHEENTRY];
-
-static struct MCCacheEntry *pmcio_entrycache;
-static struct MCCacheEntry **pmcio_mccache;
+#define MIN_CACHEENTRY		36
 
 struct MCFatCache {
 	int32_t entry[(MCIO_CLUSTERFATENTRIES * 2)+1];
 } __attribute__((packed));
 
-static struct MCFatCache mcio_fatcache;
-
 #define MAX_CACHEDIRENTRY	3
-static struct MCFsEntry mcio_dircache[MAX_CACHEDIRENTRY];
-
 
-static uint8_t mcio_pagebuf[1056];
-static uint8_t *mcio_pagedata[32];
-static uint8_t mcio_eccdata[512]; /* size for 32 ecc */
+struct MCDirIndex {			/* name hash of the live entries of one directory */
+	int32_t   cluster;		/* first cluster of the directory */
+	int32_t   length;		/* directory length when indexed */
+	int32_t   maxent;		/* first entry not in use */
+	uint32_t  hash_mask;
+	uint32_t  lru;
+	int32_t  *buckets;		/* first entry per name hash, -1 terminated chains, NULL when unused */
+	int32_t  *next;
+	char    (*names)[32];
+};
 
-static int32_t mcio_badblock = 0;
-static int32_t mcio_replacementcluster[16];
+#define MAX_DIRINDEX		8
 
 static const uint8_t mcio_xortable[256] = {
 	0x00, 0x87, 0x96, 0x11, 0xA5, 0x22, 0x33, 0xB4,
@@ -163,7 +164,7 @@ static const uint8_t mcio_xortable[256] = {
 };
 
 
-struct MCFHandle { /* size = 48 */
+struct MCFHandle { /* size = 48 on the IOP, plus the cached chain */
 	uint8_t  status;
 	uint8_t  wrflag;
 	uint8_t  rdflag;
@@ -180,12 +181,70 @@ struct MCFHandle { /* size = 48 */
 	uint32_t fsindex;
 	uint32_t parent_cluster;
 	uint32_t parent_fsindex;
+	int32_t *chain;			/* FAT indexes of the file clusters walked so far, from freeclink */
+	int32_t  chain_len;
+	int32_t  chain_size;
+	int32_t  next_free;		/* next slot of the free list, FD_BUSY while the slot is taken */
 };
 
-#define MAX_FDHANDLES	3
-struct MCFHandle mcio_fdhandles[MAX_FDHANDLES];
+#define MIN_FDHANDLES	4
+#define FD_BUSY		-2
+
+struct mcio_ctx {
+	uint8_t *vmc_data;
+	size_t vmc_size;
+
+	struct MCDevInfo devinfo;
+
+	int cache_request;
+	int cache_size;
+	uint8_t *cachebuf;
+	struct MCCacheEntry *entrycache;
+	struct MCCacheEntry mccache;		/* LRU list head, next is the most recently used entry */
+	struct MCCacheEntry **cachehash;
+	uint32_t cachehash_mask;
+
+	struct MCFatCache fatcache;
+	struct MCFsEntry dircache[MAX_CACHEDIRENTRY];
+	struct MCDirIndex dirindex[MAX_DIRINDEX];
+	uint32_t dirindex_lru;
+
+	int32_t fat_length;		/* FAT clusters decoded in fat[], 0 until loaded */
+	int32_t *fat;			/* native endian FAT, indexed like Card_GetFatEntry() */
+	int32_t *fat_clusters;		/* card cluster holding each FAT cluster */
+	uint32_t *fat_dirty;		/* one bit per FAT cluster not yet written back */
+	uint32_t *fat_free;		/* one bit per free allocatable cluster */
+	int32_t fat_freelimit;		/* max_allocatable_clusters covered by fat_free */
+	int32_t fat_freecount;
+
+	uint8_t pagebuf[1056];
+	uint8_t *pagedata[32];
+	uint8_t eccdata[512]; /* size for 32 ecc */
+
+	int32_t badblock;
+	int32_t replacementcluster[16];
+
+	int commit_mode;		/* MCIO_COMMIT_* */
+	int txn_depth;			/* mcio_begin() nesting, write back is deferred while > 0 */
+	int txn_cache_request;		/* cache size to restore when the transaction ends */
+
+	uint64_t wr_bytes;		/* bytes stored to the image */
+	uint32_t wr_blocks;		/* erase blocks committed by Card_FlushCacheEntry() */
+	uint32_t *dirty;		/* one bit per image page stored since mcio_clearDirty() */
+	uint32_t dirty_pages;
+
+	struct mcio_stat stats[MCIO_STAT_COUNT];
+	int stats_timing;
+
+	struct MCFHandle **fdhandles;	/* grown on demand, a handle never moves once allocated */
+	int32_t fdhandles_count;
+	int32_t fdhandles_free;		/* first free slot, -1 when all are taken */
+};
 
-static int Card_FileClose(int fd);
+static int Card_FileClose(mcio_ctx_t *ctx, int fd);
+static void Card_DropFat(mcio_ctx_t *ctx);
+static void Card_InvDirIndex(mcio_ctx_t *ctx, int32_t cluster);
+static int Card_FlushFat(mcio_ctx_t *ctx);
 
 
 static void long_multiply(uint32_t v1, uint32_t v2, uint32_t *HI, uint32_t *LO)
@@ -233,12 +292,136 @@ static void Card_DataChecksum(uint8_t *pagebuf, uint8_t *ecc)
 	p_ecc[2] = ~t0 & 0x7F;
 }
 
+/*
+ * The vector kernels below use the fact that mcio_xortable is linear and that its bit 7 is
+ * the byte parity: the column parity is the table entry of the XOR of all 128 bytes, and
+ * bit k of the line parity is the parity of the bytes whose index has bit k set.
+ */
+static void Card_ChecksumFromParity(uint8_t *ecc, uint8_t column, uint32_t lines, uint32_t odd)
+{
+	uint32_t a3 = (odd) ? ~lines : lines;
+
+	ecc[0] = ~mcio_xortable[column] & 0x77;
+	ecc[1] = ~a3 & 0x7F;
+	ecc[2] = ~lines & 0x7F;
+}
+
+#ifdef MCIO_ECC_X86
+static inline uint64_t mcio_fold128(__m128i v)
+{
+	return (uint64_t)_mm_cvtsi128_si64(v) ^ (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v));
+}
+
+static inline uint8_t mcio_fold64(uint64_t v)
+{
+	v ^= v >> 32;
+	v ^= v >> 16;
+	v ^= v >> 8;
+
+	return v & 0xFF;
+}
+
+static void Card_DataChecksumSSE2(const uint8_t *data, uint8_t *ecc, int chunks)
+{
+	int i;
+	uint32_t lines;
+	__m128i v0, v1, v2, v3, v4, v5, v6, v7, x;
+	/* byte lanes of a 16 byte row whose index has bit 0..3 set */
+	const __m128i m0 = _mm_set1_epi16((short)0xFF00);
+	const __m128i m1 = _mm_set1_epi32((int)0xFFFF0000);
+	const __m128i m2 = _mm_set1_epi64x((long long)0xFFFFFFFF00000000LL);
+	const __m128i m3 = _mm_set_epi64x(-1, 0);
+
+	for (i = 0; i < chunks; i++, data += 128, ecc += 3) {
+		v0 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+		v1 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+		v2 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+		v3 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+		v4 = _mm_loadu_si128((const __m128i *)(data + 0x40));
+		v5 = _mm_loadu_si128((const __m128i *)(data + 0x50));
+		v6 = _mm_loadu_si128((const __m128i *)(data + 0x60));
+		v7 = _mm_loadu_si128((const __m128i *)(data + 0x70));
+
+		/* rows with index bit 4, 5 and 6 set */
+		__m128i y4 = _mm_xor_si128(_mm_xor_si128(v1, v3), _mm_xor_si128(v5, v7));
+		__m128i y5 = _mm_xor_si128(_mm_xor_si128(v2, v3), _mm_xor_si128(v6, v7));
+		__m128i y6 = _mm_xor_si128(_mm_xor_si128(v4, v5), _mm_xor_si128(v6, v7));
+		x = _mm_xor_si128(_mm_xor_si128(_mm_xor_si128(v0, v1), _mm_xor_si128(v2, v3)), y6);
+
+		lines  = __builtin_parityll(mcio_fold128(_mm_and_si128(x, m0)));
+		lines |= __builtin_parityll(mcio_fold128(_mm_and_si128(x, m1))) << 1;
+		lines |= __builtin_parityll(mcio_fold128(_mm_and_si128(x, m2))) << 2;
+		lines |= __builtin_parityll(mcio_fold128(_mm_and_si128(x, m3))) << 3;
+		lines |= __builtin_parityll(mcio_fold128(y4)) << 4;
+		lines |= __builtin_parityll(mcio_fold128(y5)) << 5;
+		lines |= __builtin_parityll(mcio_fold128(y6)) << 6;
+
+		uint64_t all = mcio_fold128(x);
+		Card_ChecksumFromParity(ecc, mcio_fold64(all), lines, __builtin_parityll(all));
+	}
+}
+
+__attribute__((target("avx2")))
+static void Card_DataChecksumAVX2(const uint8_t *data, uint8_t *ecc, int chunks)
+{
+	int i;
+	uint32_t lines;
+	__m256i v0, v1, v2, v3, x, y5, y6;
+	/* byte lanes of a 32 byte row whose index has bit 0..4 set */
+	const __m256i m0 = _mm256_set1_epi16((short)0xFF00);
+	const __m256i m1 = _mm256_set1_epi32((int)0xFFFF0000);
+	const __m256i m2 = _mm256_set1_epi64x((long long)0xFFFFFFFF00000000LL);
+	const __m256i m3 = _mm256_set_epi64x(-1, 0, -1, 0);
+	const __m256i m4 = _mm256_set_epi64x(-1, -1, 0, 0);
+
+	for (i = 0; i < chunks; i++, data += 128, ecc += 3) {
+		v0 = _mm256_loadu_si256((const __m256i *)(data + 0x00));
+		v1 = _mm256_loadu_si256((const __m256i *)(data + 0x20));
+		v2 = _mm256_loadu_si256((const __m256i *)(data + 0x40));
+		v3 = _mm256_loadu_si256((const __m256i *)(data + 0x60));
+
+		y5 = _mm256_xor_si256(v1, v3);
+		y6 = _mm256_xor_si256(v2, v3);
+		x = _mm256_xor_si256(_mm256_xor_si256(v0, v1), y6);
+
+#define mcio_fold256(v)	mcio_fold128(_mm_xor_si128(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)))
+		lines  = __builtin_parityll(mcio_fold256(_mm256_and_si256(x, m0)));
+		lines |= __builtin_parityll(mcio_fold256(_mm256_and_si256(x, m1))) << 1;
+		lines |= __builtin_parityll(mcio_fold256(_mm256_and_si256(x, m2))) << 2;
+		lines |= __builtin_parityll(mcio_fold256(_mm256_and_si256(x, m3))) << 3;
+		lines |= __builtin_parityll(mcio_fold256(_mm256_and_si256(x, m4))) << 4;
+		lines |= __builtin_parityll(mcio_fold256(y5)) << 5;
+		lines |= __builtin_parityll(mcio_fold256(y6)) << 6;
+
+		uint64_t all = mcio_fold256(x);
+#undef mcio_fold256
+		Card_ChecksumFromParity(ecc, mcio_fold64(all), lines, __builtin_parityll(all));
+	}
+}
+#endif
+
+static void Card_PageChecksum(const uint8_t *data, uint8_t *ecc, int chunks) /* ECC of consecutive 128 byte chunks */
+{
+	int i;
+
+#ifdef MCIO_ECC_X86
+	if (__builtin_cpu_supports("avx2"))
+		Card_DataChecksumAVX2(data, ecc, chunks);
+	else
+		Card_DataChecksumSSE2(data, ecc, chunks);
+	return;
+#endif
+
+	for (i = 0; i < chunks; i++)
+		Card_DataChecksum((uint8_t *)data + (i << 7), ecc + (i * 3));
+}
+
 static int Card_CorrectData(uint8_t *pagebuf, uint8_t *ecc)
 {
 	int32_t xor0, xor1, xor2, xor3, xor4;
 	uint8_t eccbuf[12];
 
-	Card_DataChecksum(pagebuf, eccbuf);
+	Card_PageChecksum(pagebuf, eccbuf, 1);
 
 	xor0 = ecc[0] ^ eccbuf[0];
 	xor1 = ecc[1] ^ eccbuf[1];
@@ -251,7 +434,7 @@ static int Card_CorrectData(uint8_t *pagebuf, uint8_t *ecc)
 		return 0;
 
 	if ((xor3 == 0x7f) && (xor4 == 0x7)) {
-		ecc[xor2] ^= 1 << (xor0 >> 4);
+		pagebuf[xor2] ^= 1 << (xor0 >> 4);
 		return -1;
 	}
 
@@ -293,10 +476,14 @@ static int mcio_chrpos(char *str, char chr)
 static void mcio_getmcrtime(struct sceMcStDateTime *mc_time)
 {
 	time_t rawtime;
-	struct tm *ptm;
+	struct tm tm, *ptm = &tm;
 
 	time(&rawtime);
-	ptm = gmtime(&rawtime);
+#ifdef _WIN32
+	gmtime_s(ptm, &rawtime);
+#else
+	gmtime_r(&rawtime, ptm);
+#endif
 
 	mc_time->Resv2 = 0;
 	mc_time->Sec = ptm->tm_sec;
@@ -330,15 +517,15 @@ static void mcio_copy_mcentry(struct MCFsEntry *fse, const struct io_dirent *dir
 	memcpy(&fse->modified, &dirent->stat.mtime, sizeof(struct sceMcStDateTime));
 }
 
-static int Card_GetSpecs(uint16_t *pagesize, uint16_t *blocksize, int32_t *cardsize, uint8_t *flags)
+static int Card_GetSpecs(mcio_ctx_t *ctx, uint16_t *pagesize, uint16_t *blocksize, int32_t *cardsize, uint8_t *flags)
 {
-	if (memcmp(SUPERBLOCK_MAGIC, vmc_data, 28) != 0)
+	if (memcmp(SUPERBLOCK_MAGIC, ctx->vmc_data, 28) != 0)
 		return sceMcResFailDetect2;
 
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)vmc_data;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)ctx->vmc_data;
 
 	// check for non-ECC images
-	*flags = mcdi->cardflags & ((vmc_size % 0x800000 == 0) ? ~CF_USE_ECC : 0xFF);
+	*flags = mcdi->cardflags & ((ctx->vmc_size % 0x800000 == 0) ? ~CF_USE_ECC : 0xFF);
 	*pagesize = read_le_uint16((uint8_t*)&mcdi->pagesize);
 	*blocksize = read_le_uint16((uint8_t*)&mcdi->blocksize);
 	*cardsize = read_le_uint32((uint8_t*)&mcdi->clusters_per_card) * read_le_uint16((uint8_t*)&mcdi->pages_per_cluster);
@@ -346,105 +533,177 @@ static int Card_GetSpecs(uint16_t *pagesize, uint16_t *blocksize, int32_t *cards
 	return sceMcResSucceed;
 }
 
-static int Card_EraseBlock(int32_t block, uint8_t **pagebuf, uint8_t *eccbuf)
+static void Card_BlockChecksum(mcio_ctx_t *ctx, uint8_t **pagebuf, uint8_t *eccbuf) /* spare data of every block page held in pagebuf[] */
 {
-	int32_t size, ecc_offset, page;
-	uint8_t *p_ecc;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	int page;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
+
+	uint16_t blocksize = read_le_uint16((uint8_t *)&mcdi->blocksize);
+	uint16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
+	int sparesize = pagesize >> 5;
+
+	memset(eccbuf, 0, blocksize * sparesize);
+
+	for (page = 0; page < blocksize; page++) {
+		if (pagebuf[page])
+			Card_PageChecksum(pagebuf[page], eccbuf + (page * sparesize), pagesize >> 7);
+	}
+}
+
+static uint64_t Card_StatStart(mcio_ctx_t *ctx) /* start time for Card_Stat(), 0 while timing is off */
+{
+	return (ctx->stats_timing) ? clock_ns() : 0;
+}
+
+static void Card_Stat(mcio_ctx_t *ctx, int stat, uint64_t count, uint64_t start)
+{
+	ctx->stats[stat].count += count;
+	if (start)
+		ctx->stats[stat].ns += clock_ns() - start;
+}
+
+static void Card_StatShared(mcio_ctx_t *ctx, int stat, uint64_t count, uint64_t start) /* Card_Stat() from the page pool threads */
+{
+	__atomic_fetch_add(&ctx->stats[stat].count, count, __ATOMIC_RELAXED);
+	if (start)
+		__atomic_fetch_add(&ctx->stats[stat].ns, clock_ns() - start, __ATOMIC_RELAXED);
+}
+
+static void Card_MarkDirty(mcio_ctx_t *ctx, int32_t page, int32_t count)
+{
+	/* atomic, ECC repair marks pages from several threads */
+	for (; count > 0; page++, count--) {
+		if ((uint32_t)page < ctx->dirty_pages)
+			__atomic_fetch_or(&ctx->dirty[page >> 5], 1U << (page & 31), __ATOMIC_RELAXED);
+	}
+}
+
+static int Card_EraseBlock(mcio_ctx_t *ctx, int32_t block, uint8_t **pagebuf, uint8_t *eccbuf)
+{
+	int32_t page;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
+	uint8_t erased[1024], spare[32];
 
 	uint16_t blocksize = read_le_uint16((uint8_t *)&mcdi->blocksize);
 	uint16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
 	int ecc = (mcdi->cardflags & CF_USE_ECC) ? 1 : 0;
 	int val = (mcdi->cardflags & CF_ERASE_ZEROES) ? 0x00 : 0xFF;
 	int sparesize = pagesize >> 5;
+	uint8_t *p_page = &ctx->vmc_data[block * blocksize * (pagesize + ecc*sparesize)];
 
-	page = block * blocksize;
+	/* the whole block at once, then the spare of an erased page which is the same for all of them */
+	memset(p_page, val, blocksize * (pagesize + ecc*sparesize));
+	ctx->wr_bytes += blocksize * (pagesize + ecc*sparesize);
+	Card_MarkDirty(ctx, block * blocksize, blocksize);
 
-	for (int i = 0; i < blocksize; i++, page++) {
-		memset(&vmc_data[page * (pagesize + ecc*sparesize)], val, pagesize);
+	if (ecc) {
+		memset(erased, val, pagesize);
+		memset(spare, 0, sparesize);
+		Card_PageChecksum(erased, spare, pagesize >> 7);
 
-		if (mcdi->cardflags & CF_USE_ECC)
-		{
-			uint8_t* tmp_ecc = calloc(1, sparesize);
-			p_ecc = tmp_ecc;
-			size = 0;
+		for (page = 0; page < blocksize; page++)
+			memcpy(p_page + (page * (pagesize + sparesize)) + pagesize, spare, sparesize);
+	}
 
-			while (size < pagesize) {
-				Card_DataChecksum(&vmc_data[page * (pagesize + ecc*sparesize)] + size, p_ecc);
-				size += 128;
-				p_ecc += 3;
-			}
+	if (pagebuf && eccbuf) /* This part leave the ecc of each block page in eccbuf */
+		Card_BlockChecksum(ctx, pagebuf, eccbuf);
 
-			memcpy(&vmc_data[page * (pagesize + ecc*sparesize) + pagesize], tmp_ecc, sparesize);
-			free(tmp_ecc);
-		}
-	}
+	return sceMcResSucceed;
+}
+
+static int Card_WriteBlock(mcio_ctx_t *ctx, int32_t block, uint8_t **pagebuf, uint8_t *eccbuf) /* every page of an erase block in one pass */
+{
+	int32_t page;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 
-	if (pagebuf && eccbuf) { /* This part leave the first ecc byte of each block page in eccbuf */
-		memset(eccbuf, 0, 32);
+	uint16_t blocksize = read_le_uint16((uint8_t *)&mcdi->blocksize);
+	uint16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
+	int ecc = (mcdi->cardflags & CF_USE_ECC) ? 1 : 0;
+	int sparesize = pagesize >> 5;
+	uint8_t *p_page = &ctx->vmc_data[block * blocksize * (pagesize + ecc*sparesize)];
+	uint64_t start = Card_StatStart(ctx);
 
-		page = 0;
+	for (page = 0; page < blocksize; page++) {
+		memcpy(p_page, pagebuf[page], pagesize);
+		p_page += pagesize;
 
-		while (page < blocksize) {
-			ecc_offset = page * pagesize;
-			if (ecc_offset < 0)
-				ecc_offset += 0x1f;
-			ecc_offset = ecc_offset >> 5;
-			p_ecc = (uint8_t *)(eccbuf + ecc_offset);
-			size = 0;
-			while (size < pagesize) {
-				if (*pagebuf)
-					Card_DataChecksum((uint8_t *)(*pagebuf + size), p_ecc);
-				size += 128;
-				p_ecc += 3;
-			}
-			pagebuf++;
-			page++;
+		if (ecc) {
+			memcpy(p_page, eccbuf + (page * sparesize), sparesize);
+			p_page += sparesize;
 		}
 	}
+	ctx->wr_bytes += blocksize * (pagesize + ecc*sparesize);
+	Card_MarkDirty(ctx, block * blocksize, blocksize);
+	Card_Stat(ctx, MCIO_STAT_PAGE_WRITE, blocksize, start);
+
+	return sceMcResSucceed;
+}
+
+static int Card_CopyBlock(mcio_ctx_t *ctx, int32_t dst, int32_t src)
+{
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
+
+	uint16_t blocksize = read_le_uint16((uint8_t *)&mcdi->blocksize);
+	uint16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
+	int ecc = (mcdi->cardflags & CF_USE_ECC) ? 1 : 0;
+	size_t size = blocksize * (pagesize + ecc*(pagesize >> 5));
+	uint64_t start = Card_StatStart(ctx);
+
+	memcpy(&ctx->vmc_data[dst * size], &ctx->vmc_data[src * size], size);
+	ctx->wr_bytes += size;
+	Card_MarkDirty(ctx, dst * blocksize, blocksize);
+	Card_Stat(ctx, MCIO_STAT_PAGE_WRITE, blocksize, start);
 
 	return sceMcResSucceed;
 }
 
-static int Card_WritePageData(int32_t page, uint8_t *pagebuf, uint8_t *eccbuf)
+static int Card_WritePageData(mcio_ctx_t *ctx, int32_t page, uint8_t *pagebuf, uint8_t *eccbuf)
 {
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 
 	uint16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
 	int ecc = (mcdi->cardflags & CF_USE_ECC) ? 1 : 0;
 	int sparesize = pagesize >> 5;
+	uint64_t start = Card_StatStart(ctx);
 
-	memcpy(&vmc_data[page * (pagesize + ecc*sparesize)], pagebuf, pagesize);
+	memcpy(&ctx->vmc_data[page * (pagesize + ecc*sparesize)], pagebuf, pagesize);
 
 	if (mcdi->cardflags & CF_USE_ECC)
-		memcpy(&vmc_data[page * (pagesize + ecc*sparesize) + pagesize], eccbuf, sparesize);
+		memcpy(&ctx->vmc_data[page * (pagesize + ecc*sparesize) + pagesize], eccbuf, sparesize);
+
+	ctx->wr_bytes += pagesize + ecc*sparesize;
+	Card_MarkDirty(ctx, page, 1);
+	Card_Stat(ctx, MCIO_STAT_PAGE_WRITE, 1, start);
 
 	return sceMcResSucceed;
 }
 
-static int Card_ReadPageData(int32_t page, uint8_t *pagebuf, uint8_t *eccbuf)
+static int Card_ReadPageData(mcio_ctx_t *ctx, int32_t page, uint8_t *pagebuf, uint8_t *eccbuf)
 {
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 
 	uint16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
 	int ecc = (mcdi->cardflags & CF_USE_ECC) ? 1 : 0;
 	int sparesize = pagesize >> 5;
+	uint64_t start = Card_StatStart(ctx);
 
-	memcpy(pagebuf, &vmc_data[page * (pagesize + ecc*sparesize)], pagesize);
+	memcpy(pagebuf, &ctx->vmc_data[page * (pagesize + ecc*sparesize)], pagesize);
 
 	if (mcdi->cardflags & CF_USE_ECC)
-		memcpy(eccbuf, &vmc_data[page * (pagesize + ecc*sparesize) + pagesize], sparesize);
+		memcpy(eccbuf, &ctx->vmc_data[page * (pagesize + ecc*sparesize) + pagesize], sparesize);
+
+	Card_StatShared(ctx, MCIO_STAT_PAGE_READ, 1, start);
 
 	return sceMcResSucceed;
 }
 
-static int Card_SetDeviceSpecs(void)
+static int Card_SetDeviceSpecs(mcio_ctx_t *ctx)
 {
 	int32_t cardsize;
 	uint16_t blocksize, pages_per_cluster;
-	struct MCDevInfo *mcdi = &mcio_devinfo;
+	struct MCDevInfo *mcdi = &ctx->devinfo;
 
-	if (Card_GetSpecs((void*) &mcdi->pagesize, (void*) &mcdi->blocksize, &cardsize, &mcdi->cardflags) != sceMcResSucceed)
+	if (Card_GetSpecs(ctx, (void*) &mcdi->pagesize, (void*) &mcdi->blocksize, &cardsize, &mcdi->cardflags) != sceMcResSucceed)
 		return sceMcResFullDevice;
 
 	append_le_uint16((uint8_t *)&mcdi->pages_per_cluster, MCIO_CLUSTERSIZE / read_le_uint16((uint8_t *)&mcdi->pagesize));
@@ -463,12 +722,13 @@ static int Card_SetDeviceSpecs(void)
 	return sceMcResSucceed;
 }
 
-static int Card_ReadPage(int32_t page, uint8_t *pagebuf)
+static int Card_ReadPage(mcio_ctx_t *ctx, int32_t page, uint8_t *pagebuf)
 {
-	int r, index, ecres, retries, count, erase_byte;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	int r, index, ecres, retries, count, erase_byte, fixed;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 	uint8_t eccbuf[32];
 	uint8_t *pdata, *peccb;
+	uint64_t start;
 
 	uint16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
 	count = pagesize >> 7;
@@ -477,7 +737,7 @@ static int Card_ReadPage(int32_t page, uint8_t *pagebuf)
 	retries = 0;
 	ecres = sceMcResSucceed;
 	do {
-		if (Card_ReadPageData(page, pagebuf, eccbuf) == sceMcResSucceed) {
+		if (Card_ReadPageData(ctx, page, pagebuf, eccbuf) == sceMcResSucceed) {
 			if (mcdi->cardflags & CF_USE_ECC) { /* checking ECC from spare data block */
 				/* check for erased page (last byte of spare data set to 0xFF or 0x0) */
 				int32_t sparesize = pagesize >> 5;
@@ -487,16 +747,24 @@ static int Card_ReadPage(int32_t page, uint8_t *pagebuf)
 				index = 0;
 				peccb = (uint8_t *)eccbuf;
 				pdata = (uint8_t *)pagebuf;
+				fixed = 0;
+				start = Card_StatStart(ctx);
 
 				while (index++ < count) {
 					r = Card_CorrectData(pdata, peccb);
 					if (r < ecres)
 						ecres = r;
+					if ((r == -1) || (r == -2))
+						fixed++;
 
 					peccb += 3;
 					pdata += 128;
 				} ;
 
+				Card_StatShared(ctx, MCIO_STAT_ECC_CHECK, count, start);
+				if (fixed)
+					Card_StatShared(ctx, MCIO_STAT_ECC_CORRECT, fixed, 0);
+
 				if (ecres == sceMcResSucceed)
 					break;
 
@@ -513,121 +781,165 @@ static int Card_ReadPage(int32_t page, uint8_t *pagebuf)
 	return (ecres != sceMcResSucceed) ? sceMcResNoFormat : sceMcResChangedCard;
 }
 
-static void Card_InitCache(void)
+static void Card_LinkCacheEntry(mcio_ctx_t *ctx, struct MCCacheEntry *mce) /* insert as most recently used */
+{
+	mce->prev = &ctx->mccache;
+	mce->next = ctx->mccache.next;
+	ctx->mccache.next->prev = mce;
+	ctx->mccache.next = mce;
+}
+
+static void Card_UnlinkCacheEntry(struct MCCacheEntry *mce)
+{
+	mce->prev->next = mce->next;
+	mce->next->prev = mce->prev;
+}
+
+static void Card_HashCacheEntry(mcio_ctx_t *ctx, struct MCCacheEntry *mce)
+{
+	struct MCCacheEntry **bucket = &ctx->cachehash[mce->cluster & ctx->cachehash_mask];
+
+	mce->hnext = *bucket;
+	mce->hprev = bucket;
+	if (*bucket)
+		(*bucket)->hprev = &mce->hnext;
+	*bucket = mce;
+}
+
+static void Card_UnhashCacheEntry(struct MCCacheEntry *mce)
+{
+	*mce->hprev = mce->hnext;
+	if (mce->hnext)
+		mce->hnext->hprev = mce->hprev;
+	mce->hnext = NULL;
+	mce->hprev = NULL;
+}
+
+static void Card_FreeCache(mcio_ctx_t *ctx)
 {
-	int i, j;
+	free(ctx->cachebuf);
+	free(ctx->entrycache);
+	free(ctx->cachehash);
+
+	ctx->cachebuf = NULL;
+	ctx->entrycache = NULL;
+	ctx->cachehash = NULL;
+	ctx->cache_size = 0;
+}
+
+static int Card_InitCache(mcio_ctx_t *ctx)
+{
+	int i, size;
+	uint32_t buckets;
 	uint8_t *p;
 
-	j = MAX_CACHEENTRY - 1;
-	p = (uint8_t *)mcio_cachebuf;
+	size = ctx->cache_request;
+	if (size <= 0)
+		size = ctx->vmc_size / MCIO_CLUSTERSIZE; /* whole card resident */
+	if (size < MIN_CACHEENTRY)
+		size = MIN_CACHEENTRY;
+
+	for (buckets = 1; buckets < (uint32_t)size; buckets <<= 1)
+		;
+
+	Card_FreeCache(ctx);
+	Card_DropFat(ctx);
+	Card_InvDirIndex(ctx, -1);
+
+	ctx->cachebuf = (uint8_t *)calloc(size, MCIO_CLUSTERSIZE);
+	ctx->entrycache = (struct MCCacheEntry *)calloc(size, sizeof(struct MCCacheEntry));
+	ctx->cachehash = (struct MCCacheEntry **)calloc(buckets, sizeof(struct MCCacheEntry *));
+
+	if (!ctx->cachebuf || !ctx->entrycache || !ctx->cachehash) {
+		Card_FreeCache(ctx);
+		return sceMcResFailIO;
+	}
+
+	ctx->cache_size = size;
+	ctx->cachehash_mask = buckets - 1;
+	ctx->mccache.next = &ctx->mccache;
+	ctx->mccache.prev = &ctx->mccache;
 
-	for (i = 0; i < MAX_CACHEENTRY; i++) {
-		mcio_entrycache[i].cl_data = (uint8_t *)p;
-		mcio_mccache[i] = (struct MCCacheEntry *)&mcio_entrycache[j - i];
-		mcio_entrycache[i].cluster = -1;
+	p = (uint8_t *)ctx->cachebuf;
+
+	for (i = 0; i < size; i++) {
+		ctx->entrycache[i].cl_data = (uint8_t *)p;
+		ctx->entrycache[i].cluster = -1;
+		Card_LinkCacheEntry(ctx, &ctx->entrycache[i]);
 		p += MCIO_CLUSTERSIZE;
 	}
 
-	pmcio_entrycache = (struct MCCacheEntry *)mcio_entrycache;
-	pmcio_mccache = (struct MCCacheEntry **)mcio_mccache;
+	append_le_uint32((uint8_t *)&ctx->devinfo.unknown3, -1);
+	append_le_uint32((uint8_t *)&ctx->devinfo.unknown4, -1);
+	append_le_uint32((uint8_t *)&ctx->devinfo.unknown5, -1);
 
-	append_le_uint32((uint8_t *)&mcio_devinfo.unknown3, -1);
-	append_le_uint32((uint8_t *)&mcio_devinfo.unknown4, -1);
-	append_le_uint32((uint8_t *)&mcio_devinfo.unknown5, -1);
+	memset((void *)&ctx->fatcache, -1, sizeof(ctx->fatcache));
 
-	memset((void *)&mcio_fatcache, -1, sizeof(mcio_fatcache));
+	append_le_uint32((uint8_t *)&ctx->fatcache.entry[0], 0);
 
-	append_le_uint32((uint8_t *)&mcio_fatcache.entry[0], 0);
+	return sceMcResSucceed;
 }
 
-static int Card_ClearCache(void)
+static int Card_ClearCache(mcio_ctx_t *ctx)
 {
-	int i, j;
-	struct MCCacheEntry **pmce = (struct MCCacheEntry **)pmcio_mccache;
-	struct MCCacheEntry *mce, *mce_save;
+	int i;
+	struct MCCacheEntry *mce;
 
-	for (i = MAX_CACHEENTRY - 1; i >= 0; i--) {
-		mce = (struct MCCacheEntry *)pmce[i];
+	for (i = 0; i < ctx->cache_size; i++) {
+		mce = (struct MCCacheEntry *)&ctx->entrycache[i];
 		if (mce->cluster >= 0) {
+			Card_UnhashCacheEntry(mce);
 			mce->wr_flag = 0;
 			mce->cluster = -1;
 		}
 	}
 
-	for (i = 0; i < (MAX_CACHEENTRY - 1); i++) {
-		mce = mce_save = (struct MCCacheEntry *)pmce[i];
-		if (mce->cluster < 0) {
-			for (j = i+1; j < MAX_CACHEENTRY; j++) {
-				mce = (struct MCCacheEntry *)pmce[j];
-				if (mce->cluster >= 0)
-					break;
-			}
-			if (j == MAX_CACHEENTRY)
-				break;
-
-			pmce[i] = (struct MCCacheEntry *)pmce[j];
-			pmce[j] = (struct MCCacheEntry *)mce_save;
-		}
-	}
+	Card_DropFat(ctx);
+	Card_InvDirIndex(ctx, -1);
 
-	memset((void *)&mcio_fatcache, -1, sizeof(mcio_fatcache));
+	memset((void *)&ctx->fatcache, -1, sizeof(ctx->fatcache));
 
-	append_le_uint32((uint8_t *)&mcio_fatcache.entry[0], 0);
+	append_le_uint32((uint8_t *)&ctx->fatcache.entry[0], 0);
 
 	return sceMcResSucceed;
 }
 
-static struct MCCacheEntry *Card_GetCacheEntry(int32_t cluster)
+static struct MCCacheEntry *Card_GetCacheEntry(mcio_ctx_t *ctx, int32_t cluster)
 {
-	int i;
-	struct MCCacheEntry *mce = (struct MCCacheEntry *)pmcio_entrycache;
+	struct MCCacheEntry *mce = ctx->cachehash[cluster & ctx->cachehash_mask];
 
-	for (i = 0; i < MAX_CACHEENTRY; i++) {
+	while (mce != NULL) {
 		if (mce->cluster == cluster)
 			return mce;
-		mce++;
+		mce = mce->hnext;
 	}
 
 	return NULL;
 }
 
-static void Card_FreeCluster(int32_t cluster) /* release cluster from entrycache */
+static void Card_FreeCluster(mcio_ctx_t *ctx, int32_t cluster) /* release cluster from entrycache */
 {
-	int i;
-	struct MCCacheEntry *mce = (struct MCCacheEntry *)pmcio_entrycache;
+	struct MCCacheEntry *mce = Card_GetCacheEntry(ctx, cluster);
 
-	for (i = 0; i < MAX_CACHEENTRY; i++) {
-		if (mce->cluster == cluster) {
-			mce->cluster = -1;
-			mce->wr_flag = 0;
-		}
-		mce++;
+	if (mce != NULL) {
+		Card_UnhashCacheEntry(mce);
+		mce->cluster = -1;
+		mce->wr_flag = 0;
 	}
 }
 
-static void Card_AddCacheEntry(struct MCCacheEntry *mce)
+static void Card_AddCacheEntry(mcio_ctx_t *ctx, struct MCCacheEntry *mce)
 {
-	int i;
-	struct MCCacheEntry **pmce = (struct MCCacheEntry **)pmcio_mccache;
-
-	for (i = MAX_CACHEENTRY-1; i >= 0; i--) {
-		if (pmce[i] == mce)
-			break;
-	}
-
-	for ( ; i != 0; i--) {
-		pmce[i] = pmce[i-1];
-	}
-
-	pmce[0] = (struct MCCacheEntry *)mce;
+	Card_UnlinkCacheEntry(mce);
+	Card_LinkCacheEntry(ctx, mce);
 }
 
-static int Card_ReplaceBackupBlock(int32_t block)
+static int Card_ReplaceBackupBlock(mcio_ctx_t *ctx, int32_t block)
 {
 	int i;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 
-	if (mcio_badblock > 0)
+	if (ctx->badblock > 0)
 		return sceMcResFailReplace;
 
 	for (i = 0; i < 16; i++) {
@@ -645,7 +957,7 @@ static int Card_ReplaceBackupBlock(int32_t block)
 
 		append_le_uint32((uint8_t *)&mcdi->alloc_end, alloc_end - 8);
 		append_le_uint32((uint8_t *)&mcdi->bad_block_list[i], block);
-		mcio_badblock = -1;
+		ctx->badblock = -1;
 
 		uint32_t clusters_per_block = read_le_uint32((uint8_t *)&mcdi->clusters_per_block);
 
@@ -655,11 +967,11 @@ static int Card_ReplaceBackupBlock(int32_t block)
 	return sceMcResFullDevice;
 }
 
-static int Card_FillBackupBlock1(int32_t block, uint8_t **pagedata, uint8_t *eccdata)
+static int Card_FillBackupBlock1(mcio_ctx_t *ctx, int32_t block, uint8_t **pagedata, uint8_t *eccdata)
 {
 	int r, i;
 	int32_t sparesize, page_offset;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 	uint8_t *p_ecc;
 
 	int16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
@@ -671,17 +983,17 @@ static int Card_FillBackupBlock1(int32_t block, uint8_t **pagedata, uint8_t *ecc
 	uint32_t clusters_per_block = read_le_uint32((uint8_t *)&mcdi->clusters_per_block);
 	uint16_t blocksize = read_le_uint16((uint8_t *)&mcdi->blocksize);
 
-	if ((mcio_badblock != 0) && (mcio_badblock != block))
+	if ((ctx->badblock != 0) && (ctx->badblock != block))
 		return sceMcResFailReplace;
 
 	if ((int32_t)(alloc_offset / clusters_per_block) == block) /* this refuse to take care of a bad rootdir cluster */
 		return sceMcResFailReplace;
 
-	r = Card_EraseBlock(backup_block2, NULL, NULL);
+	r = Card_EraseBlock(ctx, backup_block2, NULL, NULL);
 	if (r != sceMcResSucceed)
 		return r;
 
-	r = Card_EraseBlock(backup_block1, NULL, NULL);
+	r = Card_EraseBlock(ctx, backup_block1, NULL, NULL);
 	if (r != sceMcResSucceed)
 		return r;
 
@@ -697,37 +1009,40 @@ static int Card_FillBackupBlock1(int32_t block, uint8_t **pagedata, uint8_t *ecc
 	p_ecc = (uint8_t *)eccdata;
 
 	for (i = 0; i < blocksize; i++) {
-		r = Card_WritePageData(page_offset + i, pagedata[i], p_ecc);
+		r = Card_WritePageData(ctx, page_offset + i, pagedata[i], p_ecc);
 		if (r != sceMcResSucceed)
 			return r;
 		p_ecc += sparesize;
 	}
 
-	mcio_badblock = block;
+	ctx->badblock = block;
 
 	i = 15;
 	do {
-		mcio_replacementcluster[i] = 0;
+		ctx->replacementcluster[i] = 0;
 	} while (--i >= 0);
 
 	return sceMcResSucceed;
 }
 
-static int Card_FlushCacheEntry(struct MCCacheEntry *mce)
+static int Card_FlushCacheEntry(mcio_ctx_t *ctx, struct MCCacheEntry *mce)
 {
-	int r, i, j, ecc_count;
-	int temp1, temp2, offset, pageindex;
-	int32_t clusters_per_block, blocksize, cardtype, pagesize, sparesize, flag, cluster, block;
+	int r, i, j;
+	int offset, pageindex;
+	int32_t clusters_per_block, blocksize, cardtype, pagesize, flag, cluster, block;
 	struct MCCacheEntry *pmce[16];
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 	struct MCCacheEntry *mcee;
 	uint8_t mcio_backupbuf[16384];
 	uint8_t eccbuf[32];
 	uint8_t *p_page, *p_ecc;
+	uint64_t start;
 
 	if (mce->wr_flag == 0)
 		return sceMcResSucceed;
 
+	start = Card_StatStart(ctx);
+
 	pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
 	int16_t pages_per_cluster = (int16_t)read_le_uint16((uint8_t *)&mcdi->pages_per_cluster);
 	cardtype = mcdi->cardtype;
@@ -743,27 +1058,18 @@ static int Card_FlushCacheEntry(struct MCCacheEntry *mce)
 	clusters_per_block = (int32_t)read_le_uint32((uint8_t *)&mcdi->clusters_per_block);
 	block = mce->cluster / clusters_per_block;
 	blocksize = read_le_uint16((uint8_t *)&mcdi->blocksize);
-	sparesize = pagesize >> 5;
 	flag = 0;
 
 	memset((void *)pmce, 0, sizeof(pmce));
 
-	i = 0;
-	if (MAX_CACHEENTRY > 0) {
-		mcee = (struct MCCacheEntry *)pmcio_entrycache;
-		do {
-			if (mcee->wr_flag == mce->wr_flag) {
-				temp1 = mcee->cluster / clusters_per_block;
-				temp2 = mcee->cluster % clusters_per_block;
-
-				if (temp1 == block) {
-					pmce[temp2] = (struct MCCacheEntry *)mcee;
-					if (mcee->rd_flag == 0)
-						flag = 1;
-				}
-			}
-			mcee++;
-		} while (++i < MAX_CACHEENTRY);
+	/* gather the cached clusters of the erase block which share the same write state */
+	for (i = 0; i < clusters_per_block; i++) {
+		mcee = Card_GetCacheEntry(ctx, (block * clusters_per_block) + i);
+		if ((mcee != NULL) && (mcee->wr_flag == mce->wr_flag)) {
+			pmce[i] = (struct MCCacheEntry *)mcee;
+			if (mcee->rd_flag == 0)
+				flag = 1;
+		}
 	}
 
 	if (clusters_per_block > 0) {
@@ -776,7 +1082,7 @@ static int Card_FlushCacheEntry(struct MCCacheEntry *mce)
 				j = 0;
 				offset = 0;
 				for (j = 0; j < pages_per_cluster; j++) {
-					mcio_pagedata[pageindex + j] = (uint8_t *)(pmce[i]->cl_data + offset);
+					ctx->pagedata[pageindex + j] = (uint8_t *)(pmce[i]->cl_data + offset);
 					offset += pagesize;
 				}
 			}
@@ -784,9 +1090,9 @@ static int Card_FlushCacheEntry(struct MCCacheEntry *mce)
 				j = 0;
 				do {
 					offset = (pageindex + j) * pagesize;
-					mcio_pagedata[pageindex + j] = (uint8_t *)(mcio_backupbuf + offset);
+					ctx->pagedata[pageindex + j] = (uint8_t *)(mcio_backupbuf + offset);
 
-					r = Card_ReadPage(((cluster + i) * pages_per_cluster) + j, mcio_backupbuf + offset);
+					r = Card_ReadPage(ctx, ((cluster + i) * pages_per_cluster) + j, mcio_backupbuf + offset);
 					if (r != sceMcResSucceed)
 						return -51;
 				} while (++j < pages_per_cluster);
@@ -796,70 +1102,49 @@ static int Card_FlushCacheEntry(struct MCCacheEntry *mce)
 		} while (++i < clusters_per_block);
 	}
 
-lbl1:
-	if ((flag != 0) && (mcio_badblock <= 0)) {
-		r = Card_EraseBlock(backup_block1, (uint8_t **)mcio_pagedata, mcio_eccdata);
-		if (r == sceMcResFailReplace) {
-lbl2:
-			r = Card_ReplaceBackupBlock(backup_block1);
-			append_le_uint32((uint8_t *)&mcdi->backup_block1, r);
-			backup_block1 = r;
-			goto lbl1;
-		}
-		if (r != sceMcResSucceed)
-			return -52;
+	/* spare data is computed once, the block is then laid out whole in backup_block1 and/or in place */
+	Card_BlockChecksum(ctx, (uint8_t **)ctx->pagedata, ctx->eccdata);
 
-		append_le_uint32((uint8_t *)&mcio_pagebuf, block | 0x80000000);
-		p_page = (uint8_t *)mcio_pagebuf;
+lbl1:
+	if ((flag != 0) && (ctx->badblock <= 0) && (ctx->commit_mode == MCIO_COMMIT_BACKUP)) {
+		append_le_uint32((uint8_t *)&ctx->pagebuf, block | 0x80000000);
+		p_page = (uint8_t *)ctx->pagebuf;
 		p_ecc = (uint8_t *)eccbuf;
 
-		i = 0;
-		do {
-			if (pagesize < 0)
-				ecc_count = (pagesize + 0x7f) >> 7;
-			else
-				ecc_count = pagesize >> 7;
-
-			if (i >= ecc_count)
-				break;
-
-			Card_DataChecksum(p_page, p_ecc);
-
-			p_ecc += 3;
-			p_page += 128;
-			i++;
-		} while (1);
+		Card_PageChecksum(p_page, p_ecc, pagesize >> 7);
 
-		r = Card_WritePageData(backup_block2 * blocksize, mcio_pagebuf, eccbuf);
+		r = Card_WritePageData(ctx, backup_block2 * blocksize, ctx->pagebuf, eccbuf);
 		if (r == sceMcResFailReplace)
 			goto lbl3;
 		if (r != sceMcResSucceed)
 			return -53;
 
-		if (r < blocksize) {
-			i = 0;
-			p_ecc = (void *)mcio_eccdata;
-
-			do {
-				r = Card_WritePageData((backup_block1 * blocksize) + i, mcio_pagedata[i], p_ecc);
-				if (r == sceMcResFailReplace)
-					goto lbl2;
-				if (r != sceMcResSucceed)
-					return -54;
-				p_ecc += sparesize;
-			} while (++i < blocksize);
+		r = Card_WriteBlock(ctx, backup_block1, (uint8_t **)ctx->pagedata, ctx->eccdata);
+		if (r == sceMcResFailReplace) {
+			r = Card_ReplaceBackupBlock(ctx, backup_block1);
+			append_le_uint32((uint8_t *)&mcdi->backup_block1, r);
+			backup_block1 = r;
+			goto lbl1;
 		}
+		if (r != sceMcResSucceed)
+			return -54;
 
-		r = Card_WritePageData((backup_block2 * blocksize) + 1, mcio_pagebuf, eccbuf);
+		r = Card_WritePageData(ctx, (backup_block2 * blocksize) + 1, ctx->pagebuf, eccbuf);
 		if (r == sceMcResFailReplace)
 			goto lbl3;
 		if (r != sceMcResSucceed)
 			return -55;
+
+		/* the backup copy is the assembled block */
+		r = Card_CopyBlock(ctx, block, backup_block1);
+		if (r == sceMcResSucceed)
+			Card_Stat(ctx, MCIO_STAT_BACKUP_WRITE, 1, 0);
 	}
+	else
+		r = Card_WriteBlock(ctx, block, (uint8_t **)ctx->pagedata, ctx->eccdata);
 
-	r = Card_EraseBlock(block, (uint8_t **)mcio_pagedata, mcio_eccdata);
 	if (r == sceMcResFailReplace) {
-		r = Card_FillBackupBlock1(block, (uint8_t **)mcio_pagedata, mcio_eccdata);
+		r = Card_FillBackupBlock1(ctx, block, (uint8_t **)ctx->pagedata, ctx->eccdata);
 		for (i = 0; i < clusters_per_block; i++) {
 			if (pmce[i] != 0)
 				pmce[i]->wr_flag = 0;
@@ -871,53 +1156,8 @@ lbl2:
 	if (r != sceMcResSucceed)
 		return -57;
 
-	if (blocksize > 0) {
-		i = 0;
-		p_ecc = (uint8_t *)mcio_eccdata;
-
-		do {
-			if (pmce[i / pages_per_cluster] == 0) {
-				r = Card_WritePageData((block * blocksize) + i, mcio_pagedata[i], p_ecc);
-				if (r == sceMcResFailReplace) {
-					r = Card_FillBackupBlock1(block, (uint8_t **)mcio_pagedata, mcio_eccdata);
-					for (i = 0; i < clusters_per_block; i++) {
-						if (pmce[i] != 0)
-							pmce[i]->wr_flag = 0;
-					}
-					if (r == sceMcResFailReplace)
-						return r;
-					return -58;
-				}
-				if (r != sceMcResSucceed)
-					return -57;
-			}
-			p_ecc += sparesize;
-		} while (++i < blocksize);
-	}
-
-	if (blocksize > 0) {
-		i = 0;
-		p_ecc = (uint8_t *)mcio_eccdata;
-
-		do {
-			if (pmce[i / pages_per_cluster] != 0) {
-				r = Card_WritePageData((block * blocksize) + i, mcio_pagedata[i], p_ecc);
-				if (r == sceMcResFailReplace) {
-					r = Card_FillBackupBlock1(block, (uint8_t **)mcio_pagedata, mcio_eccdata);
-					for (i = 0; i < clusters_per_block; i++) {
-						if (pmce[i] != 0)
-							pmce[i]->wr_flag = 0;
-					}
-					if (r == sceMcResFailReplace)
-						return r;
-					return -58;
-				}
-				if (r != sceMcResSucceed)
-					return -57;
-			}
-			p_ecc += sparesize;
-		} while (++i < blocksize);
-	}
+	ctx->wr_blocks++;
+	Card_Stat(ctx, MCIO_STAT_BLOCK_WRITE, 1, start);
 
 	if (clusters_per_block > 0) {
 		i = 0;
@@ -927,8 +1167,8 @@ lbl2:
 		} while (++i < clusters_per_block);
 	}
 
-	if ((flag != 0) && (mcio_badblock <= 0)) {
-		r = Card_EraseBlock(backup_block2, NULL, NULL);
+	if ((flag != 0) && (ctx->badblock <= 0) && (ctx->commit_mode == MCIO_COMMIT_BACKUP)) {
+		r = Card_EraseBlock(ctx, backup_block2, NULL, NULL);
 		if (r == sceMcResFailReplace) {
 			goto lbl3;
 		}
@@ -938,7 +1178,7 @@ lbl2:
 	goto lbl_exit;
 
 lbl3:
-	r = Card_ReplaceBackupBlock(backup_block2);
+	r = Card_ReplaceBackupBlock(ctx, backup_block2);
 	append_le_uint32((uint8_t *)&mcdi->backup_block2, r);
 	backup_block2 = r;
 
@@ -948,112 +1188,220 @@ lbl_exit:
 	return sceMcResSucceed;
 }
 
-static int Card_FlushMCCache(void)
+static int Card_WriteBackMCCache(mcio_ctx_t *ctx)
 {
-	int i, r;
-	struct MCCacheEntry **pmce = (struct MCCacheEntry **)pmcio_mccache;
+	int r;
 	struct MCCacheEntry *mce;
 
-	i = MAX_CACHEENTRY - 1;
+	r = Card_FlushFat(ctx);
+	if (r != sceMcResSucceed)
+		return r;
 
-	if (i >= 0) {
-		do {
-			mce = (struct MCCacheEntry *)pmce[i];
-			if (mce->wr_flag != 0) {
-				r = Card_FlushCacheEntry((struct MCCacheEntry *)mce);
-				if (r != sceMcResSucceed)
-					return r;
-			}
-			i--;
-		} while (i >= 0);
+	/* least recently used first */
+	for (mce = ctx->mccache.prev; mce != &ctx->mccache; mce = mce->prev) {
+		if (mce->wr_flag != 0) {
+			r = Card_FlushCacheEntry(ctx, (struct MCCacheEntry *)mce);
+			if (r != sceMcResSucceed)
+				return r;
+		}
 	}
 
 	return sceMcResSucceed;
 }
 
-static int Card_ReadCluster(int32_t cluster, struct MCCacheEntry **pmce)
+static int Card_FlushMCCache(mcio_ctx_t *ctx) /* write back point of the card operations, deferred inside a transaction */
 {
-	int r, i;
+	if (ctx->txn_depth > 0)
+		return sceMcResSucceed;
+
+	return Card_WriteBackMCCache(ctx);
+}
+
+static int32_t Card_RemapCluster(mcio_ctx_t *ctx, int32_t cluster) /* redirect clusters of a replaced bad block */
+{
+	int i;
 	int32_t block, block_offset;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
-	struct MCCacheEntry *mce;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 
-	if (mcio_badblock > 0) {
+	if (ctx->badblock > 0) {
 		uint32_t clusters_per_block = read_le_uint32((uint8_t *)&mcdi->clusters_per_block);
 		uint32_t backup_block1 = read_le_uint32((uint8_t *)&mcdi->backup_block1);
 
 		block = cluster / clusters_per_block;
 		block_offset = cluster % clusters_per_block;
 		
-		if (block == mcio_badblock) {
+		if (block == ctx->badblock) {
 			cluster = (backup_block1 * clusters_per_block) + block_offset;
 		}
 		else {
-			if (mcio_badblock > 0) {
-				for (i = 0; i < (int32_t)clusters_per_block; i++) {
-					if ((mcio_replacementcluster[i] != 0) && (mcio_replacementcluster[i] == cluster)) {
-						block_offset = i % clusters_per_block;
-						cluster = (backup_block1 * clusters_per_block) + block_offset;
-					}
+			for (i = 0; i < (int32_t)clusters_per_block; i++) {
+				if ((ctx->replacementcluster[i] != 0) && (ctx->replacementcluster[i] == cluster)) {
+					block_offset = i % clusters_per_block;
+					cluster = (backup_block1 * clusters_per_block) + block_offset;
 				}
 			}
 		}
 	}
 
-	mce = Card_GetCacheEntry(cluster);
-	if (mce == NULL) {
-		mce = pmcio_mccache[MAX_CACHEENTRY - 1];
+	return cluster;
+}
 
-		if (mce->wr_flag != 0) {
-			r = Card_FlushCacheEntry((struct MCCacheEntry *)mce);
-			if (r != sceMcResSucceed)
-				return r;
-		}
+static uint8_t *Card_MapCluster(mcio_ctx_t *ctx, int32_t cluster, int32_t offset, int32_t size) /* direct pointer to a clean cluster of a non-ECC image, the caller reads size bytes at offset */
+{
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
+	struct MCCacheEntry *mce;
 
-		mce->cluster = cluster;
-		mce->rd_flag = 0;
+	if (mcdi->cardflags & CF_USE_ECC)
+		return NULL;
 
-		uint16_t pages_per_cluster = read_le_uint16((uint8_t *)&mcdi->pages_per_cluster);
-		uint16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
+	cluster = Card_RemapCluster(ctx, cluster);
 
-		for (i = 0; i < pages_per_cluster; i++) {
-			r = Card_ReadPage((cluster * pages_per_cluster) + i, (uint8_t *)(mce->cl_data + (i * pagesize)));
-			if (r != sceMcResSucceed)
-				return sceMcResFailReadCluster;
-		}
-	}
+	/* a dirty cached copy is newer than the image */
+	mce = Card_GetCacheEntry(ctx, cluster);
+	if ((mce != NULL) && (mce->wr_flag != 0))
+		return NULL;
 
-	Card_AddCacheEntry(mce);
-	*pmce = (struct MCCacheEntry *)mce;
+	uint16_t pages_per_cluster = read_le_uint16((uint8_t *)&mcdi->pages_per_cluster);
+	uint16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
 
-	return sceMcResSucceed;
+	/* the pages the caller copies, as Card_ReadPage() would count them on an ECC image */
+	if (size > 0)
+		Card_Stat(ctx, MCIO_STAT_PAGE_READ, ((offset + size - 1) / pagesize) - (offset / pagesize) + 1, 0);
+
+	return &ctx->vmc_data[cluster * pages_per_cluster * pagesize];
 }
 
-static int Card_WriteCluster(int32_t cluster, int32_t flag)
+static int Card_CopyCluster(mcio_ctx_t *ctx, int32_t cluster, uint8_t *dst, int32_t offset, int32_t size) /* read without going through the cache */
 {
-	int r, i, j;
-	int32_t page, block;
-	uint32_t erase_value;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	int r;
+	int32_t page, pos, len;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
+	struct MCCacheEntry *mce;
+	uint8_t pagebuf[MCIO_CLUSTERSIZE];
 
-	uint32_t clusters_per_block = read_le_uint32((uint8_t *)&mcdi->clusters_per_block);
-	uint16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
-	uint16_t blocksize = read_le_uint16((uint8_t *)&mcdi->blocksize);
+	uint8_t *p = Card_MapCluster(ctx, cluster, offset, size);
+	if (p != NULL) {
+		memcpy(dst, &p[offset], size);
+		return sceMcResSucceed;
+	}
 
-	block = cluster / clusters_per_block;
-	
-	for (i = 0; i < 16; i++) { /* check only 16 bad blocks ? */
-		if ((int32_t)read_le_uint32((uint8_t *)&mcdi->bad_block_list[i]) < 0)
-			break;
-		if ((int32_t)read_le_uint32((uint8_t *)&mcdi->bad_block_list[i]) == block)
-			return 0;
+	cluster = Card_RemapCluster(ctx, cluster);
+
+	/* a cached copy may be newer than the image, it keeps its place in the LRU order */
+	mce = Card_GetCacheEntry(ctx, cluster);
+	if (mce != NULL) {
+		memcpy(dst, &mce->cl_data[offset], size);
+		return sceMcResSucceed;
 	}
 
-	if (flag) {
-		for (i = 1; i < blocksize; i++)
-			mcio_pagedata[i] = NULL;
+	uint16_t pages_per_cluster = read_le_uint16((uint8_t *)&mcdi->pages_per_cluster);
+	uint16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
 
-		mcio_pagedata[0] = mcio_pagebuf;
+	/* ECC image: whole pages are corrected in the caller's buffer, partial ones go through pagebuf */
+	for (page = offset / pagesize; (page < pages_per_cluster) && (size > 0); page++) {
+		pos = offset - (page * pagesize);
+		len = pagesize - pos;
+		if (len > size)
+			len = size;
+
+		if (len == pagesize) {
+			r = Card_ReadPage(ctx, (cluster * pages_per_cluster) + page, dst);
+			if (r != sceMcResSucceed)
+				return sceMcResFailReadCluster;
+		}
+		else {
+			r = Card_ReadPage(ctx, (cluster * pages_per_cluster) + page, pagebuf);
+			if (r != sceMcResSucceed)
+				return sceMcResFailReadCluster;
+			memcpy(dst, &pagebuf[pos], len);
+		}
+
+		dst += len;
+		offset += len;
+		size -= len;
+	}
+
+	return sceMcResSucceed;
+}
+
+static int Card_ReadCluster(mcio_ctx_t *ctx, int32_t cluster, struct MCCacheEntry **pmce)
+{
+	int r, i;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
+	struct MCCacheEntry *mce;
+	uint64_t start = Card_StatStart(ctx);
+
+	cluster = Card_RemapCluster(ctx, cluster);
+
+	mce = Card_GetCacheEntry(ctx, cluster);
+	if (mce != NULL)
+		Card_Stat(ctx, MCIO_STAT_CACHE_HIT, 1, start);
+	else {
+		mce = ctx->mccache.prev; /* evict the least recently used entry */
+
+		if (mce->wr_flag != 0) {
+			r = Card_FlushCacheEntry(ctx, (struct MCCacheEntry *)mce);
+			if (r != sceMcResSucceed)
+				return r;
+		}
+
+		if (mce->cluster >= 0)
+			Card_UnhashCacheEntry(mce);
+
+		mce->cluster = cluster;
+		mce->rd_flag = 0;
+		Card_HashCacheEntry(ctx, mce);
+
+		uint16_t pages_per_cluster = read_le_uint16((uint8_t *)&mcdi->pages_per_cluster);
+		uint16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
+
+		if ((mcdi->cardflags & CF_USE_ECC) == 0) {
+			/* no spare data, cluster pages are contiguous in the image */
+			memcpy(mce->cl_data, &ctx->vmc_data[cluster * pages_per_cluster * pagesize], pages_per_cluster * pagesize);
+			Card_Stat(ctx, MCIO_STAT_PAGE_READ, pages_per_cluster, 0);
+		}
+		else {
+			for (i = 0; i < pages_per_cluster; i++) {
+				r = Card_ReadPage(ctx, (cluster * pages_per_cluster) + i, (uint8_t *)(mce->cl_data + (i * pagesize)));
+				if (r != sceMcResSucceed)
+					return sceMcResFailReadCluster;
+			}
+		}
+
+		Card_Stat(ctx, MCIO_STAT_CACHE_MISS, 1, start);
+	}
+
+	Card_AddCacheEntry(ctx, mce);
+	*pmce = (struct MCCacheEntry *)mce;
+
+	return sceMcResSucceed;
+}
+
+static int Card_WriteCluster(mcio_ctx_t *ctx, int32_t cluster, int32_t flag)
+{
+	int r, i, j;
+	int32_t page, block;
+	uint32_t erase_value;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
+
+	uint32_t clusters_per_block = read_le_uint32((uint8_t *)&mcdi->clusters_per_block);
+	uint16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
+	uint16_t blocksize = read_le_uint16((uint8_t *)&mcdi->blocksize);
+
+	block = cluster / clusters_per_block;
+	
+	for (i = 0; i < 16; i++) { /* check only 16 bad blocks ? */
+		if ((int32_t)read_le_uint32((uint8_t *)&mcdi->bad_block_list[i]) < 0)
+			break;
+		if ((int32_t)read_le_uint32((uint8_t *)&mcdi->bad_block_list[i]) == block)
+			return 0;
+	}
+
+	if (flag) {
+		for (i = 1; i < blocksize; i++)
+			ctx->pagedata[i] = NULL;
+
+		ctx->pagedata[0] = ctx->pagebuf;
 
 		page = block * blocksize;
 		
@@ -1062,16 +1410,16 @@ static int Card_WriteCluster(int32_t cluster, int32_t flag)
 		else
 			erase_value = 0x00000000;
 			
-		memset(mcio_pagebuf, erase_value, pagesize);
+		memset(ctx->pagebuf, erase_value, pagesize);
 
-		r = Card_EraseBlock(block, (uint8_t **)mcio_pagedata, (uint8_t *)mcio_eccdata);
+		r = Card_EraseBlock(ctx, block, (uint8_t **)ctx->pagedata, (uint8_t *)ctx->eccdata);
 		if (r == sceMcResFailReplace)
 			return 0;
 		if (r != sceMcResSucceed)
 			return sceMcResChangedCard;
 
 		for (i = 1; i < blocksize; i++) {
-			r = Card_WritePageData(page + i, mcio_pagebuf, mcio_eccdata);
+			r = Card_WritePageData(ctx, page + i, ctx->pagebuf, ctx->eccdata);
 			if (r == sceMcResFailReplace)
 				return 0;
 			if (r != sceMcResSucceed)
@@ -1079,40 +1427,40 @@ static int Card_WriteCluster(int32_t cluster, int32_t flag)
 		}
 
 		for (i = 1; i < blocksize; i++) {
-			r = Card_ReadPage(page + i, mcio_pagebuf);
+			r = Card_ReadPage(ctx, page + i, ctx->pagebuf);
 			if (r == sceMcResNoFormat)
 				return 0;
 			if (r != sceMcResSucceed)
 				return sceMcResFullDevice;
 
 			for (j = 0; j < (pagesize >> 2); j++) {
-				if (*((uint32_t *)&mcio_pagebuf + j) != erase_value)
+				if (*((uint32_t *)&ctx->pagebuf + j) != erase_value)
 					return sceMcResSucceed;
 			}
 		}
 
-		r = Card_EraseBlock(block, NULL, NULL);
+		r = Card_EraseBlock(ctx, block, NULL, NULL);
 		if (r != sceMcResSucceed)
 			return sceMcResChangedCard;
 
-		r = Card_WritePageData(page, mcio_pagebuf, mcio_eccdata);
+		r = Card_WritePageData(ctx, page, ctx->pagebuf, ctx->eccdata);
 		if (r == sceMcResFailReplace)
 			return 0;
 		if (r != sceMcResSucceed)
 			return sceMcResNoFormat;
 
-		r = Card_ReadPage(page, mcio_pagebuf);
+		r = Card_ReadPage(ctx, page, ctx->pagebuf);
 		if (r == sceMcResNoFormat)
 			return 0;
 		if (r != sceMcResSucceed)
 			return sceMcResFullDevice;
 
 		for (j = 0; j < (pagesize >> 2); j++) {
-			if (*((uint32_t *)&mcio_pagebuf + j) != erase_value)
+			if (*((uint32_t *)&ctx->pagebuf + j) != erase_value)
 				return 0;
 		}
 
-		r = Card_EraseBlock(block, NULL, NULL);
+		r = Card_EraseBlock(ctx, block, NULL, NULL);
 		if (r == sceMcResFailReplace)
 			return 0;
 		if (r != sceMcResSucceed)
@@ -1121,12 +1469,12 @@ static int Card_WriteCluster(int32_t cluster, int32_t flag)
 		erase_value = ~erase_value;
 
 		for (i = 0; i < blocksize; i++) {
-			r = Card_ReadPage(page + i, mcio_pagebuf);
+			r = Card_ReadPage(ctx, page + i, ctx->pagebuf);
 			if (r != sceMcResSucceed)
 				return sceMcResDeniedPermit;
 
 			for (j = 0; j < (pagesize >> 2); j++) {
-				if (*((uint32_t *)&mcio_pagebuf + j) != erase_value)
+				if (*((uint32_t *)&ctx->pagebuf + j) != erase_value)
 					return 0;
 			}
 		}
@@ -1135,255 +1483,587 @@ static int Card_WriteCluster(int32_t cluster, int32_t flag)
 	return 1;
 }
 
-static int Card_FindFree(int reserve)
+static uint8_t *Card_PeekCluster(mcio_ctx_t *ctx, int32_t cluster, uint8_t *buf) /* read a cluster without caching it */
 {
-	int r;
-	int32_t rfree, indirect_index, ifc_index, fat_offset, indirect_offset, fat_index, block;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
-	struct MCCacheEntry *mce1, *mce2;
+	int i;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
+	struct MCCacheEntry *mce;
+	uint8_t *p;
 
-	int32_t unknown2 = (int32_t)read_le_uint32((uint8_t *)&mcdi->unknown2);
-	int32_t FATentries_per_cluster = (int32_t)read_le_uint32((uint8_t *)&mcdi->FATentries_per_cluster);
-	rfree = 0;
+	mce = Card_GetCacheEntry(ctx, Card_RemapCluster(ctx, cluster));
+	if (mce != NULL)
+		return mce->cl_data;
 
-	int32_t max_allocatable_clusters = (int32_t)read_le_uint32((uint8_t *)&mcdi->max_allocatable_clusters);
+	uint16_t pages_per_cluster = read_le_uint16((uint8_t *)&mcdi->pages_per_cluster);
+	uint16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
 
-	for (fat_index = unknown2; fat_index < max_allocatable_clusters; fat_index++) {
+	p = Card_MapCluster(ctx, cluster, 0, pages_per_cluster * pagesize);
+	if (p != NULL)
+		return p;
 
-		indirect_index = fat_index / FATentries_per_cluster;
-		fat_offset = fat_index % FATentries_per_cluster;
+	cluster = Card_RemapCluster(ctx, cluster);
+	for (i = 0; i < pages_per_cluster; i++) {
+		if (Card_ReadPage(ctx, (cluster * pages_per_cluster) + i, buf + (i * pagesize)) != sceMcResSucceed)
+			return NULL;
+	}
 
-		if ((fat_offset == 0) || (fat_index == unknown2)) {
+	return buf;
+}
 
-			ifc_index = indirect_index / FATentries_per_cluster;
-			int32_t ifc = (int32_t)read_le_uint32((uint8_t *)&mcdi->ifc_list[ifc_index]);
-			r = Card_ReadCluster(ifc, &mce1);
-			if (r != sceMcResSucceed)
-				return r;
+static void Card_DropFat(mcio_ctx_t *ctx) /* forget the decoded FAT, pending entries included */
+{
+	free(ctx->fat);
+	free(ctx->fat_clusters);
+	free(ctx->fat_dirty);
+	free(ctx->fat_free);
+
+	ctx->fat = NULL;
+	ctx->fat_clusters = NULL;
+	ctx->fat_dirty = NULL;
+	ctx->fat_free = NULL;
+	ctx->fat_length = 0;
+	ctx->fat_freelimit = 0;
+	ctx->fat_freecount = 0;
+}
 
-			indirect_offset = indirect_index % FATentries_per_cluster;
-			struct MCFatCluster *fc = (struct MCFatCluster *)mce1->cl_data;
-			r = Card_ReadCluster(read_le_uint32((uint8_t *)&fc->entry[indirect_offset]), &mce2);
-			if (r != sceMcResSucceed)
-				return r;
+static int Card_LoadFat(mcio_ctx_t *ctx) /* decode the whole FAT once, through the indirect FAT clusters */
+{
+	int32_t i, j, fat_length;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
+	uint8_t ifcbuf[MCIO_CLUSTERSIZE];
+	uint8_t buf[MCIO_CLUSTERSIZE];
+	uint8_t *p;
+
+	if (ctx->fat_length != 0)
+		return sceMcResSucceed;
+
+	int32_t cluster_size = (int32_t)read_le_uint32((uint8_t *)&mcdi->cluster_size);
+	int32_t clusters_per_card = (int32_t)read_le_uint32((uint8_t *)&mcdi->clusters_per_card);
+	int32_t FATentries_per_cluster = (int32_t)read_le_uint32((uint8_t *)&mcdi->FATentries_per_cluster);
+
+	if ((cluster_size != MCIO_CLUSTERSIZE) || (FATentries_per_cluster != MCIO_CLUSTERFATENTRIES))
+		return sceMcResNoFormat;
+
+	/* same layout as Card_Format() */
+	fat_length = (((clusters_per_card << 2) - 1) / cluster_size) + 1;
+	if (fat_length > (FATentries_per_cluster << 5))
+		fat_length = FATentries_per_cluster << 5;
+
+	int32_t max_allocatable_clusters = (int32_t)read_le_uint32((uint8_t *)&mcdi->max_allocatable_clusters);
+	if (max_allocatable_clusters > (fat_length * FATentries_per_cluster))
+		max_allocatable_clusters = fat_length * FATentries_per_cluster;
+	if (max_allocatable_clusters < 0)
+		max_allocatable_clusters = 0;
+
+	ctx->fat = (int32_t *)malloc(fat_length * FATentries_per_cluster * sizeof(int32_t));
+	ctx->fat_clusters = (int32_t *)malloc(fat_length * sizeof(int32_t));
+	ctx->fat_dirty = (uint32_t *)calloc((fat_length + 31) >> 5, sizeof(uint32_t));
+	ctx->fat_free = (uint32_t *)calloc((max_allocatable_clusters + 32) >> 5, sizeof(uint32_t));
+
+	if (!ctx->fat || !ctx->fat_clusters || !ctx->fat_dirty || !ctx->fat_free) {
+		Card_DropFat(ctx);
+		return sceMcResFailIO;
+	}
+
+	for (i = 0; i < fat_length; i++) {
+		if ((i % FATentries_per_cluster) == 0) {
+			p = Card_PeekCluster(ctx, read_le_uint32((uint8_t *)&mcdi->ifc_list[i / FATentries_per_cluster]), buf);
+			if (p == NULL)
+				goto fail;
+			memcpy(ifcbuf, p, MCIO_CLUSTERSIZE);
 		}
 
-		struct MCFatCluster *fc = (struct MCFatCluster *)mce2->cl_data;
+		ctx->fat_clusters[i] = (int32_t)read_le_uint32(&ifcbuf[(i % FATentries_per_cluster) << 2]);
+		if ((ctx->fat_clusters[i] < 0) || (ctx->fat_clusters[i] >= clusters_per_card))
+			goto fail;
 
-		if ((int32_t)read_le_uint32((uint8_t *)&fc->entry[fat_offset]) >= 0) {
-			int32_t alloc_offset = (int32_t)read_le_uint32((uint8_t *)&mcdi->alloc_offset);
-			int32_t clusters_per_block = (int32_t)read_le_uint32((uint8_t *)&mcdi->clusters_per_block);
-			block = (alloc_offset + fat_offset) / clusters_per_block;
-			if (block != mcio_badblock) {
-				if (reserve) {
-					append_le_uint32((uint8_t *)&fc->entry[fat_offset], 0xffffffff);
-					mce2->wr_flag = 1;
-					append_le_uint32((uint8_t *)&mcdi->unknown2, fat_index);
-					return fat_index;
-				}
-				rfree++;
-			}
+		p = Card_PeekCluster(ctx, ctx->fat_clusters[i], buf);
+		if (p == NULL)
+			goto fail;
+
+		for (j = 0; j < FATentries_per_cluster; j++)
+			ctx->fat[(i * FATentries_per_cluster) + j] = (int32_t)read_le_uint32(p + (j << 2));
+	}
+
+	/* free clusters have bit 31 clear */
+	for (i = 0; i < max_allocatable_clusters; i++) {
+		if (ctx->fat[i] >= 0) {
+			ctx->fat_free[i >> 5] |= 1U << (i & 31);
+			ctx->fat_freecount++;
 		}
 	}
 
-	if (reserve)
-		return sceMcResFullDevice;
+	ctx->fat_length = fat_length;
+	ctx->fat_freelimit = max_allocatable_clusters;
+
+	return sceMcResSucceed;
 
-	return (rfree) ? rfree : sceMcResFullDevice;
+fail:
+	Card_DropFat(ctx);
+	return sceMcResFailReadCluster;
 }
 
-static int Card_SetFatEntry(int32_t fat_index, int32_t fat_entry)
+static int Card_FlushFat(mcio_ctx_t *ctx) /* write modified FAT clusters back to the mc cache */
 {
 	int r;
-	int32_t ifc_index, indirect_index, indirect_offset, fat_offset;
+	int32_t i, j;
 	struct MCCacheEntry *mce;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
 
-	int32_t FATentries_per_cluster = (int32_t)read_le_uint32((uint8_t *)&mcdi->FATentries_per_cluster);
+	for (i = 0; i < ctx->fat_length; i++) {
+		if (ctx->fat_dirty[i >> 5] == 0) {
+			i |= 31;
+			continue;
+		}
+		if ((ctx->fat_dirty[i >> 5] & (1U << (i & 31))) == 0)
+			continue;
 
-	indirect_index = fat_index / FATentries_per_cluster;
-	fat_offset = fat_index % FATentries_per_cluster;
+		r = Card_ReadCluster(ctx, ctx->fat_clusters[i], &mce);
+		if (r != sceMcResSucceed)
+			return r;
 
-	ifc_index = indirect_index / FATentries_per_cluster;
-	indirect_offset = indirect_index % FATentries_per_cluster;
+		struct MCFatCluster *fc = (struct MCFatCluster *)mce->cl_data;
+		for (j = 0; j < MCIO_CLUSTERFATENTRIES; j++)
+			append_le_uint32((uint8_t *)&fc->entry[j], ctx->fat[(i * MCIO_CLUSTERFATENTRIES) + j]);
+		mce->wr_flag = 1;
+
+		ctx->fat_dirty[i >> 5] &= ~(1U << (i & 31));
+	}
 
-	int32_t ifc = (int32_t)read_le_uint32((uint8_t *)&mcdi->ifc_list[ifc_index]);
+	return sceMcResSucceed;
+}
 
-	r = Card_ReadCluster(ifc, &mce);
+static int Card_SetFatEntry(mcio_ctx_t *ctx, int32_t fat_index, int32_t fat_entry)
+{
+	int r;
+
+	r = Card_LoadFat(ctx);
 	if (r != sceMcResSucceed)
 		return r;
 
-	struct MCFatCluster *fc = (struct MCFatCluster *)mce->cl_data;
+	if ((uint32_t)fat_index >= (uint32_t)(ctx->fat_length * MCIO_CLUSTERFATENTRIES))
+		return sceMcResFailReadCluster;
+
+	if ((fat_index < ctx->fat_freelimit) && ((ctx->fat[fat_index] >= 0) != (fat_entry >= 0))) {
+		ctx->fat_free[fat_index >> 5] ^= 1U << (fat_index & 31);
+		ctx->fat_freecount += (fat_entry >= 0) ? 1 : -1;
+	}
+
+	ctx->fat[fat_index] = fat_entry;
+	fat_index /= MCIO_CLUSTERFATENTRIES;
+	ctx->fat_dirty[fat_index >> 5] |= 1U << (fat_index & 31);
+
+	return sceMcResSucceed;
+}
+
+static int Card_GetFatEntry(mcio_ctx_t *ctx, int32_t fat_index, int32_t *fat_entry)
+{
+	int r;
+	uint64_t start = Card_StatStart(ctx);
 
-	r = Card_ReadCluster(read_le_uint32((uint8_t *)&fc->entry[indirect_offset]), &mce);
+	r = Card_LoadFat(ctx);
 	if (r != sceMcResSucceed)
 		return r;
 
-	fc = (struct MCFatCluster *)mce->cl_data;
+	if ((uint32_t)fat_index >= (uint32_t)(ctx->fat_length * MCIO_CLUSTERFATENTRIES))
+		return sceMcResFailReadCluster;
 
-	append_le_uint32((uint8_t *)&fc->entry[fat_offset], fat_entry);
-	mce->wr_flag = 1;
+	*fat_entry = ctx->fat[fat_index];
+	Card_Stat(ctx, MCIO_STAT_FAT_LOOKUP, 1, start);
 
 	return sceMcResSucceed;
 }
 
-static int Card_GetFatEntry(int32_t fat_index, int32_t *fat_entry)
+static uint32_t Card_BadBlockMask(mcio_ctx_t *ctx, int32_t word) /* fat_free bits of a word usable for allocation */
 {
-	int r, ifc_index, indirect_index, indirect_offset, fat_offset;
-	struct MCCacheEntry *mce;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	int32_t first, last;
+	uint32_t mask = 0xffffffff;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 
-	int32_t FATentries_per_cluster = (int32_t)read_le_uint32((uint8_t *)&mcdi->FATentries_per_cluster);
+	if (ctx->badblock <= 0)
+		return mask;
 
-	indirect_index = fat_index / FATentries_per_cluster;
-	fat_offset = fat_index % FATentries_per_cluster;
+	int32_t alloc_offset = (int32_t)read_le_uint32((uint8_t *)&mcdi->alloc_offset);
+	int32_t clusters_per_block = (int32_t)read_le_uint32((uint8_t *)&mcdi->clusters_per_block);
 
-	ifc_index = indirect_index / FATentries_per_cluster;
-	indirect_offset = indirect_index % FATentries_per_cluster;
+	/* FAT indexes of the block being replaced, clipped to this word */
+	first = (ctx->badblock * clusters_per_block) - alloc_offset - (word << 5);
+	last = first + clusters_per_block;
+	if (first < 0)
+		first = 0;
+	if (last > 32)
+		last = 32;
 
-	int32_t ifc = (int32_t)read_le_uint32((uint8_t *)&mcdi->ifc_list[ifc_index]);
+	for (; first < last; first++)
+		mask &= ~(1U << first);
 
-	r = Card_ReadCluster(ifc, &mce);
-	if (r != sceMcResSucceed)
-		return r;
+	return mask;
+}
 
-	struct MCFatCluster *fc = (struct MCFatCluster *)mce->cl_data;
+static int Card_FindFree(mcio_ctx_t *ctx, int reserve)
+{
+	int r;
+	int32_t word, nwords, fat_index, rfree;
+	uint32_t bits;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 
-	r = Card_ReadCluster(read_le_uint32((uint8_t *)&fc->entry[indirect_offset]), &mce);
+	r = Card_LoadFat(ctx);
 	if (r != sceMcResSucceed)
 		return r;
 
-	fc = (struct MCFatCluster *)mce->cl_data;
+	if (!reserve) {
+		rfree = ctx->fat_freecount;
+
+		if (ctx->badblock > 0) {
+			int32_t clusters_per_block = (int32_t)read_le_uint32((uint8_t *)&mcdi->clusters_per_block);
+			int32_t first = (ctx->badblock * clusters_per_block) - (int32_t)read_le_uint32((uint8_t *)&mcdi->alloc_offset);
+
+			word = (first > 0) ? (first >> 5) : 0;
+			for (; ((word << 5) < first + clusters_per_block) && ((word << 5) < ctx->fat_freelimit); word++)
+				rfree -= __builtin_popcount(ctx->fat_free[word] & ~Card_BadBlockMask(ctx, word));
+		}
+
+		return (rfree) ? rfree : sceMcResFullDevice;
+	}
+
+	uint64_t start = Card_StatStart(ctx);
+
+	fat_index = (int32_t)read_le_uint32((uint8_t *)&mcdi->unknown2);
+	if (fat_index < 0)
+		fat_index = 0;
+
+	nwords = (ctx->fat_freelimit + 31) >> 5;
+
+	for (word = fat_index >> 5; word < nwords; word++) {
+		bits = ctx->fat_free[word] & Card_BadBlockMask(ctx, word);
+		if (word == (fat_index >> 5))
+			bits &= 0xffffffff << (fat_index & 31);
+		if (bits == 0)
+			continue;
+
+		Card_Stat(ctx, MCIO_STAT_FREE_SCAN, word - (fat_index >> 5) + 1, 0);
+		Card_Stat(ctx, MCIO_STAT_FREE_SEARCH, 1, start);
+
+		fat_index = (word << 5) + __builtin_ctz(bits);
+
+		r = Card_SetFatEntry(ctx, fat_index, 0xffffffff);
+		if (r != sceMcResSucceed)
+			return r;
+
+		append_le_uint32((uint8_t *)&mcdi->unknown2, fat_index);
+		return fat_index;
+	}
+
+	Card_Stat(ctx, MCIO_STAT_FREE_SCAN, nwords - (fat_index >> 5), 0);
+	Card_Stat(ctx, MCIO_STAT_FREE_SEARCH, 1, start);
+
+	return sceMcResFullDevice;
+}
+
+static void Card_ClearHandle(struct MCFHandle *fh) /* all but the chain buffer, which is kept across reopens */
+{
+	int32_t *chain = fh->chain;
+	int32_t chain_size = fh->chain_size;
+
+	memset((void *)fh, 0, sizeof(struct MCFHandle));
+	fh->chain = chain;
+	fh->chain_size = chain_size;
+}
+
+static int Card_FileChainPush(struct MCFHandle *fh, int32_t fat_index)
+{
+	int32_t *chain;
+
+	if (fh->chain_len == fh->chain_size) {
+		chain = (int32_t *)realloc(fh->chain, (fh->chain_size ? fh->chain_size * 2 : 64) * sizeof(int32_t));
+		if (chain == NULL)
+			return sceMcResFailIO;
+
+		fh->chain = chain;
+		fh->chain_size = fh->chain_size ? fh->chain_size * 2 : 64;
+	}
 
-	*fat_entry = read_le_uint32((uint8_t *)&fc->entry[fat_offset]);
+	fh->chain[fh->chain_len++] = fat_index;
 
 	return sceMcResSucceed;
 }
 
-static int Card_FatRSeek(int fd)
+static int Card_FileChain(mcio_ctx_t *ctx, struct MCFHandle *fh, int32_t index) /* FAT index of the index-th file cluster */
 {
 	int r;
-	int32_t entries_to_read, fat_index;
-	struct MCFHandle *fh = (struct MCFHandle *)&mcio_fdhandles[fd];
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
 	int32_t fat_entry;
 
+	if ((int32_t)fh->freeclink < 0)
+		return sceMcResFullDevice;
+
+	if (fh->chain_len == 0) {
+		r = Card_FileChainPush(fh, fh->freeclink);
+		if (r != sceMcResSucceed)
+			return r;
+	}
+
+	/* the chain only ever grows while a handle is open, extend it from its last known cluster */
+	while (fh->chain_len <= index) {
+		r = Card_GetFatEntry(ctx, fh->chain[fh->chain_len - 1], &fat_entry);
+		if (r != sceMcResSucceed)
+			return r;
+
+		if (fat_entry >= -1)
+			return sceMcResFullDevice;
+
+		r = Card_FileChainPush(fh, fat_entry & 0x7fffffff);
+		if (r != sceMcResSucceed)
+			return r;
+	}
+
+	return fh->chain[index];
+}
+
+static int Card_FatRSeek(mcio_ctx_t *ctx, int fd)
+{
+	int32_t entries_to_read, fat_index;
+	struct MCFHandle *fh = ctx->fdhandles[fd];
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
+
 	int32_t cluster_size = (int32_t)read_le_uint32((uint8_t *)&mcdi->cluster_size);
 	entries_to_read = fh->position / cluster_size;
 
-	if (entries_to_read < (int32_t)fh->clust_offset)
-		fat_index = fh->freeclink;
-	else {
-		fat_index = fh->clink;
-		entries_to_read -= fh->clust_offset;
+	fat_index = Card_FileChain(ctx, fh, entries_to_read);
+
+	if (fh->chain_len > 0) {
+		fh->clust_offset = (entries_to_read < fh->chain_len) ? entries_to_read : fh->chain_len - 1;
+		fh->clink = fh->chain[fh->clust_offset];
 	}
 
-	int32_t alloc_offset = (int32_t)read_le_uint32((uint8_t *)&mcdi->alloc_offset);
+	if (fat_index < 0)
+		return fat_index;
 
-	if (entries_to_read == 0) {
-		if (fat_index >= 0)
-			return fat_index + alloc_offset;
+	return fat_index + (int32_t)read_le_uint32((uint8_t *)&mcdi->alloc_offset);
+}
 
-		return sceMcResFullDevice;
-	}
+static int Card_FatHead(mcio_ctx_t *ctx, int fd) /* give an empty file its first cluster */
+{
+	int r;
+	int32_t fat_index;
+	struct MCFHandle *fh = ctx->fdhandles[fd];
 
-	do {
-		r = Card_GetFatEntry(fat_index, &fat_entry);
-		if (r != sceMcResSucceed)
-			return r;
+	if ((int32_t)fh->freeclink >= 0)
+		return sceMcResSucceed;
 
-		fat_index = fat_entry;
+	fat_index = Card_FindFree(ctx, 1);
 
-		if (fat_index >= -1)
-			return sceMcResFullDevice;
+	if (fat_index < 0)
+		return sceMcResFullDevice;
 
-		entries_to_read--;
+	fh->freeclink = fat_index;
 
-		fat_index &= 0x7fffffff;
-		fh->clink = fat_index;
-		fh->clust_offset = (fh->position / cluster_size) - entries_to_read;
+	r = Card_FileClose(ctx, fd);
+	if (r != sceMcResSucceed)
+		return r;
 
-	} while (entries_to_read > 0);
+	Card_FlushMCCache(ctx);
 
-	return fat_index + alloc_offset;
+	return sceMcResSucceed;
 }
 
-static int Card_FatWSeek(int fd) /* modify FAT to hold new content for a file */
+static int Card_FatWSeek(mcio_ctx_t *ctx, int fd) /* modify FAT to hold new content for a file */
 {
 	int r;
 	int32_t entries_to_write, fat_index, fat_entry;
-	struct MCFHandle *fh = (struct MCFHandle *)&mcio_fdhandles[fd];
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
-	struct MCCacheEntry *mce;
+	struct MCFHandle *fh = ctx->fdhandles[fd];
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 
 	int32_t cluster_size = (int32_t)read_le_uint32((uint8_t *)&mcdi->cluster_size);
 	entries_to_write = fh->position / cluster_size;
 
-	if ((fh->clust_offset == 0) || (entries_to_write < (int32_t)fh->clust_offset)) {
-		fat_index = fh->freeclink;
+	r = Card_FatHead(ctx, fd);
+	if (r != sceMcResSucceed)
+		return r;
 
-		if (fat_index < 0) {
-			fat_index = Card_FindFree(1);
+	fat_index = Card_FileChain(ctx, fh, entries_to_write);
+	if ((fat_index < 0) && (fat_index != sceMcResFullDevice))
+		return fat_index;
 
-			if (fat_index < 0)
-				return sceMcResFullDevice;
+	/* append clusters past the current end of the file */
+	while (fh->chain_len <= entries_to_write) {
+		fat_index = fh->chain[fh->chain_len - 1];
 
-			mce = (struct MCCacheEntry *)*pmcio_mccache;
-			fh->freeclink = fat_index;
+		r = Card_GetFatEntry(ctx, fat_index, &fat_entry);
+		if (r != sceMcResSucceed)
+			return r;
+
+		if (fat_entry >= (int32_t)0xffffffff) {
+			r = Card_FindFree(ctx, 1);
+			if (r < 0)
+				return r;
+			fat_entry = r;
+			fat_entry |= 0x80000000;
 
-			r = Card_FileClose(fd);
+			r = Card_SetFatEntry(ctx, fat_index, fat_entry);
 			if (r != sceMcResSucceed)
 				return r;
+		}
+
+		fat_index = fat_entry & 0x7fffffff;
+
+		r = Card_FileChainPush(fh, fat_index);
+		if (r != sceMcResSucceed)
+			return r;
+	}
+
+	fh->clink = fat_index;
+	fh->clust_offset = entries_to_write;
+
+	return sceMcResSucceed;
+}
 
-			Card_AddCacheEntry(mce);
-			Card_FlushMCCache();
+static int32_t Card_FreeExtent(mcio_ctx_t *ctx, int32_t need, int32_t after) /* best-fit run of need free clusters */
+{
+	int32_t fat_index, start, len, best, best_len;
+	uint32_t bits = 0;
+	uint64_t stat_start = Card_StatStart(ctx);
+
+	best = -1;
+	best_len = 0x7fffffff;
+	start = -1;
+
+	/* walk the free extents, fat_freelimit closes the last one */
+	for (fat_index = 0; fat_index <= ctx->fat_freelimit; fat_index++) {
+		if ((fat_index & 31) == 0) {
+			bits = (fat_index < ctx->fat_freelimit) ? ctx->fat_free[fat_index >> 5] & Card_BadBlockMask(ctx, fat_index >> 5) : 0;
+			/* skip words that do not end or start an extent */
+			if ((bits == 0xffffffff) && (start >= 0) && (fat_index + 32 < ctx->fat_freelimit)) {
+				fat_index += 31;
+				continue;
+			}
+			if ((bits == 0) && (start < 0)) {
+				fat_index += 31;
+				continue;
+			}
+		}
+		if ((fat_index < ctx->fat_freelimit) && (bits & (1U << (fat_index & 31)))) {
+			if (start < 0)
+				start = fat_index;
+			continue;
 		}
+		if (start < 0)
+			continue;
+
+		len = fat_index - start;
+		if ((start == after) && (len >= need)) { /* the file's own end can grow in place */
+			best = start;
+			break;
+		}
+		if ((len >= need) && (len < best_len)) {
+			best = start;
+			best_len = len;
+		}
+		start = -1;
 	}
-	else {
-		fat_index = fh->clink;
-		entries_to_write -= fh->clust_offset;
+
+	Card_Stat(ctx, MCIO_STAT_FREE_SCAN, (fat_index >> 5) + 1, 0);
+	Card_Stat(ctx, MCIO_STAT_FREE_SEARCH, 1, stat_start);
+
+	return best;
+}
+
+static int Card_FatAllocate(mcio_ctx_t *ctx, int fd, int32_t clusters) /* grow a file's chain to hold clusters clusters */
+{
+	int r;
+	int32_t word, nwords, fat_index, first, avail, last;
+	uint32_t bits;
+	struct MCFHandle *fh = ctx->fdhandles[fd];
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
+
+	r = Card_LoadFat(ctx);
+	if (r != sceMcResSucceed)
+		return r;
+
+	last = -1;
+	avail = clusters;
+	if ((int32_t)fh->freeclink >= 0) {
+		r = Card_FileChain(ctx, fh, clusters - 1);
+		if (r >= 0)
+			return sceMcResSucceed;
+		if (r != sceMcResFullDevice)
+			return r;
+
+		last = fh->chain[fh->chain_len - 1];
+		avail = clusters - fh->chain_len;
 	}
 
-	if (entries_to_write != 0) {
-		do {
-			r = Card_GetFatEntry(fat_index, &fat_entry);
-			if (r != sceMcResSucceed)
-				return r;
+	/* start the search at the best fitting free extent, the first-fit order of Card_FindFree() is the fallback */
+	first = Card_FreeExtent(ctx, avail, (last >= 0) ? last + 1 : -1);
+	if (first >= 0)
+		append_le_uint32((uint8_t *)&mcdi->unknown2, first);
 
-			if (fat_entry >= (int32_t)0xffffffff) {
-				r = Card_FindFree(1);
-				if (r < 0)
-					return r;
-				fat_entry = r;
-				fat_entry |= 0x80000000;
+	r = Card_FatHead(ctx, fd);
+	if (r != sceMcResSucceed)
+		return r;
 
-				mce = (struct MCCacheEntry *)*pmcio_mccache;
+	r = Card_FileChain(ctx, fh, clusters - 1);
+	if (r >= 0)
+		return sceMcResSucceed;
+	if (r != sceMcResFullDevice)
+		return r;
 
-				r = Card_SetFatEntry(fat_index, fat_entry);
-				if (r != sceMcResSucceed)
-					return r;
+	clusters -= fh->chain_len;
 
-				Card_AddCacheEntry(mce);
-			}
+	first = (int32_t)read_le_uint32((uint8_t *)&mcdi->unknown2);
+	if (first < 0)
+		first = 0;
 
-			entries_to_write--;
-			fat_index = fat_entry & 0x7fffffff;
-		} while (entries_to_write > 0);
+	nwords = (ctx->fat_freelimit + 31) >> 5;
+
+	/* count first, nothing is linked unless the whole request fits */
+	avail = 0;
+	for (word = first >> 5; (word < nwords) && (avail < clusters); word++) {
+		bits = ctx->fat_free[word] & Card_BadBlockMask(ctx, word);
+		if (word == (first >> 5))
+			bits &= 0xffffffff << (first & 31);
+		avail += __builtin_popcount(bits);
 	}
+	if (avail < clusters)
+		return sceMcResFullDevice;
 
-	fh->clink = fat_index;
-	fh->clust_offset = fh->position / cluster_size;
+	last = fh->chain[fh->chain_len - 1];
+
+	for (word = first >> 5; clusters > 0; word++) {
+		bits = ctx->fat_free[word] & Card_BadBlockMask(ctx, word);
+		if (word == (first >> 5))
+			bits &= 0xffffffff << (first & 31);
+
+		for (; (bits != 0) && (clusters > 0); bits &= bits - 1, clusters--) {
+			fat_index = (word << 5) + __builtin_ctz(bits);
+
+			r = Card_SetFatEntry(ctx, fat_index, 0xffffffff);
+			if (r != sceMcResSucceed)
+				return r;
+
+			r = Card_SetFatEntry(ctx, last, fat_index | 0x80000000);
+			if (r != sceMcResSucceed)
+				return r;
+
+			r = Card_FileChainPush(fh, fat_index);
+			if (r != sceMcResSucceed)
+				return r;
+
+			last = fat_index;
+		}
+	}
+
+	append_le_uint32((uint8_t *)&mcdi->unknown2, last);
 
 	return sceMcResSucceed;
 }
 
-static int Card_ReadDirEntry(int32_t cluster, int32_t fsindex, struct MCFsEntry **pfse)
+static int Card_ReadDirEntry(mcio_ctx_t *ctx, int32_t cluster, int32_t fsindex, struct MCFsEntry **pfse)
 {
 	int r, i;
 	int32_t maxent, index, clust;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
-	struct MCFatCache *fci = (struct MCFatCache *)&mcio_fatcache;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
+	struct MCFatCache *fci = (struct MCFatCache *)&ctx->fatcache;
 	struct MCCacheEntry *mce;
+	uint64_t start = Card_StatStart(ctx);
 
 	uint32_t cluster_size = (int32_t)read_le_uint32((uint8_t *)&mcdi->cluster_size);
 
@@ -1413,7 +2093,7 @@ static int Card_ReadDirEntry(int32_t cluster, int32_t fsindex, struct MCFsEntry
 
 	if (i < index) {
 		do {
-			r = Card_GetFatEntry(clust, &clust);
+			r = Card_GetFatEntry(ctx, clust, &clust);
 			if (r != sceMcResSucceed)
 				return r;
 
@@ -1431,29 +2111,31 @@ static int Card_ReadDirEntry(int32_t cluster, int32_t fsindex, struct MCFsEntry
 
 	uint32_t alloc_offset = read_le_uint32((uint8_t *)&mcdi->alloc_offset);
 
-	r = Card_ReadCluster(alloc_offset + clust, &mce);
+	r = Card_ReadCluster(ctx, alloc_offset + clust, &mce);
 	if (r != sceMcResSucceed)
 		return r;
 
 	*pfse = (struct MCFsEntry *)(mce->cl_data + ((fsindex % (cluster_size >> 9)) << 9));
+	Card_Stat(ctx, MCIO_STAT_DIRENT_READ, 1, start);
 
 	return sceMcResSucceed;
 }
 
-static int Card_CreateDirEntry(int32_t parent_cluster, int32_t num_entries, int32_t cluster, struct sceMcStDateTime *ctime)
+static int Card_CreateDirEntry(mcio_ctx_t *ctx, int32_t parent_cluster, int32_t num_entries, int32_t cluster, struct sceMcStDateTime *ctime)
 {
 	int r;
 	struct MCCacheEntry *mce;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 	struct MCFsEntry *mfe, *mfe_next, *pfse;
 
 	uint32_t alloc_offset = read_le_uint32((uint8_t *)&mcdi->alloc_offset);
 
-	r = Card_ReadCluster(alloc_offset + cluster, &mce);
+	r = Card_ReadCluster(ctx, alloc_offset + cluster, &mce);
 	if (r != sceMcResSucceed)
 		return r;
 
 	memset(mce->cl_data, 0, MCIO_CLUSTERSIZE);
+	Card_InvDirIndex(ctx, cluster);
 
 	mfe = (struct MCFsEntry *)mce->cl_data;
 	mfe_next = (struct MCFsEntry *)(mce->cl_data + sizeof(struct MCFsEntry));
@@ -1487,7 +2169,7 @@ static int Card_CreateDirEntry(int32_t parent_cluster, int32_t num_entries, int3
 	}
 	else {
 		/* entry is normal "." / ".." */
-		Card_ReadDirEntry(parent_cluster, 0, &pfse);
+		Card_ReadDirEntry(ctx, parent_cluster, 0, &pfse);
 
 		append_le_uint64((uint8_t *)&mfe_next->created, read_le_uint64((uint8_t *)&pfse->created));
 		mfe++;
@@ -1508,11 +2190,128 @@ static int Card_CreateDirEntry(int32_t parent_cluster, int32_t num_entries, int3
 	return sceMcResSucceed;
 }
 
-static int Card_GetDirInfo(struct MCFsEntry *pfse, char *filename, struct MCCacheDir *pcd, int32_t unknown_flag)
+static uint32_t Card_DirNameHash(const char *name, int32_t len)
+{
+	uint32_t h = 2166136261U;
+
+	while (len-- > 0)
+		h = (h ^ (uint8_t)*name++) * 16777619U;
+
+	return h;
+}
+
+static void Card_FreeDirIndex(struct MCDirIndex *di)
+{
+	free(di->buckets);
+	free(di->next);
+	free(di->names);
+	memset((void *)di, 0, sizeof(struct MCDirIndex));
+}
+
+static void Card_InvDirIndex(mcio_ctx_t *ctx, int32_t cluster) /* forget a directory index, all of them if cluster < 0 */
+{
+	int i;
+
+	for (i = 0; i < MAX_DIRINDEX; i++) {
+		if ((cluster < 0) || (ctx->dirindex[i].cluster == cluster))
+			Card_FreeDirIndex((struct MCDirIndex *)&ctx->dirindex[i]);
+	}
+}
+
+static struct MCDirIndex *Card_GetDirIndex(mcio_ctx_t *ctx, struct MCFsEntry *pfse)
+{
+	int i;
+	int32_t len;
+	uint32_t h;
+	struct MCDirIndex *di, *victim;
+	struct MCFsEntry *fse;
+
+	int32_t cluster = (int32_t)read_le_uint32((uint8_t *)&pfse->cluster);
+	int32_t length = (int32_t)read_le_uint32((uint8_t *)&pfse->length);
+
+	victim = NULL;
+	for (i = 0; i < MAX_DIRINDEX; i++) {
+		di = (struct MCDirIndex *)&ctx->dirindex[i];
+		if ((di->buckets != NULL) && (di->cluster == cluster)) {
+			if (di->length == length) {
+				di->lru = ++ctx->dirindex_lru;
+				return di;
+			}
+			victim = di; /* the directory grew, rebuild it */
+			break;
+		}
+		if ((victim == NULL) || ((victim->buckets != NULL) && ((di->buckets == NULL) || (di->lru < victim->lru))))
+			victim = di;
+	}
+
+	di = victim;
+	Card_FreeDirIndex(di);
+
+	for (h = 1; h < (uint32_t)length; h <<= 1)
+		;
+
+	di->buckets = (int32_t *)malloc(h * sizeof(int32_t));
+	di->next = (int32_t *)malloc(length * sizeof(int32_t));
+	di->names = (char (*)[32])malloc(length * 32);
+	if (!di->buckets || !di->next || !di->names)
+		goto fail;
+
+	memset(di->buckets, -1, h * sizeof(int32_t));
+	di->hash_mask = h - 1;
+	di->maxent = length;
+
+	/* walk backwards so that the lowest entry heads each chain, as a linear scan would find it first */
+	for (i = length - 1; i >= 0; i--) {
+		if (Card_ReadDirEntry(ctx, cluster, i, &fse) != sceMcResSucceed)
+			goto fail;
+
+		memcpy(di->names[i], fse->name, 32);
+		di->next[i] = -1;
+
+		if ((read_le_uint16((uint8_t *)&fse->mode) & sceMcFileAttrExists) == 0) {
+			di->maxent = i;
+			continue;
+		}
+
+		len = strnlen(fse->name, 32);
+		h = Card_DirNameHash(fse->name, len) & di->hash_mask;
+		di->next[i] = di->buckets[h];
+		di->buckets[h] = i;
+	}
+
+	di->cluster = cluster;
+	di->length = length;
+	di->lru = ++ctx->dirindex_lru;
+
+	return di;
+
+fail:
+	Card_FreeDirIndex(di);
+
+	return NULL;
+}
+
+static int Card_FindDirIndex(struct MCDirIndex *di, const char *filename, int32_t pos)
+{
+	int32_t i;
+
+	if (pos > 32)
+		return -1;
+
+	for (i = di->buckets[Card_DirNameHash(filename, pos) & di->hash_mask]; i >= 0; i = di->next[i]) {
+		if ((strnlen(di->names[i], 32) == (size_t)pos) && (memcmp(di->names[i], filename, pos) == 0))
+			return i;
+	}
+
+	return -1;
+}
+
+static int Card_GetDirInfo(mcio_ctx_t *ctx, struct MCFsEntry *pfse, char *filename, struct MCCacheDir *pcd, int32_t unknown_flag)
 {
 	int i, r;
 	int32_t ret, len, pos;
 	struct MCFsEntry *fse;
+	struct MCDirIndex *di;
 
 	pos = mcio_chrpos(filename, '/');
 	if (pos < 0)
@@ -1521,11 +2320,11 @@ static int Card_GetDirInfo(struct MCFsEntry *pfse, char *filename, struct MCCach
 	ret = 0;
 	if ((pos == 2) && (!strncmp(filename, "..", 2))) {
 
-		r = Card_ReadDirEntry((int32_t)read_le_uint32((uint8_t *)&pfse->cluster), 0, &fse);
+		r = Card_ReadDirEntry(ctx, (int32_t)read_le_uint32((uint8_t *)&pfse->cluster), 0, &fse);
 		if (r != sceMcResSucceed)
 			return r;
 
-		r = Card_ReadDirEntry(fse->cluster, 0, &fse);
+		r = Card_ReadDirEntry(ctx, fse->cluster, 0, &fse);
 		if (r != sceMcResSucceed)
 			return r;
 
@@ -1537,7 +2336,7 @@ static int Card_GetDirInfo(struct MCFsEntry *pfse, char *filename, struct MCCach
 			pcd->fsindex = dir_entry;
 		}
 
-		r = Card_ReadDirEntry(cluster, dir_entry, &fse);
+		r = Card_ReadDirEntry(ctx, cluster, dir_entry, &fse);
 		if (r != sceMcResSucceed)
 			return r;
 
@@ -1555,7 +2354,7 @@ static int Card_GetDirInfo(struct MCFsEntry *pfse, char *filename, struct MCCach
 	else {
 		if ((pos == 1) && (!strncmp(filename, ".", 1))) {
 			
-			r = Card_ReadDirEntry((int32_t)read_le_uint32((uint8_t *)&pfse->cluster), 0, &fse);
+			r = Card_ReadDirEntry(ctx, (int32_t)read_le_uint32((uint8_t *)&pfse->cluster), 0, &fse);
 			if (r != sceMcResSucceed)
 				return r;
 
@@ -1586,11 +2385,28 @@ static int Card_GetDirInfo(struct MCFsEntry *pfse, char *filename, struct MCCach
 	if ((pcd) && (pcd->maxent >= 0))
 		pcd->maxent = length;
 
-	if (length > 0) {
+	/* live entries are looked up through the directory name hash */
+	di = (unknown_flag && (length > 0)) ? Card_GetDirIndex(ctx, pfse) : NULL;
+	if (di != NULL) {
+		if ((pcd) && (di->maxent < pcd->maxent))
+			pcd->maxent = di->maxent;
+
+		if (ret == 0) {
+			i = Card_FindDirIndex(di, filename, pos);
+			if (i >= 0) {
+				ret = 1;
+				if (pcd) {
+					pcd->fsindex = i;
+					pcd->cluster = (int32_t)read_le_uint32((uint8_t *)&pfse->cluster);
+				}
+			}
+		}
+	}
+	else if (length > 0) {
 
 		i = 0;
 		do {
-			r = Card_ReadDirEntry((int32_t)read_le_uint32((uint8_t *)&pfse->cluster), i, &fse);
+			r = Card_ReadDirEntry(ctx, (int32_t)read_le_uint32((uint8_t *)&pfse->cluster), i, &fse);
 			if (r != sceMcResSucceed)
 				return r;
 
@@ -1648,14 +2464,14 @@ continue_check:
 	return ((ret < 1) ? 1 : 0);
 }
 
-static int Card_SetDirEntryState(int32_t cluster, int32_t fsindex, int32_t flags)
+static int Card_SetDirEntryState(mcio_ctx_t *ctx, int32_t cluster, int32_t fsindex, int32_t flags)
 {
 	int r, i;
 	int32_t fat_index, fat_entry;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 	struct MCFsEntry *fse;
 
-	r = Card_ReadDirEntry(cluster, fsindex, &fse);
+	r = Card_ReadDirEntry(ctx, cluster, fsindex, &fse);
 	if (r != sceMcResSucceed)
 		return r;
 
@@ -1664,18 +2480,16 @@ static int Card_SetDirEntryState(int32_t cluster, int32_t fsindex, int32_t flags
 			return sceMcResNoEntry;
 	}
 
-	i = 0;
-	do {
-		if (mcio_fdhandles[i].status == 0)
+	for (i = 0; i < ctx->fdhandles_count; i++) {
+		if (ctx->fdhandles[i]->status == 0)
 			continue;
 
-		if ((int32_t)mcio_fdhandles[i].cluster != cluster)
+		if ((int32_t)ctx->fdhandles[i]->cluster != cluster)
 			continue;
 
-		if ((int32_t)mcio_fdhandles[i].fsindex == fsindex)
+		if ((int32_t)ctx->fdhandles[i]->fsindex == fsindex)
 			return sceMcResDeniedPermit;
-
-	} while (++i < MAX_FDHANDLES);
+	}
 
 	uint16_t mode = read_le_uint16((uint8_t *)&fse->mode);
 
@@ -1684,7 +2498,9 @@ static int Card_SetDirEntryState(int32_t cluster, int32_t fsindex, int32_t flags
 	else
 		append_le_uint16((uint8_t *)&fse->mode, mode | sceMcFileAttrExists);
 
-	struct MCCacheEntry *mce = (struct MCCacheEntry *)*pmcio_mccache;
+	Card_InvDirIndex(ctx, cluster);
+
+	struct MCCacheEntry *mce = (struct MCCacheEntry *)ctx->mccache.next;
 	mce->wr_flag = -1;
 
 	fat_index = read_le_uint32((uint8_t *)&fse->cluster);
@@ -1695,7 +2511,7 @@ static int Card_SetDirEntryState(int32_t cluster, int32_t fsindex, int32_t flags
 		append_le_uint32((uint8_t *)&mcdi->unknown5, -1);
 
 		do {
-			r = Card_GetFatEntry(fat_index, &fat_entry);
+			r = Card_GetFatEntry(ctx, fat_index, &fat_entry);
 			if (r != sceMcResSucceed)
 				return r;
 
@@ -1707,7 +2523,7 @@ static int Card_SetDirEntryState(int32_t cluster, int32_t fsindex, int32_t flags
 			else
 				fat_entry |= 0x80000000;
 
-			r = Card_SetFatEntry(fat_index, fat_entry);
+			r = Card_SetFatEntry(ctx, fat_index, fat_entry);
 			if (r != sceMcResSucceed)
 				return r;
 
@@ -1719,11 +2535,11 @@ static int Card_SetDirEntryState(int32_t cluster, int32_t fsindex, int32_t flags
 	return sceMcResSucceed;
 }
 
-static int Card_CacheDirEntry(const char *filename, struct MCCacheDir *pcacheDir, struct MCFsEntry **pfse, int unknown_flag)
+static int Card_CacheDirEntry(mcio_ctx_t *ctx, const char *filename, struct MCCacheDir *pcacheDir, struct MCFsEntry **pfse, int unknown_flag)
 {
 	int r;
 	int32_t fsindex, cluster, fmode;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 	struct MCFsEntry *fse;
 	struct MCCacheDir cacheDir;
 	char *p;
@@ -1744,7 +2560,7 @@ static int Card_CacheDirEntry(const char *filename, struct MCCacheDir *pcacheDir
 		fsindex = read_le_uint32((uint8_t *)&mcdi->unknown1);
 	}
 
-	r = Card_ReadDirEntry(cluster, fsindex, &fse);
+	r = Card_ReadDirEntry(ctx, cluster, fsindex, &fse);
 	if (r != sceMcResSucceed)
 		return r;
 
@@ -1758,11 +2574,11 @@ static int Card_CacheDirEntry(const char *filename, struct MCCacheDir *pcacheDir
 			return sceMcResSucceed;
 		}
 
-		memcpy((void *)&mcio_dircache[0], (void *)fse, sizeof(struct MCFsEntry));
+		memcpy((void *)&ctx->dircache[0], (void *)fse, sizeof(struct MCFsEntry));
 
-		r = Card_GetDirInfo((struct MCFsEntry *)&mcio_dircache[0], ".", pcacheDir, unknown_flag);
+		r = Card_GetDirInfo(ctx, (struct MCFsEntry *)&ctx->dircache[0], ".", pcacheDir, unknown_flag);
 
-		Card_ReadDirEntry(pcacheDir->cluster, pcacheDir->fsindex, pfse);
+		Card_ReadDirEntry(ctx, pcacheDir->cluster, pcacheDir->fsindex, pfse);
 
 		if (r > 0)
 			return 2;
@@ -1777,9 +2593,9 @@ static int Card_CacheDirEntry(const char *filename, struct MCCacheDir *pcacheDir
 			if ((mode & fmode) != fmode)
 				return sceMcResDeniedPermit;
 
-			memcpy((void *)&mcio_dircache[0], (void *)fse, sizeof(struct MCFsEntry));
+			memcpy((void *)&ctx->dircache[0], (void *)fse, sizeof(struct MCFsEntry));
 
-			r = Card_GetDirInfo((struct MCFsEntry *)&mcio_dircache[0], p, pcacheDir, unknown_flag);
+			r = Card_GetDirInfo(ctx, (struct MCFsEntry *)&ctx->dircache[0], p, pcacheDir, unknown_flag);
 
 			if (r > 0) {
 				if (mcio_chrpos(p, '/') >= 0)
@@ -1797,10 +2613,10 @@ static int Card_CacheDirEntry(const char *filename, struct MCCacheDir *pcacheDir
 				cluster = pcacheDir->cluster;
 				fsindex = pcacheDir->fsindex;
 
-				Card_ReadDirEntry(cluster, fsindex, &fse);
+				Card_ReadDirEntry(ctx, cluster, fsindex, &fse);
 			}
 			else {
-				Card_ReadDirEntry(pcacheDir->cluster, pcacheDir->fsindex, pfse);
+				Card_ReadDirEntry(ctx, pcacheDir->cluster, pcacheDir->fsindex, pfse);
 
 				return sceMcResSucceed;
 			}
@@ -1809,12 +2625,12 @@ static int Card_CacheDirEntry(const char *filename, struct MCCacheDir *pcacheDir
 	return sceMcResSucceed;
 }
 
-static int Card_GetDirEntryCluster(int32_t cluster, int32_t fsindex)
+static int Card_GetDirEntryCluster(mcio_ctx_t *ctx, int32_t cluster, int32_t fsindex)
 {
 	int r, i;
 	int32_t maxent, index, clust;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
-	struct MCFatCache *fci = (struct MCFatCache *)&mcio_fatcache;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
+	struct MCFatCache *fci = (struct MCFatCache *)&ctx->fatcache;
 
 	uint32_t cluster_size = (int32_t)read_le_uint32((uint8_t *)&mcdi->cluster_size);
 
@@ -1844,7 +2660,7 @@ static int Card_GetDirEntryCluster(int32_t cluster, int32_t fsindex)
 
 	if (i < index) {
 		do {
-			r = Card_GetFatEntry(clust, &clust);
+			r = Card_GetFatEntry(ctx, clust, &clust);
 			if (r != sceMcResSucceed)
 				return r;
 
@@ -1865,13 +2681,13 @@ static int Card_GetDirEntryCluster(int32_t cluster, int32_t fsindex)
 	return clust + alloc_offset;
 }
 
-static int Card_CheckBackupBlocks(void)
+static int Card_CheckBackupBlocks(mcio_ctx_t *ctx)
 {
 	int r1, r2, r;
 	int32_t value1, value2, eccsize;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 	struct MCCacheEntry *mce;
-	int32_t *pagebuf = (int32_t *)&mcio_pagebuf;
+	int32_t *pagebuf = (int32_t *)&ctx->pagebuf;
 
 	uint32_t backup_block1 = read_le_uint32((uint8_t *)&mcdi->backup_block1);
 	uint32_t backup_block2 = read_le_uint32((uint8_t *)&mcdi->backup_block2);
@@ -1881,7 +2697,7 @@ static int Card_CheckBackupBlocks(void)
 	uint16_t pages_per_cluster = read_le_uint16((uint8_t *)&mcdi->pages_per_cluster);
 
 	/* First check backup block2 to see if it's in erased state */
-	r1 = Card_ReadPage(backup_block2 * blocksize, mcio_pagebuf);
+	r1 = Card_ReadPage(ctx, backup_block2 * blocksize, ctx->pagebuf);
 
 	value1 = *pagebuf;
 	if (((mcdi->cardflags & CF_ERASE_ZEROES) != 0) && (value1 == 0))
@@ -1889,7 +2705,7 @@ static int Card_CheckBackupBlocks(void)
 	if (value1 != -1)
 		value1 = value1 & 0x7fffffff;
 
-	r2 = Card_ReadPage((backup_block2 * blocksize) + 1, mcio_pagebuf);
+	r2 = Card_ReadPage(ctx, (backup_block2 * blocksize) + 1, ctx->pagebuf);
 
 	value2 = *pagebuf;
 	if (((mcdi->cardflags & CF_ERASE_ZEROES) != 0) && (value2 == 0))
@@ -1910,17 +2726,17 @@ static int Card_CheckBackupBlocks(void)
 	 */
 	for (r1 = 0; r1 < (int32_t) clusters_per_block; r1++) {
 
-		Card_ReadCluster((backup_block1 * clusters_per_block) + r1, &mce);
+		Card_ReadCluster(ctx, (backup_block1 * clusters_per_block) + r1, &mce);
 		mce->rd_flag = 1;
 
 		for (r2 = 0; r2 < pages_per_cluster; r2++) {
-			mcio_pagedata[(r1 * ((pages_per_cluster << 16) >> 16)) + r2] = \
+			ctx->pagedata[(r1 * ((pages_per_cluster << 16) >> 16)) + r2] = \
 				(void *)(mce->cl_data + (r2 * pagesize));
 		}
 	}
 
 	/* Erase the block where data must be written */
-	r = Card_EraseBlock(value1, (uint8_t **)mcio_pagedata, (void *)mcio_eccdata);
+	r = Card_EraseBlock(ctx, value1, (uint8_t **)ctx->pagedata, (void *)ctx->eccdata);
 	if (r != sceMcResSucceed)
 		return r;
 
@@ -1932,63 +2748,67 @@ static int Card_CheckBackupBlocks(void)
 			eccsize += 0x1f;
 		eccsize = eccsize >> 5;
 
-		r = Card_WritePageData((value1 * ((blocksize << 16) >> 16)) + r1, \
-			mcio_pagedata[r1], (uint8_t *)(mcio_eccdata + (eccsize * r1)));
+		r = Card_WritePageData(ctx, (value1 * ((blocksize << 16) >> 16)) + r1, \
+			ctx->pagedata[r1], (uint8_t *)(ctx->eccdata + (eccsize * r1)));
 
 		if (r != sceMcResSucceed)
 			return r;
 	}
 
 	for (r1 = 0; r1 < (int32_t)clusters_per_block; r1++)
-		Card_FreeCluster((backup_block1 * clusters_per_block) + r1);
+		Card_FreeCluster(ctx, (backup_block1 * clusters_per_block) + r1);
+
+	/* the restored block may hold FAT or directory clusters */
+	Card_DropFat(ctx);
+	Card_InvDirIndex(ctx, -1);
 
 check_done:
 	/* Finally erase backup block2 */
-	return Card_EraseBlock(backup_block2, NULL, NULL);
+	return Card_EraseBlock(ctx, backup_block2, NULL, NULL);
 }
 
-static int Card_SetDeviceInfo(void)
+static int Card_SetDeviceInfo(mcio_ctx_t *ctx)
 {
 	int32_t r, allocatable_clusters_per_card, iscluster_valid, current_allocatable_cluster, cluster_cnt;
-	struct MCDevInfo *mcdi = &mcio_devinfo;
+	struct MCDevInfo *mcdi = &ctx->devinfo;
 	struct MCFsEntry *pfse;
 
 	memset((void *)mcdi, 0, sizeof(struct MCDevInfo));
 
-	r = Card_SetDeviceSpecs();
+	r = Card_SetDeviceSpecs(ctx);
 	if (r != sceMcResSucceed)
 		return sceMcResFailSetDeviceSpecs;
 
-	r = Card_ReadPage(0, mcio_pagebuf);
+	r = Card_ReadPage(ctx, 0, ctx->pagebuf);
 	if (r == sceMcResNoFormat)
 		return sceMcResNoFormat; /* should rebuild a valid superblock here */
 	if (r != sceMcResSucceed)
 		return sceMcResFailIO;
 
-	if (strncmp(SUPERBLOCK_MAGIC, (char *)mcio_pagebuf, 28) != 0)
+	if (strncmp(SUPERBLOCK_MAGIC, (char *)ctx->pagebuf, 28) != 0)
 		return sceMcResNoFormat;
 	
-	if (((mcio_pagebuf[28] - 48) == 1) && ((mcio_pagebuf[30] - 48) == 0)) /* check ver major & minor */
+	if (((ctx->pagebuf[28] - 48) == 1) && ((ctx->pagebuf[30] - 48) == 0)) /* check ver major & minor */
 		return sceMcResNoFormat;
 
 	uint8_t *p = (uint8_t *)mcdi;
 	for (r=0; r<336; r++)
-		p[r] = mcio_pagebuf[r];
+		p[r] = ctx->pagebuf[r];
 
 	mcdi->cardtype = sceMcTypePS2; /* <-- */
 
-	r = Card_CheckBackupBlocks();
+	r = Card_CheckBackupBlocks(ctx);
 	if (r != sceMcResSucceed)
 		return sceMcResFailCheckBackupBlocks;
 
-	r = Card_ReadDirEntry(0, 0, &pfse);
+	r = Card_ReadDirEntry(ctx, 0, 0, &pfse);
 	if (r != sceMcResSucceed)
 		return sceMcResNoFormat;
 
 	if (strcmp(pfse->name, ".") != 0)
 		return sceMcResNoFormat;
 
-	if (Card_ReadDirEntry(0, 1, &pfse) != sceMcResSucceed)
+	if (Card_ReadDirEntry(ctx, 0, 1, &pfse) != sceMcResSucceed)
 		return -45;
 
 	if (strcmp(pfse->name, "..") != 0)
@@ -2002,7 +2822,7 @@ static int Card_SetDeviceInfo(void)
 	alloc_end = read_le_uint32((uint8_t *)&mcdi->alloc_end);
 	backup_block2 = read_le_uint32((uint8_t *)&mcdi->backup_block2);
 
-	if (((mcio_pagebuf[28] - 48) == 1) && ((mcio_pagebuf[30] - 48) == 1)) { /* check ver major & minor */
+	if (((ctx->pagebuf[28] - 48) == 1) && ((ctx->pagebuf[30] - 48) == 1)) { /* check ver major & minor */
 		if ((clusters_per_block * backup_block2) == alloc_end)
 			append_le_uint32((uint8_t *)&mcdi->alloc_end, (clusters_per_block * backup_block2) - alloc_offset);
 	}
@@ -2014,25 +2834,40 @@ static int Card_SetDeviceInfo(void)
 	long_multiply(clusters_per_card, 0x10624dd3, &hi, &lo);
 	temp = (hi >> 6) - (clusters_per_card >> 31);
 	allocatable_clusters_per_card = (((((temp << 5) - temp) << 2) + temp) << 3) + 1;
-	iscluster_valid = 0;
+	uint32_t bad_blocks[16];
+	int bad_count = 0;
+
+	for (r=0; r<16; r++) {
+		bad_blocks[bad_count] = read_le_uint32((uint8_t *)&mcdi->bad_block_list[r]);
+		if (bad_blocks[bad_count] < clusters_per_card / clusters_per_block + 1)
+			bad_count++;
+	}
+
 	cluster_cnt = 0;
 	current_allocatable_cluster = alloc_offset;
 
+	/* count allocatable clusters a block at a time, the clusters of a bad block are skipped */
 	while (cluster_cnt < allocatable_clusters_per_card) {
 		if (current_allocatable_cluster >= (int32_t)clusters_per_card)
 			break;
 
-		if (((current_allocatable_cluster % clusters_per_block) == 0) \
-			|| (alloc_offset == (uint32_t)current_allocatable_cluster)) {
-			iscluster_valid = 1;
-			for (r=0; r<16; r++) {
-				if ((current_allocatable_cluster / clusters_per_block) == read_le_uint32((uint8_t *)&mcdi->bad_block_list[r]))
-					iscluster_valid = 0;
-			}
+		uint32_t block = current_allocatable_cluster / clusters_per_block;
+		int32_t block_end = (block + 1) * clusters_per_block;
+		if (block_end > (int32_t)clusters_per_card)
+			block_end = clusters_per_card;
+
+		iscluster_valid = 1;
+		for (r=0; r<bad_count; r++) {
+			if (block == bad_blocks[r])
+				iscluster_valid = 0;
+		}
+
+		if (iscluster_valid == 1) {
+			if (block_end - current_allocatable_cluster > allocatable_clusters_per_card - cluster_cnt)
+				block_end = current_allocatable_cluster + (allocatable_clusters_per_card - cluster_cnt);
+			cluster_cnt += block_end - current_allocatable_cluster;
 		}
-		if (iscluster_valid == 1)
-			cluster_cnt++;
-		current_allocatable_cluster++;
+		current_allocatable_cluster = block_end;
 	}
 
 	append_le_uint32((uint8_t *)&mcdi->max_allocatable_clusters, current_allocatable_cluster - alloc_offset);
@@ -2040,11 +2875,11 @@ static int Card_SetDeviceInfo(void)
 	return sceMcResSucceed;
 }
 
-static int Card_ReportBadBlocks(void)
+static int Card_ReportBadBlocks(mcio_ctx_t *ctx)
 {
 	int r, i;
 	int32_t block, bad_blocks, page, erase_byte, err_cnt, err_limit;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 	uint8_t *p;
 
 	memset((void *)mcdi->bad_block_list, -1, 128);
@@ -2067,7 +2902,7 @@ static int Card_ReportBadBlocks(void)
 
 		err_cnt = 0;
 		for (page = 0; page < 2; page++) {
-			r = Card_ReadPage((block * blocksize) + page, mcio_pagebuf);
+			r = Card_ReadPage(ctx, (block * blocksize) + page, ctx->pagebuf);
 			if (r == sceMcResNoFormat) {
 				append_le_uint32((uint8_t *)&mcdi->bad_block_list[bad_blocks], block);
 				bad_blocks++;
@@ -2077,7 +2912,7 @@ static int Card_ReportBadBlocks(void)
 				return r;
 
 			if ((mcdi->cardflags & CF_USE_ECC) == 0) {
-				p = (uint8_t *)&mcio_pagebuf;
+				p = (uint8_t *)&ctx->pagebuf;
 				for (i = 0; i < pagesize; i++) {
 					/* check if the content of page is clean */
 					if (*p++ != erase_byte)
@@ -2096,12 +2931,12 @@ static int Card_ReportBadBlocks(void)
 	return sceMcResSucceed;
 }
 
-static int Card_Unformat(void)
+static int Card_Unformat(mcio_ctx_t *ctx)
 {
 	int r, i, j, z, l;
 	int32_t pageword_cnt, page, blocks_on_card, erase_byte, err_cnt;
 	uint32_t erase_value;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 
 	uint16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
 	uint16_t blocksize = read_le_uint16((uint8_t *)&mcdi->blocksize);
@@ -2111,13 +2946,16 @@ static int Card_Unformat(void)
 	pageword_cnt = pagesize >> 2;
 	blocks_on_card = clusters_per_card / clusters_per_block;
 
+	Card_DropFat(ctx);
+	Card_InvDirIndex(ctx, -1);
+
 	if (mcdi->cardflags & CF_ERASE_ZEROES)
 		erase_value = 0xffffffff;
 	else
 		erase_value = 0x00000000;
 
-	memset(mcio_pagebuf, erase_value, pagesize);
-	memset(mcio_eccdata, erase_value, 128);
+	memset(ctx->pagebuf, erase_value, pagesize);
+	memset(ctx->eccdata, erase_value, 128);
 
 	erase_byte = erase_value & 0xff;
 
@@ -2138,7 +2976,7 @@ static int Card_Unformat(void)
 			err_cnt = 0;
 			j = -1;
 			for (z = 0; z < blocksize; z++) {
-				r = Card_ReadPage(page + z, mcio_pagebuf);
+				r = Card_ReadPage(ctx, page + z, ctx->pagebuf);
 				if (r == sceMcResNoFormat) {
 					j = -2;
 					break;
@@ -2148,7 +2986,7 @@ static int Card_Unformat(void)
 
 				if ((mcdi->cardflags & CF_USE_ECC) == 0) {
 					for (l = 0; l < pagesize; l++) {
-						if (mcio_pagebuf[l] != erase_byte)
+						if (ctx->pagebuf[l] != erase_byte)
 							err_cnt++;
 						if (err_cnt >= (int32_t)(clusters_per_block << 6)) {
 							j = 16;
@@ -2165,37 +3003,41 @@ static int Card_Unformat(void)
 			j = 16;
 lbl1:
 		if (j == 16) {
-			r = Card_EraseBlock(i, NULL, NULL);
+			r = Card_EraseBlock(ctx, i, NULL, NULL);
 			if (r != sceMcResSucceed)
 				return -43;
 		}
 		else {
-			memset(mcio_pagebuf, erase_value, pagesize);
+			memset(ctx->pagebuf, erase_value, pagesize);
 			for (z = 0; z < blocksize; z++) {
-				r = Card_WritePageData(page + z, mcio_pagebuf, mcio_eccdata);
+				r = Card_WritePageData(ctx, page + z, ctx->pagebuf, ctx->eccdata);
 				if (r != sceMcResSucceed)
 					return -44;
 			}
 		}
 	}
 
-	r = Card_EraseBlock(0, NULL, NULL);
+	r = Card_EraseBlock(ctx, 0, NULL, NULL);
 	if (r != sceMcResSucceed)
 		return -45;
 
 	return sceMcResSucceed;
 }
 
-static int Card_Format(void)
+static int Card_Format(mcio_ctx_t *ctx)
 {
 	int r;
 	uint32_t i;
 	int32_t size, ifc_index, indirect_offset, allocatable_clusters_per_card;
 	int32_t ifc_length, fat_length, fat_entry, alloc_offset;
 	int j = 0, z = 0;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 	struct MCCacheEntry *mce;
 
+	/* the FAT and root directory are rebuilt from scratch below */
+	Card_DropFat(ctx);
+	Card_InvDirIndex(ctx, -1);
+
 	if ((int32_t)read_le_uint32((uint8_t *)&mcdi->cardform) == sceMcResNoFormat) {
 		for (i = 0; i < 32; i++)
 			append_le_uint32((uint8_t *)&mcdi->bad_block_list[i], -1);
@@ -2209,7 +3051,7 @@ static int Card_Format(void)
 			goto lbl1;
 	}
 
-	r = Card_ReportBadBlocks();
+	r = Card_ReportBadBlocks(ctx);
 	if ((r != sceMcResSucceed) && (r != sceMcResNoFormat))
 		return sceMcResChangedCard;
 
@@ -2232,7 +3074,7 @@ lbl1:
 
 	/* clear first 8 clusters */
 	for (i = 0; i < (uint32_t)size; i++) {
-		r = Card_WriteCluster(i, 1);
+		r = Card_WriteCluster(ctx, i, 1);
 		if (r == 0)
 			return sceMcResNoFormat;
 
@@ -2254,7 +3096,7 @@ lbl1:
 			return sceMcResNoFormat;
 
 		for ( ; i < clusters_per_card; i++) {
-			if (Card_WriteCluster(i, 1) != 0)
+			if (Card_WriteCluster(ctx, i, 1) != 0)
 				break;
 		}
 
@@ -2274,7 +3116,7 @@ lbl1:
 			indirect_offset = j % FATentries_per_cluster;
 
 			if (indirect_offset == 0) {
-				if (Card_ReadCluster(read_le_uint32((uint8_t *)&mcdi->ifc_list[ifc_index]), &mce) != sceMcResSucceed)
+				if (Card_ReadCluster(ctx, read_le_uint32((uint8_t *)&mcdi->ifc_list[ifc_index]), &mce) != sceMcResSucceed)
 					return -42;
 				mce->wr_flag = 1;
 			}
@@ -2283,7 +3125,7 @@ lbl1:
 				return sceMcResNoFormat;
 
 			do {
-				r = Card_WriteCluster(i, 1);
+				r = Card_WriteCluster(ctx, i, 1);
 				if (r == 1)
 					break;
 
@@ -2313,7 +3155,7 @@ lbl1:
 	/* clear backup blocks */
 	for (i = (clusters_per_card / clusters_per_block) - 1; i > 0; i--) {
 
-		r = Card_WriteCluster(clusters_per_block * i, 1);
+		r = Card_WriteCluster(ctx, clusters_per_block * i, 1);
 		if (r < 0)
 			return -44;
 
@@ -2326,7 +3168,7 @@ lbl1:
 	}
 
 	/* set backup block2 to erased state */
-	if (Card_EraseBlock(read_le_uint32((uint8_t *)&mcdi->backup_block2), NULL, NULL) != sceMcResSucceed)
+	if (Card_EraseBlock(ctx, read_le_uint32((uint8_t *)&mcdi->backup_block2), NULL, NULL) != sceMcResSucceed)
 		return -45;
 
 	uint32_t hi, lo, temp;
@@ -2340,7 +3182,7 @@ lbl1:
 	if (j < (int32_t)(i * clusters_per_block)) {
 		z = 0;
 		do { /* quick check for bad clusters */
-			r = Card_WriteCluster(j, 0);
+			r = Card_WriteCluster(ctx, j, 0);
 			if (r == 1) {
 				if (z == 0) {
 					append_le_uint32((uint8_t *)&mcdi->alloc_offset, j);
@@ -2359,7 +3201,7 @@ lbl1:
 				fat_entry = 0xfffffffd; /* marking bad cluster */
 			}
 
-			if (Card_SetFatEntry(j - read_le_uint32((uint8_t *)&mcdi->alloc_offset), fat_entry) != sceMcResSucceed)
+			if (Card_SetFatEntry(ctx, j - read_le_uint32((uint8_t *)&mcdi->alloc_offset), fat_entry) != sceMcResSucceed)
 				return -46;
 
 			j++;
@@ -2381,7 +3223,7 @@ lbl1:
 		else
 			size = i;
 
-		if (Card_ReadCluster(size >> 10, &mce) != sceMcResSucceed)
+		if (Card_ReadCluster(ctx, size >> 10, &mce) != sceMcResSucceed)
 			return -48;
 
 		size = MCIO_CLUSTERSIZE;
@@ -2399,11 +3241,11 @@ lbl1:
 	append_le_uint32((uint8_t *)&mcdi->rootdir_cluster2, mcdi->rootdir_cluster);
 
 	/* Create root dir */
-	if (Card_CreateDirEntry(0, 0, 0, NULL) != sceMcResSucceed)
+	if (Card_CreateDirEntry(ctx, 0, 0, 0, NULL) != sceMcResSucceed)
 		return -49;
 
 	/* finally flush cache to memcard */
-	r = Card_FlushMCCache();
+	r = Card_FlushMCCache(ctx);
 	if (r != sceMcResSucceed)
 		return r;
 
@@ -2412,13 +3254,13 @@ lbl1:
 	return sceMcResSucceed;
 }
 
-static int Card_Delete(const char *filename, int flags)
+static int Card_Delete(mcio_ctx_t *ctx, const char *filename, int flags)
 {
 	int r, i;
 	struct MCCacheDir cacheDir;
 	struct MCFsEntry *fse1, *fse2;
 
-	r = Card_CacheDirEntry(filename, &cacheDir, &fse1, ((uint32_t)(flags < 1)) ? 1 : 0);
+	r = Card_CacheDirEntry(ctx, filename, &cacheDir, &fse1, ((uint32_t)(flags < 1)) ? 1 : 0);
 	if (r > 0)
 		return sceMcResNoEntry;
 	if (r < 0)
@@ -2444,7 +3286,7 @@ static int Card_Delete(const char *filename, int flags)
 	i = 2;
 	if ((!flags) && (mode & sceMcFileAttrSubdir) && (i < length)) {
 		do {
-			r = Card_ReadDirEntry(cluster, i, &fse2);
+			r = Card_ReadDirEntry(ctx, cluster, i, &fse2);
 			if (r != sceMcResSucceed)
 				return r;
 
@@ -2454,57 +3296,133 @@ static int Card_Delete(const char *filename, int flags)
 		} while (++i < length);
 	}
 
-	r = Card_SetDirEntryState(cacheDir.cluster, cacheDir.fsindex, flags);
+	r = Card_SetDirEntryState(ctx, cacheDir.cluster, cacheDir.fsindex, flags);
 	if (r != sceMcResSucceed)
 		return r;
 
-	r = Card_FlushMCCache();
+	r = Card_FlushMCCache(ctx);
 	if (r != sceMcResSucceed)
 		return r;
 
 	return sceMcResSucceed;
 }
 
-static int Card_Probe(void)
+static int Card_Probe(mcio_ctx_t *ctx)
 {
 	int r;
 	struct MCDevInfo *mcdi;
 
-	r = Card_SetDeviceInfo();
+	r = Card_SetDeviceInfo(ctx);
 	if (r == sceMcResSucceed)
 		return sceMcResSucceed;
 
 	if (r != sceMcResNoFormat)
 		return sceMcResFailDetect2;
 
-	mcdi = &mcio_devinfo;
+	mcdi = &ctx->devinfo;
 	append_le_uint32((uint8_t *)&mcdi->cardform, r);
 
 	return r;
 }
 
-static void Card_InvFileHandles(void)
+static struct MCFHandle *Card_Handle(mcio_ctx_t *ctx, int fd) /* NULL unless fd is a slot of the table */
+{
+	if ((fd < 0) || (fd >= ctx->fdhandles_count))
+		return NULL;
+
+	return ctx->fdhandles[fd];
+}
+
+static int Card_GrowHandles(mcio_ctx_t *ctx)
+{
+	int32_t i, count;
+	struct MCFHandle **table, *fh;
+
+	count = (ctx->fdhandles_count) ? ctx->fdhandles_count * 2 : MIN_FDHANDLES;
+
+	table = (struct MCFHandle **)realloc(ctx->fdhandles, count * sizeof(struct MCFHandle *));
+	if (table == NULL)
+		return sceMcResUpLimitHandle;
+
+	ctx->fdhandles = table;
+
+	/* handles are allocated one by one so that pointers to open ones survive the growth */
+	for (i = ctx->fdhandles_count; i < count; i++) {
+		fh = (struct MCFHandle *)calloc(1, sizeof(struct MCFHandle));
+		if (fh == NULL)
+			break;
+
+		table[i] = fh;
+	}
+
+	if (i == ctx->fdhandles_count)
+		return sceMcResUpLimitHandle;
+
+	/* pushed from the top down, the lowest new slot is handed out first */
+	count = i;
+	while (--i >= ctx->fdhandles_count) {
+		table[i]->next_free = ctx->fdhandles_free;
+		ctx->fdhandles_free = i;
+	}
+	ctx->fdhandles_count = count;
+
+	return sceMcResSucceed;
+}
+
+static int Card_AllocHandle(mcio_ctx_t *ctx) /* take a free slot, cleared but for its chain buffer */
+{
+	int r, fd;
+	struct MCFHandle *fh;
+
+	if (ctx->fdhandles_free < 0) {
+		r = Card_GrowHandles(ctx);
+		if (r != sceMcResSucceed)
+			return r;
+	}
+
+	fd = ctx->fdhandles_free;
+	fh = ctx->fdhandles[fd];
+	ctx->fdhandles_free = fh->next_free;
+
+	Card_ClearHandle(fh);
+	fh->next_free = FD_BUSY;
+
+	return fd;
+}
+
+static void Card_ReleaseHandle(mcio_ctx_t *ctx, int fd)
+{
+	struct MCFHandle *fh = ctx->fdhandles[fd];
+
+	fh->status = 0;
+
+	if (fh->next_free != FD_BUSY) /* already free */
+		return;
+
+	fh->next_free = ctx->fdhandles_free;
+	ctx->fdhandles_free = fd;
+}
+
+static void Card_InvFileHandles(mcio_ctx_t *ctx)
 {
 	int i;
-	struct MCFHandle *fh = (struct MCFHandle *)&mcio_fdhandles[0];
 
-	for (i=0; i<MAX_FDHANDLES; i++) {
-		fh->status = 0;
-		fh++;
+	for (i = 0; i < ctx->fdhandles_count; i++) {
+		if (ctx->fdhandles[i]->status != 0)
+			Card_ReleaseHandle(ctx, i);
 	}
 }
 
-static int Card_FileOpen(const char *filename, int flags)
+static int Card_FileOpenHandle(mcio_ctx_t *ctx, int32_t fd, const char *filename, int flags)
 {
 	int i, r;
-	int32_t fd, fsindex, fsoffset, fat_index, rdflag, wrflag, pos, mcfree;
+	int32_t fsindex, fsoffset, fat_index, rdflag, wrflag, pos, mcfree;
 	struct MCFHandle *fh, *fh2;
 	struct MCCacheDir cacheDir;
 	struct MCFsEntry *fse1, *fse2;
-	struct MCCacheEntry *mce;
 	char *p;
 	int32_t fat_entry;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 
 	if ((flags & sceMcFileCreateFile) != 0)
 		flags |= sceMcFileAttrWriteable;
@@ -2512,19 +3430,7 @@ static int Card_FileOpen(const char *filename, int flags)
 	if (filename[0] == 0)
 		return sceMcResNoEntry;
 
-	fd = 0;
-	do {
-		fh = (struct MCFHandle *)&mcio_fdhandles[fd];
-		if (fh->status == 0)
-			break;
-	} while (++fd < MAX_FDHANDLES);
-
-	if (fd == MAX_FDHANDLES)
-		return sceMcResUpLimitHandle;
-
-	fh = (struct MCFHandle *)&mcio_fdhandles[fd];
-
-	memset((void *)fh, 0, sizeof(struct MCFHandle));
+	fh = ctx->fdhandles[fd];
 
 	if ((flags & (sceMcFileCreateFile | sceMcFileCreateDir)) == 0)
 		cacheDir.maxent = -1;
@@ -2532,12 +3438,12 @@ static int Card_FileOpen(const char *filename, int flags)
 		cacheDir.maxent = 0;
 
 	fse1 = NULL;
-	r = Card_CacheDirEntry(filename, &cacheDir, &fse1, 1);
+	r = Card_CacheDirEntry(ctx, filename, &cacheDir, &fse1, 1);
 	if (r < 0)
 		return r;
 
 	if (fse1) {
-		memcpy((void *)&mcio_dircache[1], (void *)fse1, sizeof(struct MCFsEntry));
+		memcpy((void *)&ctx->dircache[1], (void *)fse1, sizeof(struct MCFsEntry));
 
 		uint16_t mode = read_le_uint16((uint8_t *)&fse1->mode);
 		if ((flags == 0) && ((mode & sceMcFileAttrExists) == 0))
@@ -2561,6 +3467,7 @@ static int Card_FileOpen(const char *filename, int flags)
 	fh->freeclink = -1;
 	fh->clink = -1;
 	fh->clust_offset = 0;
+	fh->chain_len = 0;
 	fh->filesize = 0;
 	fh->position = 0;
 	fh->unknown2 = 0;
@@ -2572,39 +3479,38 @@ static int Card_FileOpen(const char *filename, int flags)
 	
 	if (r == 0) {
 
-		if ((wrflag != 0) && ((mcio_dircache[1].mode & sceMcFileAttrWriteable) == 0))
+		if ((wrflag != 0) && ((ctx->dircache[1].mode & sceMcFileAttrWriteable) == 0))
 			return sceMcResDeniedPermit;
 
-		r = Card_ReadDirEntry(cacheDir.cluster, 0, &fse2);
+		r = Card_ReadDirEntry(ctx, cacheDir.cluster, 0, &fse2);
 		if (r != sceMcResSucceed)
 			return r;
 
 		fh->parent_cluster = read_le_uint32((uint8_t *)&fse2->cluster);
 		fh->parent_fsindex = read_le_uint32((uint8_t *)&fse2->dir_entry);
 
-		if ((mcio_dircache[1].mode & sceMcFileAttrSubdir) != 0) {
-			if ((mcio_dircache[1].mode & sceMcFileAttrReadable) == 0)
+		if ((ctx->dircache[1].mode & sceMcFileAttrSubdir) != 0) {
+			if ((ctx->dircache[1].mode & sceMcFileAttrReadable) == 0)
 				return sceMcResDeniedPermit;
 
 			if ((flags & sceMcFileAttrSubdir) == 0)
 				return sceMcResNotFile;
 
-			fh->freeclink = mcio_dircache[1].cluster;
+			fh->freeclink = ctx->dircache[1].cluster;
 			fh->rdflag = 0;
 			fh->wrflag = 0;
 			fh->unknown1 = 0;
 			fh->drdflag = 1;
 			fh->status = 1;
-			fh->filesize = mcio_dircache[1].length;
+			fh->filesize = ctx->dircache[1].length;
 			fh->clink = fh->freeclink;
 
 			return fd;
 		}
 
 		if ((flags & sceMcFileAttrWriteable) != 0) {
-			i = 0;
-			do {
-				fh2 = (struct MCFHandle *)&mcio_fdhandles[i];
+			for (i = 0; i < ctx->fdhandles_count; i++) {
+				fh2 = ctx->fdhandles[i];
 
 				if ((fh2->status == 0) \
 					|| (fh2->cluster != (uint32_t) cacheDir.cluster) || (fh2->fsindex != (uint32_t) cacheDir.fsindex))
@@ -2612,13 +3518,12 @@ static int Card_FileOpen(const char *filename, int flags)
 
 				if (fh2->wrflag != 0)
 					return sceMcResDeniedPermit;
-
-			} while (++i < MAX_FDHANDLES);
+			}
 		}
 
 		if ((flags & sceMcFileCreateFile) != 0) {
-			r = Card_SetDirEntryState(cacheDir.cluster, cacheDir.fsindex, 0);
-			Card_FlushMCCache();
+			r = Card_SetDirEntryState(ctx, cacheDir.cluster, cacheDir.fsindex, 0);
+			Card_FlushMCCache(ctx);
 
 			if (r != sceMcResSucceed)
 				return r;
@@ -2627,17 +3532,17 @@ static int Card_FileOpen(const char *filename, int flags)
 				cacheDir.maxent = cacheDir.fsindex;
 		}
 		else {
-			fh->freeclink = mcio_dircache[1].cluster;
-			fh->filesize = mcio_dircache[1].length;
+			fh->freeclink = ctx->dircache[1].cluster;
+			fh->filesize = ctx->dircache[1].length;
 			fh->clink = fh->freeclink;
 
 			if (fh->rdflag != 0)
-				fh->rdflag = (*((uint8_t *)&mcio_dircache[1].mode)) & sceMcFileAttrReadable;
+				fh->rdflag = (*((uint8_t *)&ctx->dircache[1].mode)) & sceMcFileAttrReadable;
 			else
 				fh->rdflag = 0;
 
 			if (fh->wrflag != 0)
-				fh->wrflag = (mcio_dircache[1].mode >> 1) & sceMcFileAttrReadable;
+				fh->wrflag = (ctx->dircache[1].mode >> 1) & sceMcFileAttrReadable;
 			else
 				fh->wrflag = 0;
 
@@ -2651,27 +3556,27 @@ static int Card_FileOpen(const char *filename, int flags)
 		fh->parent_fsindex = cacheDir.fsindex;
 	}
 
-	r = Card_ReadDirEntry(fh->parent_cluster, fh->parent_fsindex, &fse1);
+	r = Card_ReadDirEntry(ctx, fh->parent_cluster, fh->parent_fsindex, &fse1);
 	if (r != sceMcResSucceed)
 		return r;
 
-	memcpy((void *)&mcio_dircache[2], (void *)fse1, sizeof(struct MCFsEntry));
+	memcpy((void *)&ctx->dircache[2], (void *)fse1, sizeof(struct MCFsEntry));
 
 	i = -1;
-	if (mcio_dircache[2].length == (uint32_t) cacheDir.maxent) {
+	if (ctx->dircache[2].length == (uint32_t) cacheDir.maxent) {
 
 		int32_t cluster_size = (int32_t)read_le_uint32((uint8_t *)&mcdi->cluster_size);
 
-		fsindex = mcio_dircache[2].length / (cluster_size >> 9);
-		fsoffset = mcio_dircache[2].length % (cluster_size >> 9);
+		fsindex = ctx->dircache[2].length / (cluster_size >> 9);
+		fsoffset = ctx->dircache[2].length % (cluster_size >> 9);
 
 		if (fsoffset == 0) {
-			fat_index = mcio_dircache[2].cluster;
+			fat_index = ctx->dircache[2].cluster;
 			i = fsindex;
 
-			if ((mcio_dircache[2].cluster == 0) && (i >= 2)) {
-				if (read_le_uint32((uint8_t *)&mcio_fatcache.entry[i-1]) >= 0) {
-					fat_index = read_le_uint32((uint8_t *)&mcio_fatcache.entry[i-1]);
+			if ((ctx->dircache[2].cluster == 0) && (i >= 2)) {
+				if (read_le_uint32((uint8_t *)&ctx->fatcache.entry[i-1]) >= 0) {
+					fat_index = read_le_uint32((uint8_t *)&ctx->fatcache.entry[i-1]);
 					i = 1;
 				}
 			}
@@ -2680,25 +3585,21 @@ static int Card_FileOpen(const char *filename, int flags)
 			if (i != -1) {
 
 				do {
-					r = Card_GetFatEntry(fat_index, &fat_entry);
+					r = Card_GetFatEntry(ctx, fat_index, &fat_entry);
 					if (r != sceMcResSucceed)
 						return r;
 
 					if (fat_entry >= -1) {
-						r = Card_FindFree(1);
+						r = Card_FindFree(ctx, 1);
 						if (r < 0)
 							return r;
 
 						fat_entry = r;
-						mce = *pmcio_mccache;
-
 						fat_entry |= 0x80000000;
 
-						r = Card_SetFatEntry(fat_index, fat_entry);
+						r = Card_SetFatEntry(ctx, fat_index, fat_entry);
 						if (r != sceMcResSucceed)
 							return r;
-
-						Card_AddCacheEntry(mce);
 					}
 					i--;
 					fat_index = fat_entry & 0x7fffffff;
@@ -2707,13 +3608,13 @@ static int Card_FileOpen(const char *filename, int flags)
 			}
 		}
 
-		r = Card_FlushMCCache();
+		r = Card_FlushMCCache(ctx);
 		if (r != sceMcResSucceed)
 			return r;
 
 		i = -1;
 
-		mcio_dircache[2].length++;
+		ctx->dircache[2].length++;
 	}
 
 	do {
@@ -2730,33 +3631,31 @@ static int Card_FileOpen(const char *filename, int flags)
 	mcfree = 0;
 
 	if ((flags & sceMcFileCreateDir) != 0) {
-		r = Card_FindFree(1);
+		r = Card_FindFree(ctx, 1);
 		if (r < 0)
 			return r;
 		mcfree = r;
 	}
 
-	mce = *pmcio_mccache;
-
-	mcio_getmcrtime(&mcio_dircache[2].modified);
+	mcio_getmcrtime(&ctx->dircache[2].modified);
 
-	r = Card_ReadDirEntry(mcio_dircache[2].cluster, cacheDir.maxent, &fse2);
+	r = Card_ReadDirEntry(ctx, ctx->dircache[2].cluster, cacheDir.maxent, &fse2);
 	if (r != sceMcResSucceed)
 		return r;
 
 	memset((void *)fse2, 0, sizeof(struct MCFsEntry));
 
 	strncpy((void *)fse2->name, p, 32);
+	Card_InvDirIndex(ctx, ctx->dircache[2].cluster);
 
-	uint64_t modified = read_le_uint64((uint8_t *)&mcio_dircache[2].modified);
+	uint64_t modified = read_le_uint64((uint8_t *)&ctx->dircache[2].modified);
 	append_le_uint64((uint8_t *)&fse2->created, modified);
 	append_le_uint64((uint8_t *)&fse2->modified, modified);
 
-	struct MCCacheEntry *mce_1st = (struct MCCacheEntry *)*pmcio_mccache;
+	struct MCCacheEntry *mce_1st = (struct MCCacheEntry *)ctx->mccache.next;
 	mce_1st->wr_flag = -1;
 
-	Card_AddCacheEntry(mce);
-	
+
 	if ((flags & sceMcFileCreateDir) != 0) {
 
 		uint16_t fmode = ((flags & sceMcFileAttrHidden) | sceMcFileAttrReadable | sceMcFileAttrWriteable \
@@ -2767,20 +3666,20 @@ static int Card_FileOpen(const char *filename, int flags)
 		append_le_uint32((uint8_t *)&fse2->cluster, mcfree);
 		append_le_uint32((uint8_t *)&fse2->length, 2);
 
-		r = Card_CreateDirEntry(mcio_dircache[2].cluster, cacheDir.maxent, mcfree, (struct sceMcStDateTime *)&fse2->created);
+		r = Card_CreateDirEntry(ctx, ctx->dircache[2].cluster, cacheDir.maxent, mcfree, (struct sceMcStDateTime *)&fse2->created);
 		if (r != sceMcResSucceed)
 			return -46;
 
-		r = Card_ReadDirEntry(fh->parent_cluster, fh->parent_fsindex, &fse1);
+		r = Card_ReadDirEntry(ctx, fh->parent_cluster, fh->parent_fsindex, &fse1);
 		if (r != sceMcResSucceed)
 			return r;
 
-		memcpy((void *)fse1, (void *)&mcio_dircache[2], sizeof(struct MCFsEntry));
+		memcpy((void *)fse1, (void *)&ctx->dircache[2], sizeof(struct MCFsEntry));
 
-		mce_1st = (struct MCCacheEntry *)*pmcio_mccache;
+		mce_1st = (struct MCCacheEntry *)ctx->mccache.next;
 		mce_1st->wr_flag = -1;
 
-		r = Card_FlushMCCache();
+		r = Card_FlushMCCache(ctx);
 		if (r != sceMcResSucceed)
 			return r;
 
@@ -2793,20 +3692,20 @@ static int Card_FileOpen(const char *filename, int flags)
 
 		append_le_uint16((uint8_t *)&fse2->mode, fmode);
 		append_le_uint32((uint8_t *)&fse2->cluster, -1);
-		fh->cluster = mcio_dircache[2].cluster;
+		fh->cluster = ctx->dircache[2].cluster;
 		fh->status = 1;
 		fh->fsindex = cacheDir.maxent;
 
-		r = Card_ReadDirEntry(fh->parent_cluster, fh->parent_fsindex, &fse1);
+		r = Card_ReadDirEntry(ctx, fh->parent_cluster, fh->parent_fsindex, &fse1);
 		if (r != sceMcResSucceed)
 			return r;
 
-		memcpy((void *)fse1, (void *)&mcio_dircache[2], sizeof(struct MCFsEntry));
+		memcpy((void *)fse1, (void *)&ctx->dircache[2], sizeof(struct MCFsEntry));
 
-		mce_1st = (struct MCCacheEntry *)*pmcio_mccache;
+		mce_1st = (struct MCCacheEntry *)ctx->mccache.next;
 		mce_1st->wr_flag = -1;
 
-		r = Card_FlushMCCache();
+		r = Card_FlushMCCache(ctx);
 		if (r != sceMcResSucceed)
 			return r;
 	}
@@ -2814,15 +3713,15 @@ static int Card_FileOpen(const char *filename, int flags)
 	return fd;
 }
 
-static int Card_FileClose(int fd)
+static int Card_FileClose(mcio_ctx_t *ctx, int fd)
 {
 	int r;
 	uint16_t fmode;
-	struct MCFHandle *fh = (struct MCFHandle *)&mcio_fdhandles[fd];
+	struct MCFHandle *fh = ctx->fdhandles[fd];
 	struct MCFsEntry *fse1, *fse2;
 	struct sceMcStDateTime mcio_fsmodtime;
 
-	r = Card_ReadDirEntry(fh->cluster, fh->fsindex, &fse1);
+	r = Card_ReadDirEntry(ctx, fh->cluster, fh->fsindex, &fse1);
 	if (r != sceMcResSucceed)
 		return r;
 
@@ -2838,29 +3737,29 @@ static int Card_FileClose(int fd)
 	append_le_uint32((uint8_t *)&fse1->cluster, fh->freeclink);
 	append_le_uint32((uint8_t *)&fse1->length, fh->filesize);
 
-	struct MCCacheEntry *mce = (struct MCCacheEntry *)*pmcio_mccache;
+	struct MCCacheEntry *mce = (struct MCCacheEntry *)ctx->mccache.next;
 	mce->wr_flag = -1;
 
 	append_le_uint64((uint8_t *)&mcio_fsmodtime, read_le_uint64((uint8_t *)&fse1->modified));
 
-	r = Card_ReadDirEntry(fh->parent_cluster, fh->parent_fsindex, &fse2);
+	r = Card_ReadDirEntry(ctx, fh->parent_cluster, fh->parent_fsindex, &fse2);
 	if (r != sceMcResSucceed)
 		return r;
 
 	append_le_uint64((uint8_t *)&fse2->modified, read_le_uint64((uint8_t *)&mcio_fsmodtime));
 
-	mce = (struct MCCacheEntry *)*pmcio_mccache;
+	mce = (struct MCCacheEntry *)ctx->mccache.next;
 	mce->wr_flag = -1;
 
 	return sceMcResSucceed;
 }
 
-static int Card_FileRead(int fd, void *buffer, int nbyte)
+static int Card_FileRead(mcio_ctx_t *ctx, int fd, void *buffer, int nbyte)
 {
 	int r;
 	int32_t temp, rpos, size, offset;
-	struct MCFHandle *fh = (struct MCFHandle *)&mcio_fdhandles[fd];
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	struct MCFHandle *fh = ctx->fdhandles[fd];
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 	struct MCCacheEntry *mce;
 
 	if (fh->position < fh->filesize) {
@@ -2881,20 +3780,26 @@ static int Card_FileRead(int fd, void *buffer, int nbyte)
 				else
 					size = nbyte;
 
-				r = Card_FatRSeek(fd);
+				r = Card_FatRSeek(ctx, fd);
 
 				if (r <= 0)
 					return r;
 
-				r = Card_ReadCluster(r, &mce);
-				if (r != sceMcResSucceed)
-					return r;
+				/* clean clusters of non-ECC images are copied straight from the image */
+				uint8_t *cl_data = Card_MapCluster(ctx, r, offset, size);
+				if (cl_data == NULL) {
+					r = Card_ReadCluster(ctx, r, &mce);
+					if (r != sceMcResSucceed)
+						return r;
+
+					mce->rd_flag = 1;
+					cl_data = mce->cl_data;
+				}
 
 				uint8_t *p = (uint8_t *)buffer;
-				memcpy(&p[rpos], &mce->cl_data[offset], size);
+				memcpy(&p[rpos], &cl_data[offset], size);
 
 				rpos += size;
-				mce->rd_flag = 1;
 				nbyte -= size;
 				fh->position += size;
 
@@ -2906,22 +3811,22 @@ static int Card_FileRead(int fd, void *buffer, int nbyte)
 	return 0;
 }
 
-static int Card_FileWrite(int fd, void *buffer, int nbyte)
+static int Card_FileWrite(mcio_ctx_t *ctx, int fd, void *buffer, int nbyte)
 {
 	int r, r2;
 	int32_t wpos, size, offset;
-	struct MCFHandle *fh = (struct MCFHandle *)&mcio_fdhandles[fd];
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	struct MCFHandle *fh = ctx->fdhandles[fd];
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 	struct MCCacheEntry *mce;
 
 	if (nbyte) {
 		if (fh->unknown2 == 0) {
 			fh->unknown2 = 1;
 
-			r = Card_FileClose(fd);
+			r = Card_FileClose(ctx, fd);
 			if (r != sceMcResSucceed)
 				return r;
-			r = Card_FlushMCCache();
+			r = Card_FlushMCCache(ctx);
 			if (r != sceMcResSucceed)
 				return r;
 		}
@@ -2930,24 +3835,24 @@ static int Card_FileWrite(int fd, void *buffer, int nbyte)
 	wpos = 0;
 	if (nbyte) {
 		do {
-			r = Card_FatRSeek(fd);
+			r = Card_FatRSeek(ctx, fd);
 			if (r == sceMcResFullDevice) {
 
-				r2 = Card_FatWSeek(fd);
+				r2 = Card_FatWSeek(ctx, fd);
 				if (r2 == r)
 					return sceMcResFullDevice;
 
 				if (r2 != sceMcResSucceed)
 					return r2;
 
-				r = Card_FatRSeek(fd);
+				r = Card_FatRSeek(ctx, fd);
 			}
 			else {
 				if (r < 0)
 					return r;
 			}
 
-			r = Card_ReadCluster(r, &mce);
+			r = Card_ReadCluster(ctx, r, &mce);
 			if (r != sceMcResSucceed)
 				return r;
 
@@ -2980,92 +3885,434 @@ static int Card_FileWrite(int fd, void *buffer, int nbyte)
 		} while (nbyte);
 	}
 
-	r = Card_FileClose(fd);
+	/* length, head cluster and times stay in the handle until mcio_mcSync() or mcio_mcClose() */
+	return wpos;
+}
+
+
+mcio_ctx_t *mcio_alloc(void)
+{
+	mcio_ctx_t *ctx = (mcio_ctx_t *)calloc(1, sizeof(mcio_ctx_t));
+
+	if (ctx != NULL) {
+		ctx->cache_request = MIN_CACHEENTRY;
+		ctx->fdhandles_free = -1;
+	}
+
+	return ctx;
+}
+
+void mcio_free(mcio_ctx_t *ctx)
+{
+	int i;
+
+	if (ctx == NULL)
+		return;
+
+	for (i = 0; i < ctx->fdhandles_count; i++) {
+		free(ctx->fdhandles[i]->chain);
+		free(ctx->fdhandles[i]);
+	}
+	free(ctx->fdhandles);
+
+	Card_InvDirIndex(ctx, -1);
+	Card_DropFat(ctx);
+	Card_FreeCache(ctx);
+	free(ctx->dirty);
+	free(ctx);
+}
+
+int mcio_setCacheSize(mcio_ctx_t *ctx, int entries)
+{
+	if (ctx->txn_depth > 0) { /* applied when the transaction ends */
+		ctx->txn_cache_request = entries;
+		return sceMcResSucceed;
+	}
+
+	ctx->cache_request = entries;
+
+	if (ctx->vmc_data == NULL)
+		return sceMcResSucceed;
+
+	/* already mounted: write back and rebuild the cache at the new size */
+	int r = Card_WriteBackMCCache(ctx);
 	if (r != sceMcResSucceed)
 		return r;
 
-	return wpos;
+	return Card_InitCache(ctx);
+}
+
+int mcio_setCommitMode(mcio_ctx_t *ctx, int mode)
+{
+	if ((mode != MCIO_COMMIT_BACKUP) && (mode != MCIO_COMMIT_DIRECT))
+		return sceMcResFailIO;
+
+	ctx->commit_mode = mode;
+
+	return sceMcResSucceed;
+}
+
+static int Card_EndTransaction(mcio_ctx_t *ctx)
+{
+	ctx->txn_depth = 0;
+
+	if (ctx->cache_request == ctx->txn_cache_request)
+		return sceMcResSucceed;
+
+	ctx->cache_request = ctx->txn_cache_request;
+
+	return Card_InitCache(ctx);
+}
+
+int mcio_begin(mcio_ctx_t *ctx)
+{
+	int r;
+
+	if (ctx->vmc_data == NULL)
+		return sceMcResFailIO;
+
+	if (ctx->txn_depth > 0) {
+		ctx->txn_depth++;
+		return sceMcResSucceed;
+	}
+
+	r = Card_WriteBackMCCache(ctx);
+	if (r != sceMcResSucceed)
+		return r;
+
+	/* a cache holding the whole card never evicts, so nothing reaches the image before the commit */
+	ctx->txn_cache_request = ctx->cache_request;
+	if (ctx->cache_size < (int)(ctx->vmc_size / MCIO_CLUSTERSIZE)) {
+		ctx->cache_request = 0;
+		r = Card_InitCache(ctx);
+		if (r != sceMcResSucceed) {
+			ctx->cache_request = ctx->txn_cache_request;
+			Card_InitCache(ctx);
+			return r;
+		}
+	}
+
+	ctx->txn_depth = 1;
+
+	return sceMcResSucceed;
+}
+
+int mcio_commit(mcio_ctx_t *ctx)
+{
+	int r;
+
+	if (ctx->txn_depth <= 0)
+		return sceMcResFailIO;
+
+	if (--ctx->txn_depth > 0)
+		return sceMcResSucceed;
+
+	r = Card_WriteBackMCCache(ctx);
+	if (r != sceMcResSucceed) {
+		ctx->txn_depth = 1; /* still pending, mcio_abort() can drop it */
+		return r;
+	}
+
+	return Card_EndTransaction(ctx);
 }
 
+int mcio_abort(mcio_ctx_t *ctx)
+{
+	if (ctx->txn_depth <= 0)
+		return sceMcResFailIO;
+
+	/* nothing was written back yet, forgetting the cache restores the card as it was at mcio_begin() */
+	Card_InvFileHandles(ctx);
+	Card_ClearCache(ctx);
+
+	return Card_EndTransaction(ctx);
+}
 
-int mcio_init(void* vmc, size_t size)
+int mcio_init(mcio_ctx_t *ctx, void* vmc, size_t size)
 {
 	int r;
 
-	vmc_data = vmc;
-	vmc_size = size;
-	Card_InitCache();
+	ctx->vmc_data = vmc;
+	ctx->vmc_size = size;
 
-	r = mcio_mcDetect();
+	/* sized for the smallest page, whatever the card turns out to use */
+	free(ctx->dirty);
+	ctx->dirty_pages = size / 512;
+	ctx->dirty = (uint32_t *)calloc((ctx->dirty_pages + 31) >> 5, sizeof(uint32_t));
+	if (ctx->dirty == NULL) {
+		ctx->dirty_pages = 0;
+		return sceMcResFailIO;
+	}
+
+	r = Card_InitCache(ctx);
+	if (r != sceMcResSucceed)
+		return r;
+
+	r = mcio_mcDetect(ctx);
 	if (r == sceMcResChangedCard)
 		return sceMcResSucceed;
 
 	return r;
 }
 
-int mcio_mcDetect(void)
+int mcio_getDirtyRanges(mcio_ctx_t *ctx, size_t *ranges, int max)
+{
+	uint32_t page, first;
+	int count = 0;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
+
+	uint16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
+	size_t stride = pagesize + ((mcdi->cardflags & CF_USE_ECC) ? (pagesize >> 5) : 0);
+
+	for (page = 0; page < ctx->dirty_pages; ) {
+		if (ctx->dirty[page >> 5] == 0) { /* skip clean words */
+			page = (page | 31) + 1;
+			continue;
+		}
+		if (!(ctx->dirty[page >> 5] & (1U << (page & 31)))) {
+			page++;
+			continue;
+		}
+
+		/* merge the run of consecutive dirty pages */
+		for (first = page; (page < ctx->dirty_pages) && (ctx->dirty[page >> 5] & (1U << (page & 31))); page++)
+			;
+
+		if (count < max) {
+			ranges[count * 2] = first * stride;
+			ranges[count * 2 + 1] = (page - first) * stride;
+		}
+		count++;
+	}
+
+	return count;
+}
+
+void mcio_clearDirty(mcio_ctx_t *ctx)
+{
+	if (ctx->dirty != NULL)
+		memset(ctx->dirty, 0, ((ctx->dirty_pages + 31) >> 5) * sizeof(uint32_t));
+}
+
+static const char *mcio_stat_names[MCIO_STAT_COUNT] = {
+	"cache_hit",
+	"cache_miss",
+	"page_read",
+	"page_write",
+	"ecc_check",
+	"ecc_correct",
+	"block_write",
+	"backup_write",
+	"fat_lookup",
+	"free_search",
+	"free_scan",
+	"dirent_read",
+};
+
+void mcio_setStatsTiming(mcio_ctx_t *ctx, int enable)
+{
+	ctx->stats_timing = enable;
+}
+
+void mcio_getStats(mcio_ctx_t *ctx, struct mcio_stat *stats)
+{
+	memcpy(stats, ctx->stats, sizeof(ctx->stats));
+}
+
+void mcio_resetStats(mcio_ctx_t *ctx)
+{
+	memset(ctx->stats, 0, sizeof(ctx->stats));
+}
+
+const char *mcio_statName(int stat)
+{
+	if ((stat < 0) || (stat >= MCIO_STAT_COUNT))
+		return NULL;
+
+	return mcio_stat_names[stat];
+}
+
+int mcio_mcDetect(mcio_ctx_t *ctx)
 {
 	int r=0;
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 
 	if ((mcdi->cardtype == sceMcTypeNoCard) || (mcdi->cardtype == sceMcTypePS2)) {
-		r = Card_Probe();
+		r = Card_Probe(ctx);
 		if (!(r < -9)) {
 			mcdi->cardtype = sceMcTypePS2;
 			return r;
 		}
 	}
 
-	mcdi->cardtype = 0;
-	append_le_uint32((uint8_t *)&mcdi->cardform, 0);
-	Card_InvFileHandles();
-	Card_ClearCache();
+	mcdi->cardtype = 0;
+	append_le_uint32((uint8_t *)&mcdi->cardform, 0);
+	Card_InvFileHandles(ctx);
+	Card_ClearCache(ctx);
+
+	return r;
+}
+
+static int Card_FileOpen(mcio_ctx_t *ctx, const char *filename, int flags)
+{
+	int r, fd;
+
+	fd = Card_AllocHandle(ctx);
+	if (fd < 0)
+		return fd;
+
+	r = Card_FileOpenHandle(ctx, fd, filename, flags);
+
+	/* failed opens and mkdir leave no handle behind */
+	if ((r < 0) || (ctx->fdhandles[fd]->status == 0))
+		Card_ReleaseHandle(ctx, fd);
+
+	return r;
+}
+
+int mcio_mcOpen(mcio_ctx_t *ctx, const char *filename, int flag)
+{
+	int r;
+
+	r = mcio_mcDetect(ctx);
+	if (r != sceMcResSucceed)
+		return r;
+
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
+	if ((int32_t)read_le_uint32((uint8_t *)&mcdi->cardform) == sceMcResNoFormat)
+		return sceMcResNoFormat;
+
+	r = Card_FileOpen(ctx, filename, flag);
+	if (r < -9) {
+		Card_InvFileHandles(ctx);
+		Card_ClearCache(ctx);
+	}
+
+	return r;
+}
+
+int mcio_mcOpenAt(mcio_ctx_t *ctx, int dirfd, const char *name, int flag)
+{
+	int r, fd;
+	int32_t fsindex, cluster, length;
+	uint16_t mode = 0;
+	struct MCFHandle *fh, *dh;
+	struct MCFsEntry *fse = NULL;
+
+	dh = Card_Handle(ctx, dirfd);
+	if ((dh == NULL) || !dh->status || !dh->drdflag)
+		return sceMcResDeniedPermit;
+
+	/* lookups only, creating or writing an entry still goes through the full path */
+	if (flag & (sceMcFileAttrWriteable | sceMcFileCreateFile | sceMcFileCreateDir))
+		return sceMcResDeniedPermit;
+
+	r = mcio_mcDetect(ctx);
+	if (r != sceMcResSucceed)
+		return r;
+
+	/* usually the entry mcio_mcDread() just returned, otherwise scan the directory */
+	fsindex = (int32_t)dh->position - 1;
+	for (r = -1; r < (int32_t)dh->filesize; fsindex = ++r) {
+		if ((fsindex < 0) || (fsindex >= (int32_t)dh->filesize))
+			continue;
+
+		if (Card_ReadDirEntry(ctx, dh->freeclink, fsindex, &fse) != sceMcResSucceed)
+			return sceMcResFailReadCluster;
+
+		mode = read_le_uint16((uint8_t *)&fse->mode);
+		if ((mode & sceMcFileAttrExists) && !strncmp(fse->name, name, 32))
+			break;
+	}
+	if (r == (int32_t)dh->filesize)
+		return sceMcResNoEntry;
+
+	cluster = read_le_uint32((uint8_t *)&fse->cluster);
+	length = read_le_uint32((uint8_t *)&fse->length);
+
+	if ((mode & sceMcFileAttrSubdir) && !(flag & sceMcFileAttrSubdir))
+		return sceMcResNotFile;
+
+	if (!(mode & sceMcFileAttrReadable) && (mode & sceMcFileAttrSubdir))
+		return sceMcResDeniedPermit;
+
+	fd = Card_AllocHandle(ctx);
+	if (fd < 0)
+		return fd;
+
+	fh = ctx->fdhandles[fd];
+
+	fh->cluster = dh->freeclink;
+	fh->fsindex = fsindex;
+	fh->freeclink = cluster;
+	fh->clink = cluster;
+	fh->filesize = length;
+
+	/* the "." entry of the directory points back at its own entry */
+	r = Card_ReadDirEntry(ctx, dh->freeclink, 0, &fse);
+	if (r != sceMcResSucceed) {
+		Card_ReleaseHandle(ctx, fd);
+		return r;
+	}
+
+	fh->parent_cluster = read_le_uint32((uint8_t *)&fse->cluster);
+	fh->parent_fsindex = read_le_uint32((uint8_t *)&fse->dir_entry);
+
+	if (mode & sceMcFileAttrSubdir)
+		fh->drdflag = 1;
+	else
+		fh->rdflag = (flag & sceMcFileAttrReadable) ? (mode & sceMcFileAttrReadable) : 0;
 
-	return r;
+	fh->status = 1;
+
+	return fd;
 }
 
-int mcio_mcOpen(const char *filename, int flag)
+int mcio_mcFstat(mcio_ctx_t *ctx, int fd, struct io_dirent *dirent)
 {
 	int r;
+	struct MCFHandle *fh;
+	struct MCFsEntry *fse;
+
+	fh = Card_Handle(ctx, fd);
+	if ((fh == NULL) || !fh->status)
+		return sceMcResDeniedPermit;
 
-	r = mcio_mcDetect();
+	r = mcio_mcDetect(ctx);
 	if (r != sceMcResSucceed)
 		return r;
 
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
-	if ((int32_t)read_le_uint32((uint8_t *)&mcdi->cardform) == sceMcResNoFormat)
-		return sceMcResNoFormat;
+	r = Card_ReadDirEntry(ctx, fh->cluster, fh->fsindex, &fse);
+	if (r != sceMcResSucceed)
+		return r;
 
-	r = Card_FileOpen(filename, flag);
-	if (r < -9) {
-		Card_InvFileHandles();
-		Card_ClearCache();
-	}
+	mcio_copy_dirent(dirent, fse);
 
-	return r;
+	/* a file being written has its length in the handle until it is synced */
+	if (!fh->drdflag)
+		dirent->stat.size = fh->filesize;
+
+	return sceMcResSucceed;
 }
 
-int mcio_mcClose(int fd)
+int mcio_mcClose(mcio_ctx_t *ctx, int fd)
 {
 	int r;
 	struct MCFHandle *fh;
 
-	if (!(fd < MAX_FDHANDLES))
+	fh = Card_Handle(ctx, fd);
+	if ((fh == NULL) || !fh->status)
 		return sceMcResDeniedPermit;
 
-	fh = (struct MCFHandle *)&mcio_fdhandles[fd];
-	if (!fh->status)
-		return sceMcResDeniedPermit;
-
-	fh->status = 0;
-	r = mcio_mcDetect();
+	Card_ReleaseHandle(ctx, fd);
+	r = mcio_mcDetect(ctx);
 	if (r != sceMcResSucceed)
 		return r;
 
-	r = Card_FlushMCCache();
+	r = Card_FlushMCCache(ctx);
 	if (r < -9) {
-		Card_InvFileHandles();
-		Card_ClearCache();
+		Card_InvFileHandles(ctx);
+		Card_ClearCache(ctx);
 	}
 
 	if (r != sceMcResSucceed)
@@ -3073,103 +4320,214 @@ int mcio_mcClose(int fd)
 
 	if (fh->unknown2 != 0) {
 		fh->unknown2 = 0;
-		r = Card_FileClose(fd);
+		r = Card_FileClose(ctx, fd);
 		if (r < -9) {
-			Card_InvFileHandles();
-			Card_ClearCache();
+			Card_InvFileHandles(ctx);
+			Card_ClearCache(ctx);
 		}
 
 		if (r != sceMcResSucceed)
 			return r;
 	}
 
-	r = Card_FlushMCCache();
+	r = Card_FlushMCCache(ctx);
 	if (r < -9) {
-		Card_InvFileHandles();
-		Card_ClearCache();
+		Card_InvFileHandles(ctx);
+		Card_ClearCache(ctx);
 	}
 
 	return r;
 }
 
-int mcio_mcRead(int fd, void *buf, int length)
+int mcio_mcRead(mcio_ctx_t *ctx, int fd, void *buf, int length)
 {
 	int r;
 	struct MCFHandle *fh;
 
-	if (!(fd < MAX_FDHANDLES))
+	fh = Card_Handle(ctx, fd);
+	if ((fh == NULL) || !fh->status)
 		return sceMcResDeniedPermit;
 
-	fh = (struct MCFHandle *)&mcio_fdhandles[fd];
-	if (!fh->status)
+	if (!fh->rdflag)
 		return sceMcResDeniedPermit;
 
-	if (!fh->rdflag)
+	/* no re-probe: the handle was opened on a detected card, and whatever
+	 * drops the file system (failed detect, format, abort) releases it */
+	r = Card_FileRead(ctx, fd, buf, length);
+	if (r < 0) {
+		Card_ReleaseHandle(ctx, fd);
+	}
+
+	if (r < -9) {
+		Card_InvFileHandles(ctx);
+		Card_ClearCache(ctx);
+	}
+
+	return r;
+}
+
+static int Card_FileReadWhole(mcio_ctx_t *ctx, int fd, void *buf, int length) /* read from the start and close */
+{
+	int r;
+	int32_t rpos, size, offset, fat_index;
+	struct MCFHandle *fh = ctx->fdhandles[fd];
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
+
+	int32_t cluster_size = (int32_t)read_le_uint32((uint8_t *)&mcdi->cluster_size);
+	int32_t alloc_offset = (int32_t)read_le_uint32((uint8_t *)&mcdi->alloc_offset);
+
+	if (length > (int32_t)fh->filesize)
+		length = fh->filesize;
+
+	r = sceMcResSucceed;
+	for (rpos = 0; rpos < length; rpos += size) {
+		offset = rpos % cluster_size;
+		size = cluster_size - offset;
+		if (size > length - rpos)
+			size = length - rpos;
+
+		fat_index = Card_FileChain(ctx, fh, rpos / cluster_size);
+		if (fat_index < 0) {
+			r = fat_index;
+			break;
+		}
+
+		r = Card_CopyCluster(ctx, fat_index + alloc_offset, (uint8_t *)buf + rpos, offset, size);
+		if (r != sceMcResSucceed)
+			break;
+	}
+
+	mcio_mcClose(ctx, fd);
+
+	if (r < -9) {
+		Card_InvFileHandles(ctx);
+		Card_ClearCache(ctx);
+	}
+
+	return (r < 0) ? r : rpos;
+}
+
+int mcio_mcReadFile(mcio_ctx_t *ctx, const char *filename, void *buf, int length)
+{
+	int fd;
+
+	fd = mcio_mcOpen(ctx, filename, sceMcFileAttrReadable | sceMcFileAttrFile);
+	if (fd < 0)
+		return fd;
+
+	return Card_FileReadWhole(ctx, fd, buf, length);
+}
+
+int mcio_mcReadFileAt(mcio_ctx_t *ctx, int dirfd, const char *name, void *buf, int length)
+{
+	int fd;
+
+	fd = mcio_mcOpenAt(ctx, dirfd, name, sceMcFileAttrReadable | sceMcFileAttrFile);
+	if (fd < 0)
+		return fd;
+
+	return Card_FileReadWhole(ctx, fd, buf, length);
+}
+
+int mcio_mcWrite(mcio_ctx_t *ctx, int fd, void *buf, int length)
+{
+	int r;
+	struct MCFHandle *fh;
+
+	fh = Card_Handle(ctx, fd);
+	if ((fh == NULL) || !fh->status)
 		return sceMcResDeniedPermit;
 
-	r = mcio_mcDetect();
-	if (r != sceMcResSucceed)
-		return r;
+	if (!fh->wrflag)
+		return sceMcResDeniedPermit;
 
-	r = Card_FileRead(fd, buf, length);
+	/* no re-probe, as in mcio_mcRead() */
+	r = Card_FileWrite(ctx, fd, buf, length);
 	if (r < 0) {
-		fh->status = 0;
+		/* the handle is dropped, record what was written so far */
+		if ((r >= -9) && (fh->unknown2 != 0) && (Card_FileClose(ctx, fd) == sceMcResSucceed))
+			Card_FlushMCCache(ctx);
+		Card_ReleaseHandle(ctx, fd);
 	}
 
 	if (r < -9) {
-		Card_InvFileHandles();
-		Card_ClearCache();
+		Card_InvFileHandles(ctx);
+		Card_ClearCache(ctx);
 	}
 
 	return r;
 }
 
-int mcio_mcWrite(int fd, void *buf, int length)
+int mcio_mcAllocate(mcio_ctx_t *ctx, int fd, int size)
 {
 	int r;
+	int32_t cluster_size;
 	struct MCFHandle *fh;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 
-	if (!(fd < MAX_FDHANDLES))
+	fh = Card_Handle(ctx, fd);
+	if ((fh == NULL) || !fh->status)
 		return sceMcResDeniedPermit;
 
-	fh = (struct MCFHandle *)&mcio_fdhandles[fd];
-	if (!fh->status)
+	if (!fh->wrflag)
 		return sceMcResDeniedPermit;
 
-	if (!fh->wrflag)
+	if (size < 0)
 		return sceMcResDeniedPermit;
 
-	r = mcio_mcDetect();
+	r = mcio_mcDetect(ctx);
 	if (r != sceMcResSucceed)
 		return r;
 
-	r = Card_FileWrite(fd, buf, length);
-	if (r < 0)
-		fh->status = 0;
+	if (size == 0)
+		return sceMcResSucceed;
+
+	cluster_size = (int32_t)read_le_uint32((uint8_t *)&mcdi->cluster_size);
+
+	r = Card_FatAllocate(ctx, fd, (size + cluster_size - 1) / cluster_size);
 
 	if (r < -9) {
-		Card_InvFileHandles();
-		Card_ClearCache();
+		Card_InvFileHandles(ctx);
+		Card_ClearCache(ctx);
 	}
 
 	return r;
 }
 
-int mcio_mcSeek(int fd, int offset, int origin)
+int mcio_mcSync(mcio_ctx_t *ctx, int fd)
 {
 	int r;
 	struct MCFHandle *fh;
 
-	if (!(fd < MAX_FDHANDLES))
+	fh = Card_Handle(ctx, fd);
+	if ((fh == NULL) || !fh->status)
 		return sceMcResDeniedPermit;
 
-	fh = (struct MCFHandle *)&mcio_fdhandles[fd];
-	if (!fh->status)
-		return sceMcResDeniedPermit;
+	/* no re-probe, as in mcio_mcRead(); the directory entry keeps its not-closed mode until mcio_mcClose() */
+	if (fh->unknown2 != 0) {
+		r = Card_FileClose(ctx, fd);
+		if (r == sceMcResSucceed)
+			r = Card_FlushMCCache(ctx);
+	}
+	else
+		r = Card_FlushMCCache(ctx);
 
-	r = mcio_mcDetect();
-	if (r != sceMcResSucceed)
-		return r;
+	if (r < -9) {
+		Card_InvFileHandles(ctx);
+		Card_ClearCache(ctx);
+	}
+
+	return r;
+}
+
+int mcio_mcSeek(mcio_ctx_t *ctx, int fd, int offset, int origin)
+{
+	int r;
+	struct MCFHandle *fh;
+
+	fh = Card_Handle(ctx, fd);
+	if ((fh == NULL) || !fh->status)
+		return sceMcResDeniedPermit;
 
 	switch (origin) {
 		default:
@@ -3187,51 +4545,51 @@ int mcio_mcSeek(int fd, int offset, int origin)
 	return fh->position = (r < 0) ? 0 : r;
 }
 
-int mcio_mcStat(const char *filename, struct io_dirent *dirent)
+int mcio_mcStat(mcio_ctx_t *ctx, const char *filename, struct io_dirent *dirent)
 {
 	int r, fd;
 	struct MCFsEntry *pfse;
 	struct MCCacheEntry *pmce;
 
-	fd = mcio_mcOpen(filename, sceMcFileAttrSubdir | sceMcFileAttrReadable);
+	fd = mcio_mcOpen(ctx, filename, sceMcFileAttrSubdir | sceMcFileAttrReadable);
 	if (fd < 0)
 		return fd;
 
-	struct MCFHandle *fh = (struct MCFHandle *)&mcio_fdhandles[fd];
+	struct MCFHandle *fh = ctx->fdhandles[fd];
 
-	r = Card_ReadDirEntry(fh->cluster, fh->fsindex, &pfse);
+	r = Card_ReadDirEntry(ctx, fh->cluster, fh->fsindex, &pfse);
 	if (r < 0) {
-		mcio_mcClose(fd);
+		mcio_mcClose(ctx, fd);
 		return r;
 	}
 
 	mcio_copy_dirent(dirent, pfse);
-	r = mcio_mcClose(fd);
+	r = mcio_mcClose(ctx, fd);
 
 	return r;
 }
 
-int mcio_mcSetStat(const char *filename, const struct io_dirent *dirent)
+int mcio_mcSetStat(mcio_ctx_t *ctx, const char *filename, const struct io_dirent *dirent)
 {
 	int r, fd;
 	struct MCFsEntry *pfse, *pfse2;
 	struct MCCacheEntry *pmce;
 
-	fd = mcio_mcOpen(filename, sceMcFileAttrSubdir | sceMcFileAttrReadable);
+	fd = mcio_mcOpen(ctx, filename, sceMcFileAttrSubdir | sceMcFileAttrReadable);
 	if (fd < 0)
 		return fd;
 
-	struct MCFHandle *fh = (struct MCFHandle *)&mcio_fdhandles[fd];
+	struct MCFHandle *fh = ctx->fdhandles[fd];
 
-	int32_t cluster = Card_GetDirEntryCluster(fh->cluster, fh->fsindex);
-	r = Card_ReadDirEntry(fh->cluster, fh->fsindex, &pfse2);
+	int32_t cluster = Card_GetDirEntryCluster(ctx, fh->cluster, fh->fsindex);
+	r = Card_ReadDirEntry(ctx, fh->cluster, fh->fsindex, &pfse2);
 	if (r < 0) {
-		mcio_mcClose(fd);
+		mcio_mcClose(ctx, fd);
 		return r;
 	}
-	mcio_mcClose(fd);
+	mcio_mcClose(ctx, fd);
 
-	r = Card_ReadCluster(cluster, &pmce);
+	r = Card_ReadCluster(ctx, cluster, &pmce);
 	if (r < 0)
 		return r;
 
@@ -3243,65 +4601,66 @@ int mcio_mcSetStat(const char *filename, const struct io_dirent *dirent)
 
 	mcio_copy_mcentry(pfse, dirent);
 	pmce->wr_flag = 1;
+	Card_InvDirIndex(ctx, fh->cluster);
 
-	r = Card_FlushMCCache();
+	r = Card_FlushMCCache(ctx);
 	if (r != sceMcResSucceed)
 		return r;
 
 	return r;
 }
 
-int mcio_mcCreateCrossLinkedFile(const char *real_filepath, const char *dummy_filepath)
+int mcio_mcCreateCrossLinkedFile(mcio_ctx_t *ctx, const char *real_filepath, const char *dummy_filepath)
 {
 	int r, fd;
 	struct MCFsEntry *pfse;
 	struct MCCacheEntry *pmce;
 
-	fd = mcio_mcOpen(real_filepath, sceMcFileAttrFile | sceMcFileAttrReadable);
+	fd = mcio_mcOpen(ctx, real_filepath, sceMcFileAttrFile | sceMcFileAttrReadable);
 	if (fd < 0)
 		return fd;
 
-	struct MCFHandle *fh = (struct MCFHandle *)&mcio_fdhandles[fd];
+	struct MCFHandle *fh = ctx->fdhandles[fd];
 	if (fh->drdflag) {
-		mcio_mcClose(fd);
+		mcio_mcClose(ctx, fd);
 		return sceMcResNotFile;
 	}
 
-	r = Card_ReadDirEntry(fh->cluster, fh->fsindex, &pfse);
+	r = Card_ReadDirEntry(ctx, fh->cluster, fh->fsindex, &pfse);
 	if (r < 0) {
-		mcio_mcClose(fd);
+		mcio_mcClose(ctx, fd);
 		return r;
 	}
 
 	int32_t real_file_cluster = read_le_uint32((uint8_t *)&pfse->cluster);
 	int32_t real_file_length = read_le_uint32((uint8_t *)&pfse->length);
 
-	mcio_mcClose(fd);
+	mcio_mcClose(ctx, fd);
 
-	fd = mcio_mcOpen(dummy_filepath, sceMcFileAttrWriteable | sceMcFileCreateFile | sceMcFileAttrFile);
+	fd = mcio_mcOpen(ctx, dummy_filepath, sceMcFileAttrWriteable | sceMcFileCreateFile | sceMcFileAttrFile);
 	if (fd < 0)
 		return fd;
 
-	fh = (struct MCFHandle *)&mcio_fdhandles[fd];
+	fh = ctx->fdhandles[fd];
 
-	r = Card_ReadDirEntry(fh->cluster, fh->fsindex, &pfse);
+	r = Card_ReadDirEntry(ctx, fh->cluster, fh->fsindex, &pfse);
 	if (r < 0) {
-		mcio_mcClose(fd);
+		mcio_mcClose(ctx, fd);
 		return r;
 	}
 
 	char dummy_filename[33];
 	strncpy(dummy_filename, pfse->name, 32);
 
-	int32_t cluster = Card_GetDirEntryCluster(fh->cluster, fh->fsindex);
+	int32_t cluster = Card_GetDirEntryCluster(ctx, fh->cluster, fh->fsindex);
 	if (r < 0) {
-		mcio_mcClose(fd);
+		mcio_mcClose(ctx, fd);
 		return r;
 	}
 
-	mcio_mcClose(fd);
+	mcio_mcClose(ctx, fd);
 
-	r = Card_ReadCluster(cluster, &pmce);
+	r = Card_ReadCluster(ctx, cluster, &pmce);
 	if (r < 0)
 		return r;
 
@@ -3316,22 +4675,22 @@ int mcio_mcCreateCrossLinkedFile(const char *real_filepath, const char *dummy_fi
 
 	pmce->wr_flag = 1;
 
-	r = Card_FlushMCCache();
+	r = Card_FlushMCCache(ctx);
 	if (r != sceMcResSucceed)
 		return r;
 
 	return r;
 }
 
-int mcio_mcDopen(const char *dirname)
+int mcio_mcDopen(mcio_ctx_t *ctx, const char *dirname)
 {
 	int r;
 
-	r = mcio_mcOpen(dirname, sceMcFileAttrSubdir);
+	r = mcio_mcOpen(ctx, dirname, sceMcFileAttrSubdir);
 	if (r >= 0) {
-		struct MCFHandle *fh = (struct MCFHandle *)&mcio_fdhandles[r];
+		struct MCFHandle *fh = ctx->fdhandles[r];
 		if (!fh->drdflag) {
-			mcio_mcClose(r);
+			mcio_mcClose(ctx, r);
 			return sceMcResNotDir;
 		}
 	}
@@ -3339,27 +4698,35 @@ int mcio_mcDopen(const char *dirname)
 	return r;
 }
 
-int mcio_mcDclose(int fd)
+int mcio_mcDclose(mcio_ctx_t *ctx, int fd)
 {
 	int r;
 
-	r = mcio_mcClose(fd);
+	r = mcio_mcClose(ctx, fd);
 
 	return r;
 }
 
-int mcio_mcDread(int fd, struct io_dirent *dirent)
+int mcio_mcDread(mcio_ctx_t *ctx, int fd, struct io_dirent *dirent)
+{
+	return mcio_mcDreadPos(ctx, fd, dirent, NULL);
+}
+
+int mcio_mcDreadPos(mcio_ctx_t *ctx, int fd, struct io_dirent *dirent, struct mcio_dirpos *pos)
 {
 	int r;
-	struct MCFHandle *fh = (struct MCFHandle *)&mcio_fdhandles[fd];
+	struct MCFHandle *fh = Card_Handle(ctx, fd);
 	struct MCFsEntry *fse;
 	uint16_t mode;
 
+	if ((fh == NULL) || !fh->status || !fh->drdflag)
+		return sceMcResDeniedPermit;
+
 	if (fh->position >= fh->filesize)
 		return 0;
 
 	do {
-		r = Card_ReadDirEntry(fh->freeclink, fh->position, &fse);
+		r = Card_ReadDirEntry(ctx, fh->freeclink, fh->position, &fse);
 		if (r != sceMcResSucceed)
 			return r;
 
@@ -3373,6 +4740,11 @@ int mcio_mcDread(int fd, struct io_dirent *dirent)
 	if (fh->position >= fh->filesize)
 		return 0;
 
+	if (pos != NULL) {
+		pos->cluster = fh->freeclink;
+		pos->fsindex = fh->position;
+	}
+
 	fh->position++;
 	memset((void *)dirent, 0, sizeof(struct io_dirent));
 	strncpy(dirent->name, fse->name, 32);
@@ -3417,23 +4789,84 @@ int mcio_mcDread(int fd, struct io_dirent *dirent)
 	return 1;
 }
 
-int mcio_mcMkDir(const char *dirname)
+static int Card_Walk(mcio_ctx_t *ctx, int dirfd, char *path, size_t len, mcio_walk_cb cb, void *arg)
+{
+	int r, fd;
+	struct io_dirent dirent;
+	struct mcio_dirpos pos;
+	struct MCFsEntry *fse;
+
+	while ((r = mcio_mcDreadPos(ctx, dirfd, &dirent, &pos)) > 0) {
+		if (!strcmp(dirent.name, ".") || !strcmp(dirent.name, ".."))
+			continue;
+
+		/* the entry as mcio_mcStat() reports it, without resolving its path */
+		r = Card_ReadDirEntry(ctx, pos.cluster, pos.fsindex, &fse);
+		if (r != sceMcResSucceed)
+			return r;
+		mcio_copy_dirent(&dirent, fse);
+
+		snprintf(path + len, MCIO_PATH_MAX - len, "%s%s", (len && path[len - 1] != '/') ? "/" : "", dirent.name);
+
+		r = cb(ctx, dirfd, path, &dirent, arg);
+		if (r < 0)
+			return r;
+
+		if ((r == 0) && (dirent.stat.mode & sceMcFileAttrSubdir)) {
+			fd = mcio_mcOpenAt(ctx, dirfd, dirent.name, sceMcFileAttrSubdir);
+			if (fd < 0)
+				return fd;
+
+			r = Card_Walk(ctx, fd, path, strlen(path), cb, arg);
+			mcio_mcDclose(ctx, fd);
+			if (r < 0)
+				return r;
+		}
+
+		path[len] = 0;
+	}
+
+	return r;
+}
+
+int mcio_mcWalk(mcio_ctx_t *ctx, const char *dirname, mcio_walk_cb cb, void *arg)
+{
+	int r, fd;
+	size_t len;
+	char path[MCIO_PATH_MAX];
+
+	fd = mcio_mcDopen(ctx, dirname);
+	if (fd < 0)
+		return fd;
+
+	/* reported paths start with dirname */
+	snprintf(path, sizeof(path), "%s", dirname);
+	for (len = strlen(path); (len > 1) && (path[len - 1] == '/'); len--)
+		path[len - 1] = 0;
+
+	r = Card_Walk(ctx, fd, path, len, cb, arg);
+	mcio_mcDclose(ctx, fd);
+
+	return r;
+}
+
+int mcio_mcMkDir(mcio_ctx_t *ctx, const char *dirname)
 {
-	return mcio_mcOpen(dirname, 0x40);
+	return mcio_mcOpen(ctx, dirname, 0x40);
 }
 
-int mcio_mcGetInfo(int *pagesize, int *blocksize, int *cardsize, int *cardflags)
+int mcio_mcGetInfo(mcio_ctx_t *ctx, int *pagesize, int *blocksize, int *cardsize, int *cardflags)
 {
 	int r;
 
-	r = mcio_mcDetect();
+	r = mcio_mcDetect(ctx);
 	if (r != sceMcResSucceed)
 		return r;
 
 	uint8_t _cardflags;
 	uint16_t _pagesize, _blocksize;
 	int32_t _cardsize;
-	if (Card_GetSpecs(&_pagesize, &_blocksize, &_cardsize, &_cardflags) != sceMcResSucceed)
+	if (Card_GetSpecs(ctx, &_pagesize, &_blocksize, &_cardsize, &_cardflags) != sceMcResSucceed)
 		return r;
 
 	*pagesize = (int)_pagesize;
@@ -3444,19 +4877,19 @@ int mcio_mcGetInfo(int *pagesize, int *blocksize, int *cardsize, int *cardflags)
 	return 0;
 }
 
-int mcio_mcGetAvailableSpace(int *cardfree)
+int mcio_mcGetAvailableSpace(mcio_ctx_t *ctx, int *cardfree)
 {
 	int r;
 
-	r = mcio_mcDetect();
+	r = mcio_mcDetect(ctx);
 	if (r != sceMcResSucceed)
 		return r;
 
-	struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 	if ((int32_t)read_le_uint32((uint8_t *)&mcdi->cardform) == sceMcResNoFormat)
 		return sceMcResNoFormat;
 
-	r = Card_FindFree(0);
+	r = Card_FindFree(ctx, 0);
 	if (r == sceMcResFullDevice)
 		*cardfree = 0;
 	else if (r < 0)
@@ -3467,85 +4900,375 @@ int mcio_mcGetAvailableSpace(int *cardfree)
 	return 0;
 }
 
-int mcio_mcReadPage(int pagenum, void *buf, void *ecc)
+int mcio_mcReadPage(mcio_ctx_t *ctx, int pagenum, void *buf, void *ecc)
 {
 	int r;
 
-	r = Card_ReadPage((int32_t)pagenum, (uint8_t *)buf);
+	r = Card_ReadPage(ctx, (int32_t)pagenum, (uint8_t *)buf);
 
 	if (ecc)
 	{
-		struct MCDevInfo *mcdi = (struct MCDevInfo *)&mcio_devinfo;
+		struct MCDevInfo *mcdi = (struct MCDevInfo *)&ctx->devinfo;
 		uint16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
 		uint8_t* p_ecc = ecc;
 
 		memset(ecc, 0, pagesize >> 5);
-		for (int size = 0; size < pagesize; size += 128, p_ecc += 3)
-			Card_DataChecksum(buf + size, p_ecc);
+		Card_PageChecksum(buf, p_ecc, pagesize >> 7);
+	}
+
+	return r;
+}
+
+/* worst Card_CorrectData() result over the page, the caller's copy of the data is corrected in place */
+static int Card_ScrubPage(uint8_t *pagebuf, uint8_t *eccbuf, int pagesize)
+{
+	int r, index, ecres = sceMcResSucceed;
+
+	for (index = 0; index < (pagesize >> 7); index++) {
+		r = Card_CorrectData(pagebuf + (index << 7), eccbuf + (index * 3));
+		if (r < ecres)
+			ecres = r;
+	}
+
+	return ecres;
+}
+
+/* page range split in batches handed out to a set of threads, the calling thread being worker 0 */
+struct MCPagePool {
+	int32_t pages;
+	int32_t next;			/* first page of the next batch, shared by the workers */
+	int workers;
+	void (*fn)(void *arg, int worker, int32_t first, int32_t last);
+	void *arg;
+};
+
+struct MCPageWorker {
+	struct MCPagePool *pool;
+	int index;
+	pthread_t thread;
+};
+
+#define POOL_BATCH	256
+
+static int Card_PoolWorkers(int32_t pages, int threads) /* threads <= 0 uses one per CPU */
+{
+	if (threads <= 0)
+		threads = cpu_count();
+	if (threads > (pages + POOL_BATCH - 1) / POOL_BATCH)
+		threads = (pages + POOL_BATCH - 1) / POOL_BATCH;
+
+	return (threads < 1) ? 1 : threads;
+}
+
+static void *Card_PoolWorker(void *arg)
+{
+	struct MCPageWorker *w = (struct MCPageWorker *)arg;
+	struct MCPagePool *pool = w->pool;
+	int32_t first, last;
+
+	while ((first = __atomic_fetch_add(&pool->next, POOL_BATCH, __ATOMIC_RELAXED)) < pool->pages) {
+		last = (first + POOL_BATCH < pool->pages) ? first + POOL_BATCH : pool->pages;
+		pool->fn(pool->arg, w->index, first, last);
+	}
+
+	return NULL;
+}
+
+static int Card_PoolRun(struct MCPagePool *pool)
+{
+	struct MCPageWorker *w;
+	int i, started;
+
+	w = calloc(pool->workers, sizeof(struct MCPageWorker));
+	if (w == NULL)
+		return sceMcResFailIO;
+
+	pool->next = 0;
+	for (i = 0; i < pool->workers; i++) {
+		w[i].pool = pool;
+		w[i].index = i;
+	}
+
+	/* a worker that fails to start just leaves more batches to the others */
+	for (started = 1; started < pool->workers; started++) {
+		if (pthread_create(&w[started].thread, NULL, Card_PoolWorker, &w[started]) != 0)
+			break;
+	}
+	Card_PoolWorker(&w[0]);
+	for (i = 1; i < started; i++)
+		pthread_join(w[i].thread, NULL);
+
+	free(w);
+
+	return sceMcResSucceed;
+}
+
+struct MCScrubJob {
+	mcio_ctx_t *ctx;
+	int repair;
+	uint8_t *status;
+	struct mcio_ecc_stats *stats;	/* one per worker */
+};
+
+static void Card_ScrubPages(void *arg, int worker, int32_t first, int32_t last)
+{
+	struct MCScrubJob *job = (struct MCScrubJob *)arg;
+	struct mcio_ecc_stats *stats = &job->stats[worker];
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&job->ctx->devinfo;
+	uint8_t pagebuf[1024], eccbuf[32];
+	uint8_t *p_page;
+	int32_t page;
+	int r, res;
+
+	uint16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
+	int sparesize = pagesize >> 5;
+	int erase_byte = (mcdi->cardflags & CF_ERASE_ZEROES) ? 0x00 : 0xFF;
+
+	for (page = first; page < last; page++) {
+		p_page = &job->ctx->vmc_data[page * (pagesize + sparesize)];
+
+		/*
+		 * only a page that is erased as a whole, spare included: the last spare byte alone
+		 * (the Card_ReadPage() test) is zero padding in every page written by a CF_ERASE_ZEROES card
+		 */
+		if (p_page[0] == erase_byte && !memcmp(p_page, p_page + 1, pagesize + sparesize - 1)) {
+			res = MCIO_ECC_ERASED;
+			stats->erased++;
+		}
+		else {
+			memcpy(pagebuf, p_page, pagesize);
+			memcpy(eccbuf, p_page + pagesize, sparesize);
+
+			r = Card_ScrubPage(pagebuf, eccbuf, pagesize);
+			if (r == sceMcResSucceed) {
+				res = MCIO_ECC_OK;
+				stats->ok++;
+			}
+			else if (r < -2) {
+				res = MCIO_ECC_UNCORRECTABLE;
+				stats->uncorrectable++;
+			}
+			else {
+				res = MCIO_ECC_CORRECTABLE;
+				stats->correctable++;
+
+				if (job->repair) {
+					/* a flipped data bit is fixed in pagebuf, a flipped ECC bit by regenerating the spare */
+					memcpy(p_page, pagebuf, pagesize);
+					Card_PageChecksum(pagebuf, p_page + pagesize, pagesize >> 7);
+					Card_MarkDirty(job->ctx, page, 1);
+					stats->repaired++;
+				}
+			}
+		}
+
+		if (job->status)
+			job->status[page] = res;
+	}
+}
+
+int mcio_mcVerifyECC(mcio_ctx_t *ctx, int repair, int threads, struct mcio_ecc_stats *stats, uint8_t *status)
+{
+	struct MCScrubJob job;
+	struct MCPagePool pool;
+	uint8_t cardflags;
+	uint16_t pagesize, blocksize;
+	int32_t cardsize;
+	int r, i;
+
+	if (ctx->txn_depth > 0) /* the write back below would put uncommitted clusters in the image */
+		return sceMcResDeniedPermit;
+
+	r = Card_GetSpecs(ctx, &pagesize, &blocksize, &cardsize, &cardflags);
+	if (r != sceMcResSucceed)
+		return r;
+
+	if (!(cardflags & CF_USE_ECC) || (pagesize > 1024))
+		return sceMcResFailIO;
+
+	/* pages still in the cluster cache must hit the image before it is scanned */
+	r = Card_WriteBackMCCache(ctx);
+	if (r != sceMcResSucceed)
+		return r;
+
+	pool.pages = cardsize;
+	if ((size_t)pool.pages > ctx->vmc_size / (pagesize + (pagesize >> 5)))
+		pool.pages = ctx->vmc_size / (pagesize + (pagesize >> 5));
+	pool.workers = Card_PoolWorkers(pool.pages, threads);
+	pool.fn = Card_ScrubPages;
+	pool.arg = &job;
+
+	job.ctx = ctx;
+	job.repair = repair;
+	job.status = status;
+	job.stats = calloc(pool.workers, sizeof(struct mcio_ecc_stats));
+	if (job.stats == NULL)
+		return sceMcResFailIO;
+
+	uint64_t start = Card_StatStart(ctx);
+
+	r = Card_PoolRun(&pool);
+
+	memset(stats, 0, sizeof(struct mcio_ecc_stats));
+	stats->pages = pool.pages;
+	for (i = 0; i < pool.workers; i++) {
+		stats->ok += job.stats[i].ok;
+		stats->erased += job.stats[i].erased;
+		stats->correctable += job.stats[i].correctable;
+		stats->uncorrectable += job.stats[i].uncorrectable;
+		stats->repaired += job.stats[i].repaired;
 	}
+	free(job.stats);
+
+	/* the workers scan the image directly, their pages are accounted for here */
+	Card_Stat(ctx, MCIO_STAT_PAGE_READ, pool.pages, 0);
+	Card_Stat(ctx, MCIO_STAT_PAGE_WRITE, stats->repaired, 0);
+	Card_Stat(ctx, MCIO_STAT_ECC_CORRECT, stats->correctable, 0);
+	Card_Stat(ctx, MCIO_STAT_ECC_CHECK, (uint64_t)(stats->ok + stats->correctable + stats->uncorrectable) * (pagesize >> 7), start);
+
+	/* cached clusters and FAT were read through the old data */
+	if (stats->repaired)
+		Card_ClearCache(ctx);
 
 	return r;
 }
 
-int mcio_mcUnformat(void)
+struct MCReadJob {
+	mcio_ctx_t *ctx;
+	int32_t first;
+	int ecc;
+	uint8_t *buf;
+	int result;
+};
+
+static void Card_ReadPages(void *arg, int worker, int32_t first, int32_t last)
+{
+	struct MCReadJob *job = (struct MCReadJob *)arg;
+	struct MCDevInfo *mcdi = (struct MCDevInfo *)&job->ctx->devinfo;
+	uint8_t *p_page;
+	int32_t page;
+	int r;
+
+	uint16_t pagesize = read_le_uint16((uint8_t *)&mcdi->pagesize);
+	int stride = pagesize + (job->ecc ? (pagesize >> 5) : 0);
+
+	(void)worker;
+
+	/* same output as mcio_mcReadPage() page after page */
+	for (page = first; page < last; page++) {
+		p_page = job->buf + (page * stride);
+
+		r = Card_ReadPage(job->ctx, job->first + page, p_page);
+		if (r != sceMcResSucceed)
+			__atomic_store_n(&job->result, r, __ATOMIC_RELAXED);
+
+		if (job->ecc) {
+			memset(p_page + pagesize, 0, pagesize >> 5);
+			Card_PageChecksum(p_page, p_page + pagesize, pagesize >> 7);
+		}
+	}
+}
+
+int mcio_mcReadPages(mcio_ctx_t *ctx, int first, int count, void *buf, int ecc, int threads)
+{
+	struct MCReadJob job;
+	struct MCPagePool pool;
+	int r;
+
+	if (ctx->txn_depth > 0) /* same as mcio_mcVerifyECC(), an abort could not drop what gets written back */
+		return sceMcResDeniedPermit;
+
+	r = Card_WriteBackMCCache(ctx);
+	if (r != sceMcResSucceed)
+		return r;
+
+	job.ctx = ctx;
+	job.first = first;
+	job.ecc = ecc;
+	job.buf = (uint8_t *)buf;
+	job.result = sceMcResSucceed;
+
+	pool.pages = count;
+	pool.workers = Card_PoolWorkers(count, threads);
+	pool.fn = Card_ReadPages;
+	pool.arg = &job;
+
+	r = Card_PoolRun(&pool);
+	if (r != sceMcResSucceed)
+		return r;
+
+	return job.result;
+}
+
+int mcio_mcUnformat(mcio_ctx_t *ctx)
 {
 	int r;
 
-	r = mcio_mcDetect();
+	if (ctx->txn_depth > 0) /* erases blocks of the image directly, could not be rolled back */
+		return sceMcResDeniedPermit;
+
+	r = mcio_mcDetect(ctx);
 	if (r != sceMcResSucceed)
 		return r;
 
-	r = Card_Unformat();
+	Card_InvFileHandles(ctx); /* open handles belong to the old file system */
+
+	r = Card_Unformat(ctx);
 	if (r != sceMcResSucceed)
 		return r;
 
 	return 0;
 }
 
-int mcio_mcFormat(void)
+int mcio_mcFormat(mcio_ctx_t *ctx)
 {
 	int r;
 
-	r = mcio_mcDetect();
+	if (ctx->txn_depth > 0) /* erases blocks of the image directly, could not be rolled back */
+		return sceMcResDeniedPermit;
+
+	r = mcio_mcDetect(ctx);
 	if (r != sceMcResSucceed)
 		return r;
 
-	r = Card_Format();
+	Card_InvFileHandles(ctx); /* open handles belong to the old file system */
+
+	r = Card_Format(ctx);
 	if (r != sceMcResSucceed)
 		return r;
 
 	return 0;
 }
 
-int mcio_mcRemove(const char *filename)
+int mcio_mcRemove(mcio_ctx_t *ctx, const char *filename)
 {
 	int r;
 
-	r = mcio_mcDetect();
+	r = mcio_mcDetect(ctx);
 	if (r != sceMcResSucceed)
 		return r;
 
-	r = Card_Delete(filename, 0);
+	r = Card_Delete(ctx, filename, 0);
 	if (r < -9) {
-		Card_InvFileHandles();
-		Card_ClearCache();
+		Card_InvFileHandles(ctx);
+		Card_ClearCache(ctx);
 	}
 
 	return r;
 }
 
-int mcio_mcRmDir(const char *dirname)
+int mcio_mcRmDir(mcio_ctx_t *ctx, const char *dirname)
 {
 	int r;
 
-	r = mcio_mcDetect();
+	r = mcio_mcDetect(ctx);
 	if (r != sceMcResSucceed)
 		return r;
 
-	r = Card_Delete(dirname, 0);
+	r = Card_Delete(ctx, dirname, 0);
 	if (r < -9) {
-		Card_InvFileHandles();
-		Card_ClearCache();
+		Card_InvFileHandles(ctx);
+		Card_ClearCache(ctx);
 	}
 
 	return r;
@@ -27,11 +27,39 @@ static ps1mcData_t ps1saves[PS1CARD_MAX_SLOTS];
 //Save comments (supported by .gme files only), 255 characters allowed
 static char saveComments[PS1CARD_MAX_SLOTS][256];
 
+//Performance counters, timed only when enabled
+static ps1CardStat_t cardStats[PS1STAT_COUNT];
+static int cardStatsTiming = 0;
+static const char* cardStatNames[PS1STAT_COUNT] = {
+    "card_read",
+    "card_decode",
+    "card_rebuild",
+    "card_write",
+    "checksum",
+    "link_walk",
+    "free_scan",
+    "icon_decode",
+};
+
 //AES-CBC key and IV for MCX memory cards
 static const uint8_t mcxKey[] = { 0x81, 0xD9, 0xCC, 0xE9, 0x71, 0xA9, 0x49, 0x9B, 0x04, 0xAD, 0xDC, 0x48, 0x30, 0x7F, 0x07, 0x92 };
 static const uint8_t mcxIv[]  = { 0x13, 0xC2, 0xE7, 0x69, 0x4B, 0xEC, 0x69, 0x6D, 0x52, 0xCF, 0x00, 0x09, 0x2A, 0xC1, 0xF2, 0x72 };
 
 
+//Start time for addCardStat(), 0 while timing is off
+static uint64_t cardStatStart(void)
+{
+    return cardStatsTiming ? clock_ns() : 0;
+}
+
+//Account count events of a counter, timed from start
+static void addCardStat(int stat, uint64_t count, uint64_t start)
+{
+    cardStats[stat].count += count;
+    if (start)
+        cardStats[stat].ns += clock_ns() - start;
+}
+
 //Encrypts a buffer using AES CBC 128
 static void AesCbcEncrypt(uint8_t* toEncrypt, size_t len, const uint8_t* key, const uint8_t* iv)
 {
@@ -67,6 +95,7 @@ static void loadDataFromRawCard(void)
 static void loadDataToRawCard(bool fixData)
 {
     uint8_t* tmpMemoryCard;
+    uint64_t start = cardStatStart();
 
     //Skip fixing data if it's not needed
     if (!fixData) return;
@@ -109,6 +138,7 @@ static void loadDataToRawCard(bool fixData)
 
     memcpy(rawMemoryCard, tmpMemoryCard, PS1CARD_SIZE);
     free(tmpMemoryCard);
+    addCardStat(PS1STAT_CARD_REBUILD, 1, start);
     return;
 }
 
@@ -238,6 +268,7 @@ static void setArHeader(const char* saveName, FILE* fp)
 static void calculateXOR(void)
 {
     uint8_t XORchecksum = 0;
+    uint64_t start = cardStatStart();
 
     //Cycle through each slot
     for (int slotNumber = 0; slotNumber < PS1CARD_MAX_SLOTS; slotNumber++)
@@ -252,6 +283,8 @@ static void calculateXOR(void)
         //Store checksum in 128th byte
         ps1saves[slotNumber].headerData[127] = XORchecksum;
     }
+
+    addCardStat(PS1STAT_CHECKSUM, PS1CARD_MAX_SLOTS, start);
 }
 
 //Load region of the saves
@@ -483,6 +516,7 @@ static int findSaveLinks(int initialSlotNumber, int* tempSlotList)
 {
     int j = 0;
     int currentSlot = initialSlotNumber;
+    uint64_t start = cardStatStart();
 
     //Maximum number of cycles is 15
     for (int i = 0; i < PS1CARD_MAX_SLOTS; i++)
@@ -501,6 +535,8 @@ static int findSaveLinks(int initialSlotNumber, int* tempSlotList)
         else currentSlot = ps1saves[currentSlot].headerData[8];
     }
 
+    addCardStat(PS1STAT_LINK_WALK, j, start);
+
     //Return int array
     return j;
 }
@@ -614,12 +650,16 @@ void formatSave(int slotNumber)
 //Find and return continuous free slots
 static int findFreeSlots(int slotCount, int* tempSlotList)
 {
+    int examined = 0;
+    uint64_t start = cardStatStart();
+
     //Cycle through available slots
     for (int j, slotNumber = 0; slotNumber < PS1CARD_MAX_SLOTS; slotNumber++)
     {
         j = 0;
         for (int i = slotNumber; i < (slotNumber + slotCount); i++)
         {
+            examined++;
             if (ps1saves[i].saveType == PS1BLOCK_FORMATTED) tempSlotList[j++]=i;
             else break;
 
@@ -628,9 +668,13 @@ static int findFreeSlots(int slotCount, int* tempSlotList)
         }
 
         if (j >= slotCount)
+        {
+            addCardStat(PS1STAT_FREE_SCAN, examined, start);
             return j;
+        }
     }
 
+    addCardStat(PS1STAT_FREE_SCAN, examined, start);
     return 0;
 }
 
@@ -671,8 +715,8 @@ int setSaveBytes(const uint8_t* saveBytes, int saveBytes_Length, int* reqSlots)
     *reqSlots = slotCount;
     freeSlots_Length = findFreeSlots(slotCount, freeSlots);
 
-    //Check if there are enough free slots for the operation
-    if (freeSlots_Length < slotCount) return false;
+    //Check if there is a save and enough free slots for the operation
+    if (slotCount < 1 || freeSlots_Length < slotCount) return false;
 
     //Place header data
     memcpy(ps1saves[freeSlots[0]].headerData, saveBytes, PS1CARD_HEADER_SIZE);
@@ -749,6 +793,7 @@ static void setHeaderData(int slotNumber, const char* sProdCode, const char* sId
 uint8_t* getIconRGBA(int slotNumber, int frame)
 {
     uint32_t* iconBytes;
+    uint64_t start = cardStatStart();
 
     if (frame >= ps1saves[slotNumber].iconFrames)
         return NULL;
@@ -759,6 +804,8 @@ uint8_t* getIconRGBA(int slotNumber, int frame)
     for (int i = 0; i < 256; i++)
         iconBytes[i] = ps1saves[slotNumber].iconPalette[ps1saves[slotNumber].iconData[frame][i]];
 
+    addCardStat(PS1STAT_ICON_DECODE, 1, start);
+
     return (uint8_t*) iconBytes;
 }
 
@@ -936,6 +983,7 @@ int openSingleSave(const char* fileName, int* requiredSlots)
 int saveMemoryCard(const char* fileName, int memoryCardType, int fixData)
 {
     FILE* binWriter = NULL;
+    uint64_t start = cardStatStart();
 
     binWriter = fopen(fileName, "wb");
     //Check if the file is allowed to be opened for writing
@@ -989,6 +1037,7 @@ int saveMemoryCard(const char* fileName, int memoryCardType, int fixData)
     //File is sucesfully saved, close the stream
     fclose(binWriter);
 
+    addCardStat(PS1STAT_CARD_WRITE, 1, start);
     return true;
 }
 
@@ -1012,6 +1061,33 @@ ps1mcData_t* getMemoryCardData(void)
     return ps1saves;
 }
 
+//Time the counted events too
+void setMemoryCardStatsTiming(int enable)
+{
+    cardStatsTiming = enable;
+}
+
+//Get the performance counters
+const ps1CardStat_t* getMemoryCardStats(void)
+{
+    return cardStats;
+}
+
+//Reset the performance counters
+void resetMemoryCardStats(void)
+{
+    memset(cardStats, 0, sizeof(cardStats));
+}
+
+//Get the name of a performance counter
+const char* getMemoryCardStatName(int stat)
+{
+    if (stat < 0 || stat >= PS1STAT_COUNT)
+        return NULL;
+
+    return cardStatNames[stat];
+}
+
 //Open memory card from the given byte stream
 void openMemoryCardStream(const uint8_t* memCardData, int fixData)
 {
@@ -1021,6 +1097,8 @@ void openMemoryCardStream(const uint8_t* memCardData, int fixData)
     //Load Memory Card data from raw card
     loadDataFromRawCard();
 
+    uint64_t start = cardStatStart();
+
     if(fixData) calculateXOR();
     loadStringData();
     loadSlotTypes();
@@ -1030,6 +1108,8 @@ void openMemoryCardStream(const uint8_t* memCardData, int fixData)
     loadIconFrames();
     loadIcons();
 
+    addCardStat(PS1STAT_CARD_DECODE, PS1CARD_MAX_SLOTS, start);
+
     //Since the stream is of the unknown origin Memory Card is treated as edited
     changedFlag = true;
 }
@@ -1037,6 +1117,8 @@ void openMemoryCardStream(const uint8_t* memCardData, int fixData)
 //Open Memory Card from the given filename (return error message if operation is not sucessfull)
 int openMemoryCard(const char* fileName, int fixData)
 {
+    uint64_t start = cardStatStart();
+
     //Check if the Memory Card should be opened or created
     if (fileName != NULL)
     {
@@ -1065,6 +1147,8 @@ int openMemoryCard(const char* fileName, int fixData)
         //File is sucesfully read, close the stream
         fclose(binReader);
 
+        addCardStat(PS1STAT_CARD_READ, 1, start);
+
         //Store the location of the Memory Card
 //        cardLocation = fileName;
 
@@ -1124,6 +1208,8 @@ int openMemoryCard(const char* fileName, int fixData)
         changedFlag = false;
     }
 
+    start = cardStatStart();
+
     //Calculate XOR checksum (in case if any of the saveHeaders have corrputed XOR)
     if(fixData) calculateXOR();
 
@@ -1148,6 +1234,8 @@ int openMemoryCard(const char* fileName, int fixData)
     //Load icon data to bitmaps
     loadIcons();
 
+    addCardStat(PS1STAT_CARD_DECODE, PS1CARD_MAX_SLOTS, start);
+
     //Everything went well, no error messages
     return 1;
 }
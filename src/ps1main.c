@@ -60,7 +60,10 @@ static void print_usage(int argc, char **argv)
 	printf("Copyright (C) 2024 - by Bucanero\n");
 	printf("based on MemcardRex by ShendoXT\n\n");
 	printf("Usage:\n");
-	printf("%s <VMC filepath> <command> [<arguments>]\n", argv[0]);
+	printf("%s <VMC filepath> [<options>] <command> [<arguments>]\n", argv[0]);
+	printf("\n");
+	printf("Options:\n");
+	printf("\t --stats[=json]   report the card library counters on stderr\n");
 	printf("\n");
 	printf("Available commands:\n");
 	printf("\t --mc-info, -i\n");
@@ -81,6 +84,24 @@ static void print_usage(int argc, char **argv)
 	printf("\n");
 }
 
+static void print_card_stats(FILE *fp, int json, uint64_t elapsed)
+{
+	const ps1CardStat_t *stats = getMemoryCardStats();
+	const char *names[PS1STAT_COUNT];
+	uint64_t count[PS1STAT_COUNT], ns[PS1STAT_COUNT];
+	int i;
+
+	for (i = 0; i < PS1STAT_COUNT; i++) {
+		names[i] = getMemoryCardStatName(i);
+		count[i] = stats[i].count;
+		ns[i] = stats[i].ns;
+	}
+
+	print_stats(fp, json, names, count, ns, PS1STAT_COUNT, elapsed);
+	if (json)
+		fputc('\n', fp);
+}
+
 static int cmd_icons(const char* slot)
 {
 	uint8_t *icon;
@@ -276,11 +297,19 @@ static int cmd_remove(const char *slot)
 
 int main(int argc, char **argv)
 {
-	int r, cmd = CMD_NONE;
+	int r, cmd = CMD_NONE, stats = STATS_NONE;
 	char **cmd_args = NULL;
+	uint64_t start = clock_ns();
 
 	printf(PROGRAM_NAME " v" PROGRAM_VER "\n");
 
+	/* options between the VMC path and the command */
+	while (argc > 2 && (r = parse_stats_option(argv[2])) != STATS_NONE) {
+		stats = r;
+		memmove(&argv[2], &argv[3], (argc - 2) * sizeof(char *));
+		argc--;
+	}
+
 	if (argc-- < 3) {
 		print_usage(argc, argv);
 		return 1;
@@ -392,6 +421,8 @@ int main(int argc, char **argv)
 		}
 	}
 
+	setMemoryCardStatsTiming(stats != STATS_NONE);
+
 	r = openMemoryCard(argv[1], 0);
 
 	if (!r) {
@@ -470,6 +501,12 @@ int main(int argc, char **argv)
 		printf("VMC file saved: %s\n", argv[1]);
 	}
 
+	/* load and save included */
+	if (stats != STATS_NONE) {
+		fflush(stdout);
+		print_card_stats(stderr, stats == STATS_JSON, clock_ns() - start);
+	}
+
 	if (r < 0)
 		return 1;
 
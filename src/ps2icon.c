@@ -107,7 +107,7 @@ static void* ps2IconTexture(const uint8_t* iData)
 }
 
 //Get icon data as bytes
-uint8_t* getIconPS2(const char* folder, const char* iconfile)
+uint8_t* getIconPS2(mcio_ctx_t *ctx, const char* folder, const char* iconfile)
 {
 	int fd;
 	uint8_t *buf, *out;
@@ -115,15 +115,15 @@ uint8_t* getIconPS2(const char* folder, const char* iconfile)
 	struct io_dirent st;
 
 	snprintf(filePath, sizeof(filePath), "%s/%s", folder, iconfile);
-	mcio_mcStat(filePath, &st);
+	mcio_mcStat(ctx, filePath, &st);
 
-	fd = mcio_mcOpen(filePath, sceMcFileAttrReadable | sceMcFileAttrFile);
+	fd = mcio_mcOpen(ctx, filePath, sceMcFileAttrReadable | sceMcFileAttrFile);
 	if (fd < 0)
 		return calloc(128 * 128, sizeof(uint32_t));
 
 	buf = malloc(st.stat.size);
-	mcio_mcRead(fd, buf, st.stat.size);
-	mcio_mcClose(fd);
+	mcio_mcRead(ctx, fd, buf, st.stat.size);
+	mcio_mcClose(ctx, fd);
 
 	out = ps2IconTexture(buf);
 	free(buf);
@@ -19,6 +19,18 @@
 
 #include "util.h"
 
+#include <stdarg.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 void memrcpy(void *dst, void *src, size_t len)
 {
 	size_t i;
@@ -153,3 +165,301 @@ int write_buffer(const char *file_path, uint8_t *buf, size_t size)
 
 	return 0;
 }
+
+/*
+ * replace_buffer: write a whole file through a temporary file in the same
+ * directory, synced and then renamed over file_path, so that the file is
+ * always found either with its old or with its new content.
+ */
+int replace_buffer(const char *file_path, uint8_t *buf, size_t size)
+{
+#ifdef _WIN32
+	return write_buffer(file_path, buf, size);
+#else
+	int fd, r = -1;
+	size_t done;
+	ssize_t n;
+	struct stat st;
+	char *tmp_path, *p;
+
+	tmp_path = malloc(strlen(file_path) + 8);
+	if (tmp_path == NULL)
+		return -1;
+
+	sprintf(tmp_path, "%s.XXXXXX", file_path);
+	if ((fd = mkstemp(tmp_path)) < 0) {
+		free(tmp_path);
+		return -1;
+	}
+
+	if (stat(file_path, &st) == 0)
+		fchmod(fd, st.st_mode & 07777);
+
+	for (done = 0; done < size; done += n) {
+		n = write(fd, buf + done, size - done);
+		if (n <= 0)
+			break;
+	}
+
+	if (done == size && fsync(fd) == 0 && close(fd) == 0) {
+		fd = -1;
+		if (rename(tmp_path, file_path) == 0)
+			r = 0;
+	}
+
+	if (fd >= 0)
+		close(fd);
+	if (r < 0) {
+		unlink(tmp_path);
+		free(tmp_path);
+		return r;
+	}
+
+	/* make the rename itself durable */
+	p = strrchr(tmp_path, '/');
+	if (p)
+		p[(p == tmp_path) ? 1 : 0] = 0;
+	else
+		strcpy(tmp_path, ".");
+
+	if ((fd = open(tmp_path, O_RDONLY)) >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	free(tmp_path);
+
+	return 0;
+#endif
+}
+
+/*
+ * update_buffer: write back only count offset/length pairs of buf to an
+ * existing file, then flush the file data (not its metadata) to storage.
+ */
+int update_buffer(const char *file_path, const uint8_t *buf, const size_t *ranges, int count)
+{
+	int i;
+#ifdef _WIN32
+	FILE *fp;
+
+	if ((fp = fopen(file_path, "r+b")) == NULL)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		if (fseek(fp, ranges[i * 2], SEEK_SET) != 0 ||
+			fwrite(buf + ranges[i * 2], 1, ranges[i * 2 + 1], fp) != ranges[i * 2 + 1]) {
+			fclose(fp);
+			return -1;
+		}
+	}
+
+	return (fclose(fp) == 0) ? 0 : -1;
+#else
+	int fd, r = 0;
+	size_t done;
+	ssize_t n;
+
+	if ((fd = open(file_path, O_WRONLY)) < 0)
+		return -1;
+
+	for (i = 0; (i < count) && (r == 0); i++) {
+		for (done = 0; done < ranges[i * 2 + 1]; done += n) {
+			n = pwrite(fd, buf + ranges[i * 2] + done, ranges[i * 2 + 1] - done, ranges[i * 2] + done);
+			if (n <= 0) {
+				r = -1;
+				break;
+			}
+		}
+	}
+
+	if (r == 0 && count > 0 && fdatasync(fd) < 0)
+		r = -1;
+	if (close(fd) < 0)
+		r = -1;
+
+	return r;
+#endif
+}
+
+/*
+ * map_buffer: map a whole file in memory. Changes made to the buffer are
+ * kept private (copy-on-write), they only reach the file when it is saved.
+ */
+int map_buffer(const char *file_path, uint8_t **buf, size_t *size)
+{
+#ifdef _WIN32
+	(void)file_path;
+	(void)buf;
+	(void)size;
+	return -1;
+#else
+	int fd;
+	void *map;
+	struct stat st;
+
+	if ((fd = open(file_path, O_RDONLY)) < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return -1;
+
+	*buf = (uint8_t *)map;
+	*size = st.st_size;
+
+	return 0;
+#endif
+}
+
+/*
+ * unmap_buffer: release a buffer returned by map_buffer.
+ */
+int unmap_buffer(uint8_t *buf, size_t size)
+{
+#ifdef _WIN32
+	(void)buf;
+	(void)size;
+	return -1;
+#else
+	return munmap(buf, size);
+#endif
+}
+
+/*
+ * clock_ns: monotonic timestamp in nanoseconds, for measuring intervals.
+ */
+uint64_t clock_ns(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+
+	return (uint64_t)((double)count.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * cpu_count: number of online processors, 1 when it can't be told.
+ */
+int cpu_count(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	return (si.dwNumberOfProcessors > 0) ? (int)si.dwNumberOfProcessors : 1;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (n > 0) ? (int)n : 1;
+#endif
+}
+
+/*
+ * strbuf_printf: append formatted text to a growable string. A failed
+ * append sets sb->failed and leaves the string as it was.
+ */
+void strbuf_printf(struct strbuf *sb, const char *fmt, ...)
+{
+	va_list ap;
+	size_t size;
+	char *p;
+	int n;
+
+	if (sb->failed)
+		return;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (n < 0) {
+		sb->failed = 1;
+		return;
+	}
+
+	if (sb->len + n + 1 > sb->size) {
+		for (size = sb->size ? sb->size : 128; size < sb->len + n + 1; size *= 2)
+			;
+
+		p = realloc(sb->buf, size);
+		if (p == NULL) {
+			sb->failed = 1;
+			return;
+		}
+		sb->buf = p;
+		sb->size = size;
+	}
+
+	va_start(ap, fmt);
+	vsnprintf(sb->buf + sb->len, sb->size - sb->len, fmt, ap);
+	va_end(ap);
+	sb->len += n;
+}
+
+/*
+ * format_stats: n named counters with the time spent behind each, as a
+ * JSON object appended to sb, elapsed_ns beside them.
+ */
+void format_stats(struct strbuf *sb, const char **names, const uint64_t *count, const uint64_t *ns, int n, uint64_t elapsed_ns)
+{
+	int i;
+
+	strbuf_printf(sb, "{\"elapsed_ns\":%" PRIu64, elapsed_ns);
+	for (i = 0; i < n; i++)
+		strbuf_printf(sb, ",\"%s\":{\"count\":%" PRIu64 ",\"ns\":%" PRIu64 "}", names[i], count[i], ns[i]);
+	strbuf_printf(sb, "}");
+}
+
+/*
+ * parse_stats_option: STATS_TEXT or STATS_JSON for a --stats[=json]
+ * argument, STATS_NONE for anything else.
+ */
+int parse_stats_option(const char *arg)
+{
+	if (!strcmp(arg, "--stats"))
+		return STATS_TEXT;
+	if (!strcmp(arg, "--stats=json"))
+		return STATS_JSON;
+
+	return STATS_NONE;
+}
+
+/*
+ * print_stats: report n named counters with the time spent behind each,
+ * as a table or as a JSON object left open on its line.
+ */
+void print_stats(FILE *fp, int json, const char **names, const uint64_t *count, const uint64_t *ns, int n, uint64_t elapsed_ns)
+{
+	int i;
+
+	if (json) {
+		struct strbuf sb = { NULL, 0, 0, 0 };
+
+		format_stats(&sb, names, count, ns, n, elapsed_ns);
+		if (!sb.failed)
+			fputs(sb.buf, fp);
+		free(sb.buf);
+		return;
+	}
+
+	fprintf(fp, "Stats: %.3f ms elapsed\n", elapsed_ns / 1e6);
+	fprintf(fp, "  %-16s %12s %12s %10s\n", "counter", "count", "ms", "ns/op");
+	for (i = 0; i < n; i++)
+		fprintf(fp, "  %-16s %12" PRIu64 " %12.3f %10" PRIu64 "\n", names[i], count[i], ns[i] / 1e6,
+			count[i] ? ns[i] / count[i] : 0);
+}